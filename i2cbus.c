@@ -1,326 +1,2893 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <linux/i2c-dev.h>
+#include <linux/i2c.h>
 #include <errno.h>
 #include <stdint.h>
+#include <limits.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#undef I2CBUS_INLINE_CHECKS // the library provides the out-of-line versions
 #include "i2cbus.h"
+#include "i2cbus_trace_priv.h"
+#include "i2cbus_fairlock_priv.h"
+#include "i2cbus_log.h"
+
+#ifdef eprintf
+#undef eprintf
+#endif
+
+#define eprintf(str, ...) I2CBUS_LOG(str, ##__VA_ARGS__)
+
+#ifdef __GNUC__
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#else
+#define likely(x) (x)
+#define unlikely(x) (x)
+#endif
+
+/**
+ * @brief Runtime statistics of a bus. All counters are only modified by
+ * the holder of the bus lock, so they are updated with plain (relaxed)
+ * loads and stores; readers take lock-free snapshots.
+ *
+ */
+struct i2cbus_counters
+{
+    atomic_ullong transactions;                         ///< I2C_RDWR and I2C_SMBUS calls
+    atomic_ullong bytes_out;                            ///< Bytes written
+    atomic_ullong bytes_in;                             ///< Bytes read
+    atomic_ullong errors;                               ///< Failed transactions
+    atomic_ullong nacks;                                ///< Failed with ENXIO or EREMOTEIO
+    atomic_ullong pec_errors;                           ///< Transfers that received a bad PEC byte
+    atomic_ullong retries;                              ///< Transfers repeated by the retry policy
+    atomic_ullong deadline_misses;                      ///< Deadline calls given up with ETIMEDOUT (atomic, lock not held)
+    atomic_ullong aged;                                 ///< Requests run ahead of a higher class by aging (written by the worker)
+    atomic_ullong errno_count[I2CBUS_STATS_ERRNO_MAX];  ///< Failed transactions by errno
+    atomic_ullong lock_acquisitions;                    ///< Bus lock acquisitions
+    atomic_ullong lock_contended;                       ///< Acquisitions that had to wait
+    atomic_ullong lock_wait_ns;                         ///< Total time spent waiting for the lock
+    atomic_ullong lock_recovered;                       ///< Acquisitions that recovered the lock from a dead holder
+    atomic_ullong xfer_ns;                              ///< Total time spent in transfers
+    atomic_ullong xfer_hist[I2CBUS_STATS_HIST_BUCKETS]; ///< Transfer time histogram
+};
+
+/**
+ * @brief State of a /dev/i2c-X bus, shared by all devices on the bus.
+ * Created the first time the bus is opened and kept for the lifetime of
+ * the process, so the bus lock is never destroyed while a thread may be
+ * waiting on it. Only the file descriptor follows the device count.
+ *
+ */
+struct i2cbus_state
+{
+    pthread_mutex_t *mtx; ///< Bus lock: lock, or the lock of the bus in the shared lock segment
+    pthread_mutex_t lock; ///< Process-local bus lock
+    i2cbus_fairlock *fair; ///< Bus lock in fair mode (&flock, used instead of mtx), NULL otherwise
+    i2cbus_fairlock flock; ///< FIFO bus lock
+    int id;               ///< Bus index (X in /dev/i2c-X)
+    int fd;               ///< Bus file descriptor (backend handle), -1 when no device is open and the worker has stopped
+    int refs;             ///< Number of open devices on the bus, protected by lock
+    const i2cbus_backend *be; ///< Transport backend of the open bus, protected by lock
+    int slave_addr;           ///< Address bound to fd with I2C_SLAVE, -1 if none, protected by lock
+    int pec;                  ///< Kernel PEC state of fd (I2C_PEC), protected by lock
+    unsigned long funcs;      ///< Adapter functionality (I2C_FUNCS), queried when fd is opened
+    i2cbus_policy policy;     ///< Timeout and retry policy of devices without their own, protected by lock
+    int timeout_ms;           ///< I2C_TIMEOUT last set on fd, 0 if never, protected by lock
+    int retries;              ///< I2C_RETRIES last set on fd, -1 if never, protected by lock
+    atomic_ullong byte_ns;    ///< EWMA of the transaction time per wire byte (ns << I2CBUS_EWMA_FRAC), written by the lock holder
+    struct i2cbus_counters stats; ///< Runtime statistics, written by the lock holder
+    // asynchronous request queue (intrusive MPSC), drained by the bus worker
+    _Atomic(i2cbus_req *) qhead; ///< Most recently submitted request
+    i2cbus_req *qtail;           ///< Oldest request, owned by the worker
+    i2cbus_req qstub;            ///< Queue stub node
+    atomic_int worker;           ///< Non-zero while the worker thread runs, protected by i2cbus_worker_lock
+    atomic_int stop;             ///< Set to make the worker exit once its queue is empty
+    pthread_t worker_thread;     ///< Worker thread, valid while worker is set
+    atomic_int sleeping;         ///< Non-zero while the worker waits on wakefd
+    int wakefd;                  ///< eventfd used to wake the worker, -1 while no worker runs
+    atomic_ullong aging_ns;      ///< Aging interval of the worker scheduler, 0 for strict priority
+};
+
+/**
+ * @brief Table of bus states indexed by bus id. The table is replaced by
+ * a larger copy when a bus id beyond its end is opened; retired tables are
+ * kept on the prev chain so that lock-free readers never see freed memory.
+ * Neither tables nor bus states are ever freed.
+ *
+ */
+struct i2cbus_table
+{
+    size_t size;                           ///< Number of slots
+    struct i2cbus_table *prev;             ///< Previous (smaller) table
+    _Atomic(struct i2cbus_state *) slot[]; ///< Bus states, NULL for buses never opened
+};
+
+#ifndef I2CBUS_TABLE_MIN
+#define I2CBUS_TABLE_MIN 8 /// Initial number of slots in the bus table
+#endif
+
+static _Atomic(struct i2cbus_table *) i2cbus_table = NULL; /// Current bus table
+static pthread_mutex_t i2cbus_table_lock = PTHREAD_MUTEX_INITIALIZER; /// Serializes bus table updates
+static pthread_mutex_t i2cbus_worker_lock = PTHREAD_MUTEX_INITIALIZER; /// Serializes starting and stopping bus workers
+static __thread struct i2cbus_state *i2cbus_worker_self = NULL; /// Bus whose worker is the calling thread, NULL on other threads
+static pthread_mutexattr_t i2cbus_lock_attr; /// Attribute for bus locks (recursive)
+static pthread_mutexattr_t i2cbus_shm_attr; /// Attribute for shared bus locks (recursive, process-shared, robust)
+static int i2cbus_lock_protocol = PTHREAD_PRIO_NONE; /// Protocol of bus locks created next, protected by i2cbus_table_lock
+static int i2cbus_lock_fair = 0; /// Non-zero if bus locks created next are FIFO locks, protected by i2cbus_table_lock
+static pthread_once_t i2cbus_init_once = PTHREAD_ONCE_INIT; /// Guards one-time library initialization
+static int i2cbus_init_status = 0; /// Result of library initialization, 0 on success
+
+#ifndef I2CBUS_SHM_SLOTS
+#define I2CBUS_SHM_SLOTS 64 /// Number of bus locks in a shared lock segment
+#endif
+
+/**
+ * @brief Slot of the shared lock segment, holding the lock of one bus.
+ *
+ */
+struct i2cbus_shm_slot
+{
+    atomic_int key;       ///< Bus index + 1, 0 while the slot is free
+    atomic_int ready;     ///< 1 once the lock is initialized, -1 if that failed
+    pthread_mutex_t lock; ///< Bus lock (recursive, process-shared, robust)
+};
+
+/**
+ * @brief Shared lock segment: the bus locks of every process that maps
+ * the same named shared memory object. A bus claims a slot by swapping
+ * its key in, probing linearly from the bus index.
+ *
+ */
+struct i2cbus_shm
+{
+    atomic_uint magic; ///< I2CBUS_SHM_MAGIC once a process has mapped the segment
+    struct i2cbus_shm_slot slot[I2CBUS_SHM_SLOTS]; ///< Bus locks
+};
+
+#define I2CBUS_SHM_MAGIC (0x69320000u | (unsigned int)sizeof(struct i2cbus_shm)) /// Identifies the segment layout
+
+static struct i2cbus_shm *i2cbus_shm = NULL; /// Shared lock segment, NULL for process-local bus locks, protected by i2cbus_table_lock
+
+/**
+ * @brief One-time library initialization, run through pthread_once().
+ *
+ */
+static void i2cbus_init(void)
+{
+    int ret = pthread_mutexattr_init(&i2cbus_lock_attr);
+    if (ret)
+    {
+        eprintf("Could not initialize mutex attribute");
+        i2cbus_init_status = -1;
+        return;
+    }
+    ret = pthread_mutexattr_settype(&i2cbus_lock_attr, PTHREAD_MUTEX_RECURSIVE);
+    if (ret)
+    {
+        eprintf("Could not initialize mutex attribute");
+        pthread_mutexattr_destroy(&i2cbus_lock_attr);
+        i2cbus_init_status = -1;
+        return;
+    }
+    ret = pthread_mutexattr_init(&i2cbus_shm_attr);
+    if (ret)
+    {
+        eprintf("Could not initialize shared mutex attribute");
+        pthread_mutexattr_destroy(&i2cbus_lock_attr);
+        i2cbus_init_status = -1;
+        return;
+    }
+    if (pthread_mutexattr_settype(&i2cbus_shm_attr, PTHREAD_MUTEX_RECURSIVE) ||
+        pthread_mutexattr_setpshared(&i2cbus_shm_attr, PTHREAD_PROCESS_SHARED) ||
+        pthread_mutexattr_setrobust(&i2cbus_shm_attr, PTHREAD_MUTEX_ROBUST))
+    {
+        eprintf("Could not initialize shared mutex attribute");
+        pthread_mutexattr_destroy(&i2cbus_shm_attr);
+        pthread_mutexattr_destroy(&i2cbus_lock_attr);
+        i2cbus_init_status = -1;
+        return;
+    }
+}
+
+/**
+ * @brief Find the lock of a bus in the shared lock segment, claiming and
+ * initializing a free slot if no process has used the bus yet. Must be
+ * called with i2cbus_table_lock held.
+ *
+ * @param id Bus index (X in /dev/i2c-X)
+ * @return pthread_mutex_t* Bus lock, NULL if the segment is full or the lock is unusable
+ */
+static pthread_mutex_t *i2cbus_shm_lock(int id)
+{
+    for (int i = 0; i < I2CBUS_SHM_SLOTS; i++)
+    {
+        struct i2cbus_shm_slot *slot = &(i2cbus_shm->slot[(id + i) % I2CBUS_SHM_SLOTS]);
+        int key = 0;
+        if (atomic_compare_exchange_strong(&(slot->key), &key, id + 1))
+        {
+            int ret = pthread_mutex_init(&(slot->lock), &i2cbus_shm_attr);
+            atomic_store_explicit(&(slot->ready), ret ? -1 : 1, memory_order_release);
+            if (ret)
+            {
+                eprintf("Failed to init shared mutex %d: %s", id, strerror(ret));
+                return NULL;
+            }
+            return &(slot->lock);
+        }
+        if (key != id + 1)
+            continue;
+        // claimed by another process, which may still be initializing it
+        int ready;
+        for (int wait = 0; (ready = atomic_load_explicit(&(slot->ready), memory_order_acquire)) == 0 && wait < 1000; wait++)
+            nanosleep(&(struct timespec){.tv_sec = 0, .tv_nsec = 1000000}, NULL);
+        if (ready != 1)
+        {
+            eprintf("Shared lock of bus %d was not initialized by the process that claimed it", id);
+            return NULL;
+        }
+        return &(slot->lock);
+    }
+    eprintf("No free slot for bus %d in the shared lock segment", id);
+    return NULL;
+}
+
+/**
+ * @brief Look up the state of a bus without taking any lock.
+ *
+ * @param id Bus index (X in /dev/i2c-X)
+ * @return struct i2cbus_state* Bus state, NULL if the bus was never opened
+ */
+static inline struct i2cbus_state *i2cbus_state_find(unsigned int id)
+{
+    struct i2cbus_table *table = atomic_load_explicit(&i2cbus_table, memory_order_acquire);
+    if (unlikely(table == NULL || id >= table->size))
+        return NULL;
+    return atomic_load_explicit(&(table->slot[id]), memory_order_acquire);
+}
+
+/**
+ * @brief Look up the state of a bus, creating it (and growing the table)
+ * if the bus was never opened.
+ *
+ * @param id Bus index (X in /dev/i2c-X)
+ * @return struct i2cbus_state* Bus state, NULL on allocation failure
+ */
+static struct i2cbus_state *i2cbus_state_get(int id)
+{
+    struct i2cbus_state *st = i2cbus_state_find(id);
+    if (likely(st != NULL))
+        return st;
+    pthread_mutex_lock(&i2cbus_table_lock);
+    struct i2cbus_table *table = atomic_load_explicit(&i2cbus_table, memory_order_relaxed);
+    if (table == NULL || (size_t)id >= table->size)
+    {
+        size_t size = table ? table->size : I2CBUS_TABLE_MIN;
+        while (size <= (size_t)id)
+            size *= 2;
+        struct i2cbus_table *ntable = calloc(1, sizeof(struct i2cbus_table) + size * sizeof(ntable->slot[0]));
+        if (ntable == NULL)
+        {
+            eprintf("Could not allocate bus table of size %zu", size);
+            goto out;
+        }
+        ntable->size = size;
+        ntable->prev = table;
+        for (size_t i = 0; table != NULL && i < table->size; i++)
+            atomic_init(&(ntable->slot[i]), atomic_load_explicit(&(table->slot[i]), memory_order_relaxed));
+        atomic_store_explicit(&i2cbus_table, ntable, memory_order_release);
+        table = ntable;
+    }
+    st = atomic_load_explicit(&(table->slot[id]), memory_order_relaxed);
+    if (st == NULL)
+    {
+        st = calloc(1, sizeof(struct i2cbus_state));
+        if (st == NULL)
+        {
+            eprintf("Could not allocate state for bus %d", id);
+            goto out;
+        }
+        int ret = pthread_mutex_init(&(st->lock), &i2cbus_lock_attr);
+        if (ret)
+        {
+            eprintf("Failed to init mutex %d: %s", id, strerror(ret));
+            free(st);
+            st = NULL;
+            goto out;
+        }
+        st->mtx = &(st->lock);
+        st->fair = NULL;
+        if (i2cbus_lock_fair)
+        {
+            if ((ret = i2cbus_fairlock_init(&(st->flock))))
+            {
+                eprintf("Failed to init fair lock %d: %s", id, strerror(ret));
+            }
+            else
+            {
+                st->fair = &(st->flock);
+            }
+        }
+        else if (i2cbus_shm != NULL && (st->mtx = i2cbus_shm_lock(id)) == NULL)
+        {
+            ret = -1;
+        }
+        if (ret)
+        {
+            pthread_mutex_destroy(&(st->lock));
+            free(st);
+            st = NULL;
+            goto out;
+        }
+        st->id = id;
+        st->fd = -1;
+        st->refs = 0;
+        st->slave_addr = -1;
+        st->policy = (i2cbus_policy)I2CBUS_POLICY_INIT;
+        atomic_init(&(st->qhead), &(st->qstub));
+        st->qtail = &(st->qstub);
+        st->wakefd = -1;
+        atomic_init(&(st->aging_ns), I2CBUS_AGING_USEC * 1000ULL);
+        atomic_store_explicit(&(table->slot[id]), st, memory_order_release);
+    }
+out:
+    pthread_mutex_unlock(&i2cbus_table_lock);
+    return st;
+}
+
+static inline uint64_t i2cbus_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Add to a counter that is only written by the bus lock holder.
+ *
+ */
+static inline void i2cbus_stat_add(atomic_ullong *ctr, unsigned long long val)
+{
+    atomic_store_explicit(ctr, atomic_load_explicit(ctr, memory_order_relaxed) + val, memory_order_relaxed);
+}
+
+/**
+ * @brief Histogram bucket of a duration: I2CBUS_STATS_HIST_SUB linear
+ * buckets per power of two.
+ *
+ */
+static inline int i2cbus_hist_index(uint64_t ns)
+{
+    if (ns < I2CBUS_STATS_HIST_SUB)
+        return ns;
+    int shift = 63 - __builtin_clzll(ns) - I2CBUS_STATS_HIST_SUB_BITS;
+    int idx = ((shift + 1) << I2CBUS_STATS_HIST_SUB_BITS) + ((ns >> shift) & (I2CBUS_STATS_HIST_SUB - 1));
+    return idx < I2CBUS_STATS_HIST_BUCKETS ? idx : I2CBUS_STATS_HIST_BUCKETS - 1;
+}
+
+/**
+ * @brief Make a shared bus lock consistent after its holder, in another
+ * process, died holding it (EOWNERDEAD). The caller now holds the lock;
+ * whatever the dead process was doing on the bus is simply cut short,
+ * since every transaction is a single ioctl.
+ *
+ * @return int 0 on success, error number from pthread_mutex_consistent() on failure
+ */
+static int i2cbus_bus_recover(struct i2cbus_state *st)
+{
+    int ret = pthread_mutex_consistent(st->mtx);
+    if (ret)
+        return ret;
+    i2cbus_stat_add(&(st->stats.lock_recovered), 1);
+    eprintf("Previous holder of the lock of bus %d died, lock recovered", st->id);
+    return 0;
+}
+
+/**
+ * @brief Acquire the bus lock, accounting for the time spent waiting.
+ * The clock is only read when the lock is contended.
+ *
+ * @param deadline Absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @return int 0 on success, error number from pthread_mutex_lock() or
+ * pthread_mutex_clocklock() (ETIMEDOUT) on failure
+ */
+static inline int i2cbus_bus_timedlock(struct i2cbus_state *st, const struct timespec *deadline)
+{
+    int ret = unlikely(st->fair != NULL) ? i2cbus_fairlock_trylock(st->fair) : pthread_mutex_trylock(st->mtx);
+    if (likely(ret == 0))
+    {
+        i2cbus_stat_add(&(st->stats.lock_acquisitions), 1);
+        return 0;
+    }
+    uint64_t start = 0;
+    if (ret == EBUSY)
+    {
+        start = i2cbus_now_ns();
+        if (st->fair != NULL)
+            ret = i2cbus_fairlock_wait(st->fair, deadline);
+        else
+            ret = deadline ? pthread_mutex_clocklock(st->mtx, CLOCK_MONOTONIC, deadline) : pthread_mutex_lock(st->mtx);
+    }
+    if (unlikely(ret == EOWNERDEAD))
+        ret = i2cbus_bus_recover(st);
+    if (ret)
+        return ret;
+    i2cbus_stat_add(&(st->stats.lock_acquisitions), 1);
+    if (start)
+    {
+        i2cbus_stat_add(&(st->stats.lock_contended), 1);
+        i2cbus_stat_add(&(st->stats.lock_wait_ns), i2cbus_now_ns() - start);
+    }
+    return 0;
+}
+
+static inline int i2cbus_bus_lock(struct i2cbus_state *st)
+{
+    return i2cbus_bus_timedlock(st, NULL);
+}
+
+/**
+ * @brief Acquire the bus lock for bookkeeping (open, close, policy
+ * changes, statistics reset), without counting the acquisition.
+ *
+ * @return int 0 on success, error number from pthread_mutex_lock() on failure
+ */
+static int i2cbus_bus_lock_quiet(struct i2cbus_state *st)
+{
+    if (st->fair != NULL)
+        return i2cbus_fairlock_lock(st->fair, NULL);
+    int ret = pthread_mutex_lock(st->mtx);
+    return unlikely(ret == EOWNERDEAD) ? i2cbus_bus_recover(st) : ret;
+}
+
+static inline int i2cbus_bus_unlock(struct i2cbus_state *st)
+{
+    return unlikely(st->fair != NULL) ? i2cbus_fairlock_unlock(st->fair) : pthread_mutex_unlock(st->mtx);
+}
+
+/**
+ * @brief Policy in effect for a device: its own, or that of its bus.
+ *
+ */
+static inline const i2cbus_policy *i2cbus_policy_of(i2cbus *dev)
+{
+    return dev->policy != NULL ? dev->policy : &(dev->bus->policy);
+}
+
+/**
+ * @brief Set the kernel adapter timeout and retry count of the bus file
+ * descriptor to what the policy of the device asks for, if it differs
+ * from what was set last. Must be called with the bus lock held.
+ *
+ * @return int 0 on success, -1 on failure (errno is set)
+ */
+static inline int i2cbus_policy_apply_locked(i2cbus *dev)
+{
+    struct i2cbus_state *st = dev->bus;
+    const i2cbus_policy *p = i2cbus_policy_of(dev);
+    if (unlikely(p->timeout_ms > 0 && p->timeout_ms != st->timeout_ms))
+    {
+        // I2C_TIMEOUT counts in units of 10 ms
+        if (dev->be->ioctl(dev->be, dev->fd, I2C_TIMEOUT, (void *)(unsigned long)((p->timeout_ms + 9) / 10)) < 0)
+            return -1;
+        st->timeout_ms = p->timeout_ms;
+    }
+    if (unlikely(p->retries >= 0 && p->retries != st->retries))
+    {
+        if (dev->be->ioctl(dev->be, dev->fd, I2C_RETRIES, (void *)(unsigned long)p->retries) < 0)
+            return -1;
+        st->retries = p->retries;
+    }
+    return 0;
+}
+
+/**
+ * @brief Decide whether a failed transfer is tried again, following the
+ * policy of the device: only NACKs (ENXIO, EREMOTEIO) and EAGAIN are
+ * retried, after an exponentially growing delay. Must be called with the
+ * bus lock held, right after the failed transfer.
+ *
+ * @param dev Device of the failed transfer
+ * @param attempt Number of retries already made
+ * @return long Delay before the next attempt in microseconds, -1 to give up
+ */
+static long i2cbus_retry_delay_locked(i2cbus *dev, int attempt)
+{
+    const i2cbus_policy *p = i2cbus_policy_of(dev);
+    int err = errno;
+    if (likely(attempt >= p->user_retries) || (err != ENXIO && err != EREMOTEIO && err != EAGAIN))
+        return -1;
+    unsigned long long max = p->backoff_max_us > 0 ? p->backoff_max_us : I2CBUS_BACKOFF_MAX_US;
+    unsigned long long delay = (unsigned long long)p->backoff_us << (attempt < 32 ? attempt : 32);
+    if (delay > max)
+        delay = max;
+    if (delay > LONG_MAX)
+        delay = LONG_MAX;
+    i2cbus_stat_add(&(dev->bus->stats.retries), 1);
+#ifdef I2C_DEBUG
+    eprintf("Retrying transfer to 0x%02x on bus %d in %llu us, errno %d", dev->addr, dev->id, delay, err);
+#endif
+    return delay;
+}
+
+/**
+ * @brief Sleep for the backoff delay of a retry. Does no locking of its
+ * own: must be called after the bus lock taken for the failed attempt has
+ * been released, so that other devices can use the bus meanwhile.
+ *
+ */
+static void i2cbus_retry_backoff(long delay_us)
+{
+    if (delay_us <= 0)
+        return;
+    struct timespec ts = {.tv_sec = delay_us / 1000000, .tv_nsec = (delay_us % 1000000) * 1000};
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+        ;
+}
+
+#define I2CBUS_EWMA_SHIFT 3 /// Weight of a new sample in the transaction time estimate, 1 / 2^shift
+#define I2CBUS_EWMA_FRAC 4  /// Fraction bits of the transaction time estimate
+
+/**
+ * @brief Estimated duration of a transaction that puts bytes on the bus,
+ * address bytes included, from the recent transactions of the bus.
+ *
+ */
+static inline uint64_t i2cbus_estimate_ns(struct i2cbus_state *st, unsigned long bytes)
+{
+    return (atomic_load_explicit(&(st->byte_ns), memory_order_relaxed) * bytes) >> I2CBUS_EWMA_FRAC;
+}
+
+/**
+ * @brief Acquire the bus lock for a transaction of bytes wire bytes, plus
+ * extra_ns of waiting under the lock, that must complete by deadline.
+ * Gives up with ETIMEDOUT as soon as the estimated duration no longer
+ * fits before the deadline, without starting the transaction.
+ *
+ * @param deadline Absolute CLOCK_MONOTONIC deadline, NULL for none
+ * @return int 0 on success, error number on failure
+ */
+static int i2cbus_bus_lock_by(struct i2cbus_state *st, const struct timespec *deadline,
+                              unsigned long bytes, uint64_t extra_ns)
+{
+    if (likely(deadline == NULL))
+        return i2cbus_bus_lock(st);
+    uint64_t end = (uint64_t)deadline->tv_sec * 1000000000ULL + deadline->tv_nsec;
+    uint64_t est = i2cbus_estimate_ns(st, bytes) + extra_ns;
+    uint64_t latest = end > est ? end - est : 0; // latest start that still makes it
+    struct timespec ts = {.tv_sec = latest / 1000000000ULL, .tv_nsec = latest % 1000000000ULL};
+    int ret = i2cbus_bus_timedlock(st, &ts);
+    if (ret == 0 && i2cbus_now_ns() > latest)
+    {
+        i2cbus_bus_unlock(st);
+        ret = ETIMEDOUT;
+    }
+    if (ret == ETIMEDOUT)
+        atomic_fetch_add_explicit(&(st->stats.deadline_misses), 1, memory_order_relaxed);
+    return ret;
+}
+
+/**
+ * @brief Check that a retry after delay_us can still start before the deadline.
+ *
+ */
+static inline int i2cbus_retry_fits(const struct timespec *deadline, long delay_us)
+{
+    if (likely(deadline == NULL))
+        return 1;
+    uint64_t end = (uint64_t)deadline->tv_sec * 1000000000ULL + deadline->tv_nsec;
+    return i2cbus_now_ns() + (uint64_t)delay_us * 1000 < end;
+}
+
+/**
+ * @brief Account for a transaction in the bus statistics and the trace.
+ * Must be called with the bus lock held.
+ *
+ * @param dev Device the transaction was addressed through
+ * @param msgs Messages of the transaction (or their equivalent on the wire)
+ * @param nmsgs Number of messages
+ * @param ok Non-zero if the transaction succeeded
+ * @param err errno of a failed transaction
+ * @param start Start of the transaction (i2cbus_now_ns())
+ * @param elapsed Duration of the transaction
+ */
+static void i2cbus_account(i2cbus *dev, const struct i2c_msg *msgs, int nmsgs, int ok, int err,
+                           uint64_t start, uint64_t elapsed)
+{
+    struct i2cbus_counters *stats = &(dev->bus->stats);
+    i2cbus_stat_add(&(stats->transactions), 1);
+    i2cbus_stat_add(&(stats->xfer_ns), elapsed);
+    i2cbus_stat_add(&(stats->xfer_hist[i2cbus_hist_index(elapsed)]), 1);
+    if (unlikely(i2cbus_trace_on()))
+        i2cbus_trace_record(dev->id, msgs, nmsgs, ok ? 0 : err, start, elapsed);
+    if (likely(ok))
+    {
+        unsigned long long in = 0, out = 0;
+        for (int i = 0; i < nmsgs; i++)
+        {
+            if (msgs[i].flags & I2C_M_RD)
+                in += msgs[i].len;
+            else
+                out += msgs[i].len;
+        }
+        i2cbus_stat_add(&(stats->bytes_in), in);
+        i2cbus_stat_add(&(stats->bytes_out), out);
+        // time per wire byte, for the deadline checks
+        uint64_t sample = (elapsed << I2CBUS_EWMA_FRAC) / (in + out + nmsgs);
+        uint64_t est = atomic_load_explicit(&(dev->bus->byte_ns), memory_order_relaxed);
+        est = est ? est - (est >> I2CBUS_EWMA_SHIFT) + (sample >> I2CBUS_EWMA_SHIFT) : sample;
+        atomic_store_explicit(&(dev->bus->byte_ns), est, memory_order_relaxed);
+    }
+    else
+    {
+        i2cbus_stat_add(&(stats->errors), 1);
+        i2cbus_stat_add(&(stats->errno_count[err > 0 && err < I2CBUS_STATS_ERRNO_MAX ? err : 0]), 1);
+        if (err == ENXIO || err == EREMOTEIO)
+            i2cbus_stat_add(&(stats->nacks), 1);
+    }
+}
+
+/**
+ * @brief Issue an I2C_RDWR request on the bus of a device and account for
+ * it in the bus statistics. Must be called with the bus lock held.
+ *
+ * @return int Return value of the backend ioctl (number of messages on success)
+ */
+static int i2cbus_rdwr_ioctl(i2cbus *dev, struct i2c_msg *msgs, int nmsgs)
+{
+    struct i2c_rdwr_ioctl_data data = {.msgs = msgs, .nmsgs = nmsgs};
+    if (unlikely(i2cbus_policy_apply_locked(dev) < 0))
+        return -1;
+    uint64_t start = i2cbus_now_ns();
+    int status = dev->be->ioctl(dev->be, dev->fd, I2C_RDWR, &data);
+    int err = errno;
+    i2cbus_account(dev, msgs, nmsgs, status == nmsgs, err, start, i2cbus_now_ns() - start);
+    errno = err;
+    return status;
+}
+
+static int i2cbus_chardev_open(const i2cbus_backend *be, int id)
+{
+    (void)be;
+    char fname[256];
+    if (snprintf(fname, 256, "/dev/i2c-%d", id) < 0)
+    {
+        eprintf("Failed to generate device filename using snprintf. FATAL Error!");
+        errno = EINVAL;
+        return -1;
+    }
+    int fd = open(fname, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+    {
+        int err = errno;
+        eprintf("Failed to open %s. Error %d\n", fname, err);
+        errno = err;
+    }
+    return fd;
+}
+
+static int i2cbus_chardev_close(const i2cbus_backend *be, int handle)
+{
+    (void)be;
+    return close(handle);
+}
+
+static int i2cbus_chardev_ioctl(const i2cbus_backend *be, int handle, unsigned long request, void *arg)
+{
+    (void)be;
+    return ioctl(handle, request, arg);
+}
+
+const i2cbus_backend i2cbus_backend_chardev = {
+    .name = "chardev",
+    .open = i2cbus_chardev_open,
+    .close = i2cbus_chardev_close,
+    .ioctl = i2cbus_chardev_ioctl,
+    .priv = NULL,
+};
+
+int i2cbus_open(i2cbus *dev, int id, int addr)
+{
+    return i2cbus_open_backend(dev, id, addr, &i2cbus_backend_chardev);
+}
+
+int i2cbus_open_backend(i2cbus *dev, int id, int addr, const i2cbus_backend *be)
+{
+    int ret = 0, opened = 0;
+    struct i2cbus_state *st;
+    pthread_once(&i2cbus_init_once, i2cbus_init);
+    if (i2cbus_init_status)
+    {
+        ret = -1;
+        goto err;
+    }
+    // check 1: memory
+    if (dev == NULL)
+    {
+        eprintf("Error: Device descriptor is NULL");
+        ret = -3;
+        goto err;
+    }
+    // check 2: id valid range
+    if (id < 0)
+    {
+        eprintf("Invalid bus ID %d.", id);
+        ret = -4;
+        goto err;
+    }
+    // check 3: addr valid range (7-bit, reserved addresses excluded)
+    if (addr < 8 || addr > 0x7f)
+    {
+        eprintf("Address 0x%02x is invalid", addr);
+        ret = -5;
+        goto err;
+    }
+    // check 4: backend
+    if (be == NULL || be->open == NULL || be->close == NULL || be->ioctl == NULL)
+    {
+        eprintf("Invalid backend %p", be);
+        ret = -6;
+        goto err;
+    }
+    // Get or create the bus state
+    if ((st = i2cbus_state_get(id)) == NULL)
+    {
+        ret = -2;
+        goto err;
+    }
+
+    // Open the bus file descriptor if this is the first device on the bus
+    if ((ret = i2cbus_bus_lock_quiet(st)))
+    {
+        eprintf("Mutex lock returned %d, error", ret);
+        ret = -8;
+        goto err;
+    }
+    // the last close may still be stopping the worker, in which case the
+    // descriptor is open and is taken over
+    if (st->fd < 0)
+    {
+        if ((st->fd = be->open(be, id)) < 0)
+        {
+            ret = -errno;
+            i2cbus_bus_unlock(st);
+            goto err;
+        }
+        st->be = be;
+        st->slave_addr = -1;
+        st->pec = 0;
+        st->timeout_ms = 0;
+        st->retries = -1;
+        // ask the adapter once what it can do; assume plain I2C if it won't say
+        if (be->ioctl(be, st->fd, I2C_FUNCS, &(st->funcs)) < 0)
+            st->funcs = I2C_FUNC_I2C;
+        opened = 1;
+    }
+    else if (st->be != be)
+    {
+        eprintf("Bus %d is already open with the %s backend", id, st->be->name);
+        i2cbus_bus_unlock(st);
+        ret = -7;
+        goto err;
+    }
+    // probe the address once: the kernel refuses I2C_SLAVE with EBUSY if a
+    // driver has claimed the address, which I2C_RDWR would not notice
+    if (be->ioctl(be, st->fd, I2C_SLAVE, (void *)(unsigned long)addr) < 0)
+    {
+        ret = -errno;
+        eprintf("Failed to open I2C slave address 0x%02x on bus %d with error %d", addr, id, -ret);
+        st->slave_addr = -1;
+        if (opened)
+        {
+            be->close(be, st->fd);
+            st->fd = -1;
+        }
+        i2cbus_bus_unlock(st);
+        goto err;
+    }
+    st->slave_addr = addr;
+    st->refs++;
+    i2cbus_bus_unlock(st);
+    // if we are here, then everything was successful
+    dev->fd = st->fd;         // shared bus file descriptor
+    dev->id = id;             // assign device id
+    dev->addr = addr;         // assign slave address
+    dev->flags = 0;           // default transfer mode
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+    dev->lock = st->fair ? NULL : st->mtx; // assign lock, for callers that still lock it directly
+#pragma GCC diagnostic pop
+    dev->bus = st;            // assign bus state
+    dev->be = be;             // assign backend
+    dev->policy = NULL;       // follow the bus policy
+    return dev->fd;
+err:
+    return ret;
+}
+
+static void i2cbus_worker_stop(struct i2cbus_state *st);
+static void i2cbus_worker_drain(struct i2cbus_state *st, i2cbus *dev);
+
+int i2cbus_close(i2cbus *dev)
+{
+    int ret = -1, last = 0;
+    if (dev == NULL || dev->fd < 0 || dev->bus == NULL)
+    {
+        eprintf("Invalid device descriptor");
+        return -3;
+    }
+    struct i2cbus_state *st = dev->bus;
+    if ((ret = i2cbus_bus_lock_quiet(st)))
+    {
+        eprintf("Mutex lock returned %d, error", ret);
+        return -ret;
+    }
+    last = --st->refs == 0;
+    i2cbus_bus_unlock(st);
+    // run the requests already submitted while the device is still open:
+    // the last device takes the worker down with it, the others wait for
+    // what is queued ahead of them. The worker may be waiting for the bus
+    // lock, so this is done unlocked.
+    if (last)
+        i2cbus_worker_stop(st);
+    else
+        i2cbus_worker_drain(st, dev);
+    // Close the bus file descriptor when the last device on the bus goes
+    // away, unless the bus has been opened again in the meantime
+    if ((ret = i2cbus_bus_lock_quiet(st)))
+    {
+        eprintf("Mutex lock returned %d, error", ret);
+        return -ret;
+    }
+    if (st->refs == 0 && st->fd >= 0)
+    {
+        ret = st->be->close(st->be, st->fd);
+        st->fd = -1;
+    }
+    i2cbus_bus_unlock(st);
+    dev->fd = -1;
+    dev->bus = NULL;
+    return ret;
+}
+
+/**
+ * @brief CRC-8 lookup table for SMBus PEC, polynomial x^8 + x^2 + x + 1.
+ *
+ */
+static const unsigned char i2cbus_crc8_table[256] = {
+    0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15, 0x38, 0x3f, 0x36, 0x31,
+    0x24, 0x23, 0x2a, 0x2d, 0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65,
+    0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d, 0xe0, 0xe7, 0xee, 0xe9,
+    0xfc, 0xfb, 0xf2, 0xf5, 0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+    0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85, 0xa8, 0xaf, 0xa6, 0xa1,
+    0xb4, 0xb3, 0xba, 0xbd, 0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2,
+    0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea, 0xb7, 0xb0, 0xb9, 0xbe,
+    0xab, 0xac, 0xa5, 0xa2, 0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+    0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32, 0x1f, 0x18, 0x11, 0x16,
+    0x03, 0x04, 0x0d, 0x0a, 0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42,
+    0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a, 0x89, 0x8e, 0x87, 0x80,
+    0x95, 0x92, 0x9b, 0x9c, 0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+    0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec, 0xc1, 0xc6, 0xcf, 0xc8,
+    0xdd, 0xda, 0xd3, 0xd4, 0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c,
+    0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44, 0x19, 0x1e, 0x17, 0x10,
+    0x05, 0x02, 0x0b, 0x0c, 0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+    0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b, 0x76, 0x71, 0x78, 0x7f,
+    0x6a, 0x6d, 0x64, 0x63, 0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b,
+    0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13, 0xae, 0xa9, 0xa0, 0xa7,
+    0xb2, 0xb5, 0xbc, 0xbb, 0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+    0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb, 0xe6, 0xe1, 0xe8, 0xef,
+    0xfa, 0xfd, 0xf4, 0xf3,
+};
+
+unsigned char i2cbus_pec(unsigned char crc, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    while (len--)
+        crc = i2cbus_crc8_table[crc ^ *p++];
+    return crc;
+}
+
+/**
+ * @brief Add the address byte of a message to a PEC.
+ *
+ */
+static inline unsigned char i2cbus_pec_addr(unsigned char crc, int addr, int rd)
+{
+    return i2cbus_crc8_table[crc ^ (unsigned char)((addr << 1) | (rd ? 1 : 0))];
+}
+
+static int i2cbus_smbus_xfer_locked(i2cbus *dev, const unsigned char *outbuf, int outlen,
+                                    unsigned char *inbuf, int inlen);
+
+#define I2CBUS_PEC_STACK 256 /// PEC transfers up to this size are staged on the stack
+
+/**
+ * @brief Count a transfer that received a bad PEC byte and fail it.
+ *
+ * @return int -1 (errno is set to EBADMSG)
+ */
+static int i2cbus_pec_error(i2cbus *dev)
+{
+    i2cbus_stat_add(&(dev->bus->stats.pec_errors), 1);
+#ifdef I2C_DEBUG
+    eprintf("PEC mismatch on bus %d, address 0x%02x", dev->id, dev->addr);
+#endif
+    errno = EBADMSG;
+    return -1;
+}
+
+/**
+ * @brief i2cbus_msg_locked() for a device with PEC enabled: a PEC byte is
+ * appended to a write, or read after the data and checked.
+ *
+ * @return int len on success, -1 on failure (errno is set)
+ */
+static int i2cbus_msg_pec_locked(i2cbus *dev, unsigned short flags, void *buf, int len)
+{
+    unsigned char stackbuf[I2CBUS_PEC_STACK];
+    unsigned char *tmp = stackbuf;
+    if (unlikely(len < 0))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len + 1 > I2CBUS_PEC_STACK && (tmp = malloc(len + 1)) == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    int rd = (flags & I2C_M_RD) != 0;
+    unsigned char crc = i2cbus_pec_addr(0, dev->addr, rd);
+    struct i2c_msg msg = {.addr = dev->addr, .flags = flags, .len = len + 1, .buf = tmp};
+    int status = -1;
+    if (!rd)
+    {
+        memcpy(tmp, buf, len);
+        tmp[len] = i2cbus_pec(crc, buf, len);
+    }
+    if (i2cbus_rdwr_ioctl(dev, &msg, 1) == 1)
+    {
+        if (!rd)
+        {
+            status = len;
+        }
+        else if (likely(i2cbus_pec(crc, tmp, len) == tmp[len]))
+        {
+            memcpy(buf, tmp, len);
+            status = len;
+        }
+        else
+        {
+            status = i2cbus_pec_error(dev);
+        }
+    }
+    if (tmp != stackbuf)
+        free(tmp);
+    return status;
+}
+
+/**
+ * @brief Transfer a single message to or from the slave address of the
+ * device over the shared bus file descriptor. Must be called with the
+ * bus lock held.
+ *
+ * @return int len on success, -1 on failure (errno is set)
+ */
+static int i2cbus_msg_locked(i2cbus *dev, unsigned short flags, void *buf, int len)
+{
+    if (unlikely(!(dev->bus->funcs & I2C_FUNC_I2C)))
+        return (flags & I2C_M_RD) ? i2cbus_smbus_xfer_locked(dev, NULL, 0, buf, len)
+                                  : i2cbus_smbus_xfer_locked(dev, buf, len, NULL, 0);
+    if (unlikely(dev->flags & I2CBUS_FLAG_PEC))
+        return i2cbus_msg_pec_locked(dev, flags, buf, len);
+    struct i2c_msg msg = {.addr = dev->addr, .flags = flags, .len = len, .buf = buf};
+    if (i2cbus_rdwr_ioctl(dev, &msg, 1) != 1)
+        return -1;
+    return len;
+}
+
+/**
+ * @brief Report a failure to acquire the bus lock, from the transfer
+ * functions. Running out of time is not an error worth logging.
+ *
+ * @return int -1, with errno set
+ */
+static int i2cbus_lock_failed(int status)
+{
+    if (status != ETIMEDOUT)
+        eprintf("Mutex lock returned %d, error", status);
+    errno = status;
+    return -1;
+}
+
+/**
+ * @brief Operation run by i2cbus_retry() with the bus lock held.
+ *
+ * @param dev Device the operation is addressed to
+ * @param arg Arguments of the operation
+ * @return int Result of the attempt, with errno set on failure
+ */
+typedef int (*i2cbus_locked_op)(i2cbus *dev, void *arg);
+
+/**
+ * @brief Run an operation under the bus lock, retrying it as the policy
+ * of the device allows. The lock is released between attempts, for the
+ * backoff delay.
+ *
+ * @param dev Device the operation is addressed to
+ * @param op Operation, called with the bus lock held
+ * @param arg Arguments of the operation
+ * @param ok Return value of op on success, anything else is a failure
+ * @param deadline Absolute CLOCK_MONOTONIC deadline, NULL for none
+ * @param bytes Wire bytes of the operation, for i2cbus_bus_lock_by()
+ * @param extra_ns Waiting done by the operation under the lock
+ * @return int Return value of the last attempt, -1 if the bus lock could
+ * not be acquired (errno is set)
+ */
+static inline int i2cbus_retry(i2cbus *dev, i2cbus_locked_op op, void *arg, int ok,
+                               const struct timespec *deadline, unsigned long bytes, uint64_t extra_ns)
+{
+    int status;
+    long delay;
+    for (int attempt = 0;; attempt++)
+    {
+        status = i2cbus_bus_lock_by(dev->bus, deadline, bytes, extra_ns);
+        if (status)
+            return i2cbus_lock_failed(status);
+        status = op(dev, arg);
+        delay = likely(status == ok) ? -1 : i2cbus_retry_delay_locked(dev, attempt);
+        i2cbus_bus_unlock(dev->bus);
+        if (delay < 0 || !i2cbus_retry_fits(deadline, delay))
+            return status;
+        i2cbus_retry_backoff(delay);
+    }
+}
+
+struct i2cbus_msg_args
+{
+    unsigned short flags;
+    void *buf;
+    int len;
+};
+
+static int i2cbus_msg_op(i2cbus *dev, void *arg)
+{
+    struct i2cbus_msg_args *a = arg;
+    return i2cbus_msg_locked(dev, a->flags, a->buf, a->len);
+}
+
+/**
+ * @brief Transfer a single message under the bus lock, retrying it as the
+ * policy of the device allows.
+ *
+ * @param deadline Absolute CLOCK_MONOTONIC deadline, NULL for none
+ * @return int len on success, -1 on failure (errno is set)
+ */
+static int i2cbus_msg(i2cbus *dev, unsigned short flags, void *buf, int len, const struct timespec *deadline)
+{
+    struct i2cbus_msg_args a = {.flags = flags, .buf = buf, .len = len};
+    return i2cbus_retry(dev, i2cbus_msg_op, &a, len, deadline, len + 1, 0);
+}
+
+int i2cbus_write(i2cbus *dev, void *buf, int len)
+{
+    // usual checks
+    if (unlikely(dev == NULL || dev->fd < 0))
+    {
+        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev ? dev->fd : -1);
+        return -1;
+    }
+    if (unlikely(buf == NULL))
+    {
+        eprintf("Invalid write buffer pointer NULL");
+        return -1;
+    }
+    return i2cbus_write_unchecked(dev, buf, len);
+}
+
+int i2cbus_write_unchecked(i2cbus *dev, void *buf, int len)
+{
+    int status = i2cbus_msg(dev, 0, buf, len, NULL);
+    if (status != len)
+    {
+#ifdef I2C_DEBUG
+        eprintf("Failed to write %d bytes, wrote %d bytes, errno %d", len, status, errno);
+#endif
+    }
+    return status;
+}
+
+int i2cbus_read(i2cbus *dev, void *buf, int len)
+{
+    // usual checks
+    if (unlikely(dev == NULL || dev->fd < 0))
+    {
+        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev ? dev->fd : -1);
+        return -1;
+    }
+    if (unlikely(buf == NULL))
+    {
+        eprintf("Invalid write buffer pointer NULL");
+        return -1;
+    }
+    return i2cbus_read_unchecked(dev, buf, len);
+}
+
+int i2cbus_read_unchecked(i2cbus *dev, void *buf, int len)
+{
+    int status = i2cbus_msg(dev, I2C_M_RD, buf, len, NULL);
+    if (status != len)
+    {
+#ifdef I2C_DEBUG
+        eprintf("Failed to read %d bytes, read %d bytes, errno %d", len, status, errno);
+#endif
+    }
+    return status;
+}
+
+/**
+ * @brief i2cbus_rdwr_locked() for a device with PEC enabled: the PEC byte
+ * read after inbuf covers both messages, including the repeated start.
+ *
+ * @return int inlen on success, -1 on failure (errno is set)
+ */
+static int i2cbus_rdwr_pec_locked(i2cbus *dev,
+                                  void *outbuf, int outlen,
+                                  void *inbuf, int inlen)
+{
+    unsigned char stackbuf[I2CBUS_PEC_STACK];
+    unsigned char *tmp = stackbuf;
+    if (unlikely(outlen < 0 || inlen < 0))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (inlen + 1 > I2CBUS_PEC_STACK && (tmp = malloc(inlen + 1)) == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    struct i2c_msg msgs[2] = {
+        {.addr = dev->addr, .flags = 0, .len = outlen, .buf = outbuf},
+        {.addr = dev->addr, .flags = I2C_M_RD, .len = inlen + 1, .buf = tmp},
+    };
+    int status = -1;
+    if (i2cbus_rdwr_ioctl(dev, msgs, 2) == 2)
+    {
+        unsigned char crc = i2cbus_pec_addr(0, dev->addr, 0);
+        crc = i2cbus_pec(crc, outbuf, outlen);
+        crc = i2cbus_pec_addr(crc, dev->addr, 1);
+        if (likely(i2cbus_pec(crc, tmp, inlen) == tmp[inlen]))
+        {
+            memcpy(inbuf, tmp, inlen);
+            status = inlen;
+        }
+        else
+        {
+            status = i2cbus_pec_error(dev);
+        }
+    }
+#ifdef I2C_DEBUG
+    else
+        eprintf("I2C_RDWR of %d/%d bytes with PEC failed, errno %d", outlen, inlen, errno);
+#endif
+    if (tmp != stackbuf)
+        free(tmp);
+    return status;
+}
+
+/**
+ * @brief Write outbuf and read back inbuf in one I2C_RDWR ioctl, with a
+ * repeated start between the two messages. Must be called with the bus
+ * lock held.
+ *
+ * @return int inlen on success, -1 on failure (errno is set)
+ */
+static int i2cbus_rdwr_locked(i2cbus *dev,
+                              void *outbuf, int outlen,
+                              void *inbuf, int inlen)
+{
+    if (unlikely(!(dev->bus->funcs & I2C_FUNC_I2C)))
+        return i2cbus_smbus_xfer_locked(dev, outbuf, outlen, inbuf, inlen);
+    if (unlikely(dev->flags & I2CBUS_FLAG_PEC))
+        return i2cbus_rdwr_pec_locked(dev, outbuf, outlen, inbuf, inlen);
+    struct i2c_msg msgs[2] = {
+        {.addr = dev->addr, .flags = 0, .len = outlen, .buf = outbuf},
+        {.addr = dev->addr, .flags = I2C_M_RD, .len = inlen, .buf = inbuf},
+    };
+    int status = i2cbus_rdwr_ioctl(dev, msgs, 2);
+    if (status != 2)
+    {
+#ifdef I2C_DEBUG
+        eprintf("I2C_RDWR of %d/%d bytes failed with status %d, errno %d", outlen, inlen, status, errno);
+#endif
+        return -1;
+    }
+    return inlen;
+}
+
+int i2cbus_xfer(i2cbus *dev,
+                void *outbuf, int outlen,
+                void *inbuf, int inlen,
+                unsigned long timeout_usec)
+{
+    // usual checks
+    if (unlikely(dev == NULL || dev->fd < 0))
+    {
+        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev ? dev->fd : -1);
+        return -1;
+    }
+    if (unlikely(outbuf == NULL))
+    {
+        eprintf("Invalid write buffer pointer NULL");
+        return -1;
+    }
+    if (unlikely(inbuf == NULL))
+    {
+        eprintf("Invalid read buffer pointer NULL");
+        return -1;
+    }
+    return i2cbus_xfer_unchecked(dev, outbuf, outlen, inbuf, inlen, timeout_usec);
+}
+
+/**
+ * @brief Body of i2cbus_xfer(). Must be called with the bus lock held.
+ *
+ * @return int inlen on success, -1 on failure (errno is set)
+ */
+static int i2cbus_xfer_locked(i2cbus *dev,
+                              void *outbuf, int outlen,
+                              void *inbuf, int inlen,
+                              unsigned long timeout_usec)
+{
+    int status;
+    // SMBus-only adapters always join the phases, SMBus has no separate
+    // read, and so cannot wait between them
+    if (!(dev->bus->funcs & I2C_FUNC_I2C) || ((dev->flags & I2CBUS_FLAG_RDWR) && timeout_usec == 0))
+    {
+        status = i2cbus_rdwr_locked(dev, outbuf, outlen, inbuf, inlen);
+        if (status != inlen)
+            goto ret;
+    }
+    else
+    {
+        status = i2cbus_msg_locked(dev, 0, outbuf, outlen);
+        if (status != outlen)
+        {
+#ifdef I2C_DEBUG
+            eprintf("Failed to write %d bytes, wrote %d bytes, errno %d", outlen, status, errno);
+#endif
+            goto ret;
+        }
+        if (timeout_usec > 0)
+        {
+            usleep(timeout_usec);
+        }
+        status = i2cbus_msg_locked(dev, I2C_M_RD, inbuf, inlen);
+        if (status != inlen)
+        {
+#ifdef I2C_DEBUG
+            eprintf("Failed to read %d bytes, read %d bytes, errno %d", inlen, status, errno);
+#endif
+            goto ret;
+        }
+    }
+ret:
+    return status;
+}
+
+struct i2cbus_xfer_args
+{
+    void *outbuf;
+    int outlen;
+    void *inbuf;
+    int inlen;
+    unsigned long timeout_usec;
+};
+
+static int i2cbus_xfer_op(i2cbus *dev, void *arg)
+{
+    struct i2cbus_xfer_args *a = arg;
+    return i2cbus_xfer_locked(dev, a->outbuf, a->outlen, a->inbuf, a->inlen, a->timeout_usec);
+}
+
+/**
+ * @brief i2cbus_xfer() under the bus lock, retrying it as the policy of
+ * the device allows.
+ *
+ * @param deadline Absolute CLOCK_MONOTONIC deadline, NULL for none
+ * @return int inlen on success, -1 on failure (errno is set)
+ */
+static int i2cbus_xfer_by(i2cbus *dev,
+                          void *outbuf, int outlen,
+                          void *inbuf, int inlen,
+                          unsigned long timeout_usec,
+                          const struct timespec *deadline)
+{
+    struct i2cbus_xfer_args a = {.outbuf = outbuf, .outlen = outlen, .inbuf = inbuf, .inlen = inlen,
+                                 .timeout_usec = timeout_usec};
+    return i2cbus_retry(dev, i2cbus_xfer_op, &a, inlen, deadline, outlen + inlen + 2, timeout_usec * 1000ULL);
+}
+
+int i2cbus_xfer_unchecked(i2cbus *dev,
+                          void *outbuf, int outlen,
+                          void *inbuf, int inlen,
+                          unsigned long timeout_usec)
+{
+    return i2cbus_xfer_by(dev, outbuf, outlen, inbuf, inlen, timeout_usec, NULL);
+}
+
+int i2cbus_write_deadline(i2cbus *dev, void *buf, int len, const struct timespec *deadline)
+{
+    if (unlikely(dev == NULL || dev->fd < 0))
+    {
+        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev ? dev->fd : -1);
+        return -1;
+    }
+    if (unlikely(buf == NULL))
+    {
+        eprintf("Invalid write buffer pointer NULL");
+        return -1;
+    }
+    return i2cbus_msg(dev, 0, buf, len, deadline);
+}
+
+int i2cbus_read_deadline(i2cbus *dev, void *buf, int len, const struct timespec *deadline)
+{
+    if (unlikely(dev == NULL || dev->fd < 0))
+    {
+        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev ? dev->fd : -1);
+        return -1;
+    }
+    if (unlikely(buf == NULL))
+    {
+        eprintf("Invalid read buffer pointer NULL");
+        return -1;
+    }
+    return i2cbus_msg(dev, I2C_M_RD, buf, len, deadline);
+}
+
+int i2cbus_xfer_deadline(i2cbus *dev,
+                         void *outbuf, int outlen,
+                         void *inbuf, int inlen,
+                         unsigned long timeout_usec,
+                         const struct timespec *deadline)
+{
+    if (unlikely(dev == NULL || dev->fd < 0))
+    {
+        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev ? dev->fd : -1);
+        return -1;
+    }
+    if (unlikely(outbuf == NULL || inbuf == NULL))
+    {
+        eprintf("Invalid buffer pointers %p, %p", outbuf, inbuf);
+        return -1;
+    }
+    return i2cbus_xfer_by(dev, outbuf, outlen, inbuf, inlen, timeout_usec, deadline);
+}
+
+static int i2cbus_rdwr_op(i2cbus *dev, void *arg)
+{
+    struct i2cbus_xfer_args *a = arg;
+    return i2cbus_rdwr_locked(dev, a->outbuf, a->outlen, a->inbuf, a->inlen);
+}
+
+int i2cbus_xfer_rdwr(i2cbus *dev,
+                     void *outbuf, int outlen,
+                     void *inbuf, int inlen)
+{
+    // usual checks
+    if (unlikely(dev == NULL || dev->fd < 0))
+    {
+        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev ? dev->fd : -1);
+        return -1;
+    }
+    if (unlikely(outbuf == NULL))
+    {
+        eprintf("Invalid write buffer pointer NULL");
+        return -1;
+    }
+    if (unlikely(inbuf == NULL))
+    {
+        eprintf("Invalid read buffer pointer NULL");
+        return -1;
+    }
+    struct i2cbus_xfer_args a = {.outbuf = outbuf, .outlen = outlen, .inbuf = inbuf, .inlen = inlen};
+    return i2cbus_retry(dev, i2cbus_rdwr_op, &a, inlen, NULL, 0, 0);
+}
+
+int i2cbus_xfer_yield(i2cbus *dev,
+                      void *outbuf, int outlen,
+                      void *inbuf, int inlen,
+                      unsigned long timeout_usec)
+{
+    if (timeout_usec == 0)
+        return i2cbus_xfer(dev, outbuf, outlen, inbuf, inlen, 0);
+    // usual checks
+    if (unlikely(dev == NULL || dev->fd < 0))
+    {
+        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev ? dev->fd : -1);
+        return -1;
+    }
+    if (unlikely(outbuf == NULL))
+    {
+        eprintf("Invalid write buffer pointer NULL");
+        return -1;
+    }
+    if (unlikely(inbuf == NULL))
+    {
+        eprintf("Invalid read buffer pointer NULL");
+        return -1;
+    }
+    // SMBus has no read that follows a separate write, so SMBus-only
+    // adapters join the phases like i2cbus_xfer() does, without the wait
+    if (unlikely(!(dev->bus->funcs & I2C_FUNC_I2C)))
+        return i2cbus_xfer_unchecked(dev, outbuf, outlen, inbuf, inlen, timeout_usec);
+    int status = i2cbus_msg(dev, 0, outbuf, outlen, NULL);
+    if (status != outlen)
+    {
+#ifdef I2C_DEBUG
+        eprintf("Failed to write %d bytes, wrote %d bytes, errno %d", outlen, status, errno);
+#endif
+        return status;
+    }
+    // wait with the bus released, until an absolute wake-up time
+    struct timespec wake;
+    clock_gettime(CLOCK_MONOTONIC, &wake);
+    wake.tv_sec += timeout_usec / 1000000;
+    wake.tv_nsec += (timeout_usec % 1000000) * 1000;
+    if (wake.tv_nsec >= 1000000000)
+    {
+        wake.tv_sec++;
+        wake.tv_nsec -= 1000000000;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+        ;
+    status = i2cbus_msg(dev, I2C_M_RD, inbuf, inlen, NULL);
+#ifdef I2C_DEBUG
+    if (status != inlen)
+        eprintf("Failed to read %d bytes, read %d bytes, errno %d", inlen, status, errno);
+#endif
+    return status;
+}
+
+/**
+ * @brief Issue an I2C_SMBUS request to the slave address of a device and
+ * account for it in the bus statistics. The address is bound to the bus
+ * file descriptor with I2C_SLAVE, and kernel PEC switched with I2C_PEC,
+ * only when they differ from what the bus file descriptor was last set
+ * to. Must be called with the bus lock held.
+ *
+ * @return int 0 on success, -1 on failure (errno is set)
+ */
+static int i2cbus_smbus_locked(i2cbus *dev, char read_write, unsigned char command, int size,
+                               union i2c_smbus_data *data)
+{
+    struct i2cbus_state *st = dev->bus;
+    if (st->slave_addr != dev->addr)
+    {
+        if (dev->be->ioctl(dev->be, dev->fd, I2C_SLAVE, (void *)(unsigned long)dev->addr) < 0)
+        {
+#ifdef I2C_DEBUG
+            eprintf("Could not bind address 0x%02x on bus %d, errno %d", dev->addr, dev->id, errno);
+#endif
+            st->slave_addr = -1;
+            return -1;
+        }
+        st->slave_addr = dev->addr;
+    }
+    int pec = (dev->flags & I2CBUS_FLAG_PEC) != 0;
+    if (unlikely(st->pec != pec))
+    {
+        if (pec && !(st->funcs & I2C_FUNC_SMBUS_PEC))
+        {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        if (dev->be->ioctl(dev->be, dev->fd, I2C_PEC, (void *)(unsigned long)pec) < 0)
+            return -1;
+        st->pec = pec;
+    }
+    if (unlikely(i2cbus_policy_apply_locked(dev) < 0))
+        return -1;
+    struct i2c_smbus_ioctl_data args = {.read_write = read_write, .command = command, .size = size, .data = data};
+    unsigned char wlen = 0;
+    unsigned char wblock[I2C_SMBUS_BLOCK_MAX + 1];
+    // process calls overwrite the data with the reply, keep what was sent
+    if (size == I2C_SMBUS_PROC_CALL)
+    {
+        wblock[0] = data->word & 0xff;
+        wblock[1] = data->word >> 8;
+    }
+    else if (size == I2C_SMBUS_BLOCK_PROC_CALL)
+    {
+        wlen = data->block[0] <= I2C_SMBUS_BLOCK_MAX ? data->block[0] : I2C_SMBUS_BLOCK_MAX;
+        memcpy(wblock, data->block, wlen + 1);
+    }
+    uint64_t start = i2cbus_now_ns();
+    int status = dev->be->ioctl(dev->be, dev->fd, I2C_SMBUS, &args);
+    int err = errno;
+    uint64_t elapsed = i2cbus_now_ns() - start;
+    // describe the transaction as the messages it puts on the wire
+    unsigned char word[2];
+    struct i2c_msg msgs[3] = {
+        {.addr = dev->addr, .flags = 0, .len = 1, .buf = &command},
+    };
+    int nmsgs = 1;
+    switch (size)
+    {
+    case I2C_SMBUS_QUICK:
+        msgs[0].flags = read_write == I2C_SMBUS_READ ? I2C_M_RD : 0;
+        msgs[0].len = 0;
+        msgs[0].buf = NULL;
+        break;
+    case I2C_SMBUS_BYTE:
+        if (read_write == I2C_SMBUS_READ)
+        {
+            msgs[0].flags = I2C_M_RD;
+            msgs[0].buf = &(data->byte);
+        }
+        break;
+    case I2C_SMBUS_BYTE_DATA:
+        msgs[nmsgs++] = (struct i2c_msg){.addr = dev->addr,
+                                         .flags = read_write == I2C_SMBUS_READ ? I2C_M_RD : I2C_M_NOSTART,
+                                         .len = 1,
+                                         .buf = &(data->byte)};
+        break;
+    case I2C_SMBUS_WORD_DATA:
+        word[0] = data->word & 0xff;
+        word[1] = data->word >> 8;
+        msgs[nmsgs++] = (struct i2c_msg){.addr = dev->addr,
+                                         .flags = read_write == I2C_SMBUS_READ ? I2C_M_RD : I2C_M_NOSTART,
+                                         .len = 2,
+                                         .buf = word};
+        break;
+    case I2C_SMBUS_PROC_CALL:
+        word[0] = data->word & 0xff;
+        word[1] = data->word >> 8;
+        msgs[nmsgs++] = (struct i2c_msg){.addr = dev->addr, .flags = I2C_M_NOSTART, .len = 2, .buf = wblock};
+        msgs[nmsgs++] = (struct i2c_msg){.addr = dev->addr, .flags = I2C_M_RD, .len = 2, .buf = word};
+        break;
+    case I2C_SMBUS_BLOCK_DATA:
+        msgs[nmsgs++] = (struct i2c_msg){.addr = dev->addr,
+                                         .flags = read_write == I2C_SMBUS_READ ? I2C_M_RD : I2C_M_NOSTART,
+                                         .len = 1 + (data->block[0] <= I2C_SMBUS_BLOCK_MAX ? data->block[0] : 0),
+                                         .buf = data->block};
+        break;
+    case I2C_SMBUS_I2C_BLOCK_DATA:
+        msgs[nmsgs++] = (struct i2c_msg){.addr = dev->addr,
+                                         .flags = read_write == I2C_SMBUS_READ ? I2C_M_RD : I2C_M_NOSTART,
+                                         .len = data->block[0] <= I2C_SMBUS_BLOCK_MAX ? data->block[0] : 0,
+                                         .buf = data->block + 1};
+        break;
+    case I2C_SMBUS_BLOCK_PROC_CALL:
+        msgs[nmsgs++] = (struct i2c_msg){.addr = dev->addr, .flags = I2C_M_NOSTART, .len = 1 + wlen, .buf = wblock};
+        msgs[nmsgs++] = (struct i2c_msg){.addr = dev->addr,
+                                         .flags = I2C_M_RD,
+                                         .len = 1 + (data->block[0] <= I2C_SMBUS_BLOCK_MAX ? data->block[0] : 0),
+                                         .buf = data->block};
+        break;
+    }
+    i2cbus_account(dev, msgs, nmsgs, status >= 0, err, start, elapsed);
+    errno = err;
+    return status < 0 ? -1 : 0;
+}
+
+struct i2cbus_smbus_args
+{
+    char read_write;
+    unsigned char command;
+    int size;
+    union i2c_smbus_data *data;
+};
+
+static int i2cbus_smbus_op(i2cbus *dev, void *arg)
+{
+    struct i2cbus_smbus_args *a = arg;
+    return i2cbus_smbus_locked(dev, a->read_write, a->command, a->size, a->data);
+}
+
+/**
+ * @brief Run one SMBus transaction on a device under the bus lock,
+ * retrying it as the policy of the device allows.
+ *
+ * @return int 0 on success, -1 on failure (errno is set)
+ */
+static int i2cbus_smbus(i2cbus *dev, char read_write, unsigned char command, int size,
+                        union i2c_smbus_data *data)
+{
+    if (unlikely(dev == NULL || dev->fd < 0))
+    {
+        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev ? dev->fd : -1);
+        errno = EINVAL;
+        return -1;
+    }
+    struct i2cbus_smbus_args a = {.read_write = read_write, .command = command, .size = size, .data = data};
+    int status = i2cbus_retry(dev, i2cbus_smbus_op, &a, 0, NULL, 0, 0);
+#ifdef I2C_DEBUG
+    if (status < 0)
+        eprintf("SMBus transaction %d (%s) at 0x%02x failed, errno %d", size,
+                read_write == I2C_SMBUS_READ ? "read" : "write", command, errno);
+#endif
+    return status;
+}
+
+int i2cbus_smbus_write_quick(i2cbus *dev, unsigned char value)
+{
+    return i2cbus_smbus(dev, value ? I2C_SMBUS_READ : I2C_SMBUS_WRITE, 0, I2C_SMBUS_QUICK, NULL);
+}
+
+int i2cbus_smbus_read_byte(i2cbus *dev)
+{
+    union i2c_smbus_data data;
+    if (i2cbus_smbus(dev, I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &data) < 0)
+        return -1;
+    return data.byte;
+}
+
+int i2cbus_smbus_write_byte(i2cbus *dev, unsigned char value)
+{
+    return i2cbus_smbus(dev, I2C_SMBUS_WRITE, value, I2C_SMBUS_BYTE, NULL);
+}
+
+int i2cbus_smbus_read_byte_data(i2cbus *dev, unsigned char command)
+{
+    union i2c_smbus_data data;
+    if (i2cbus_smbus(dev, I2C_SMBUS_READ, command, I2C_SMBUS_BYTE_DATA, &data) < 0)
+        return -1;
+    return data.byte;
+}
+
+int i2cbus_smbus_write_byte_data(i2cbus *dev, unsigned char command, unsigned char value)
+{
+    union i2c_smbus_data data = {.byte = value};
+    return i2cbus_smbus(dev, I2C_SMBUS_WRITE, command, I2C_SMBUS_BYTE_DATA, &data);
+}
+
+int i2cbus_smbus_read_word_data(i2cbus *dev, unsigned char command)
+{
+    union i2c_smbus_data data;
+    if (i2cbus_smbus(dev, I2C_SMBUS_READ, command, I2C_SMBUS_WORD_DATA, &data) < 0)
+        return -1;
+    return data.word;
+}
+
+int i2cbus_smbus_write_word_data(i2cbus *dev, unsigned char command, unsigned short value)
+{
+    union i2c_smbus_data data = {.word = value};
+    return i2cbus_smbus(dev, I2C_SMBUS_WRITE, command, I2C_SMBUS_WORD_DATA, &data);
+}
+
+int i2cbus_smbus_process_call(i2cbus *dev, unsigned char command, unsigned short value)
+{
+    union i2c_smbus_data data = {.word = value};
+    if (i2cbus_smbus(dev, I2C_SMBUS_WRITE, command, I2C_SMBUS_PROC_CALL, &data) < 0)
+        return -1;
+    return data.word;
+}
+
+/**
+ * @brief Copy a block received by an SMBus transaction to the caller.
+ *
+ * @return int Number of bytes copied, -1 if the slave sent an invalid count
+ */
+static int i2cbus_smbus_block_out(const union i2c_smbus_data *data, unsigned char *values)
+{
+    if (unlikely(data->block[0] > I2C_SMBUS_BLOCK_MAX))
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    memcpy(values, data->block + 1, data->block[0]);
+    return data->block[0];
+}
+
+int i2cbus_smbus_read_block_data(i2cbus *dev, unsigned char command, unsigned char *values)
+{
+    union i2c_smbus_data data;
+    if (unlikely(values == NULL))
+    {
+        eprintf("Invalid read buffer pointer NULL");
+        errno = EINVAL;
+        return -1;
+    }
+    if (i2cbus_smbus(dev, I2C_SMBUS_READ, command, I2C_SMBUS_BLOCK_DATA, &data) < 0)
+        return -1;
+    return i2cbus_smbus_block_out(&data, values);
+}
+
+int i2cbus_smbus_write_block_data(i2cbus *dev, unsigned char command, unsigned char length,
+                                  const unsigned char *values)
+{
+    union i2c_smbus_data data;
+    if (unlikely(length > I2C_SMBUS_BLOCK_MAX || (length > 0 && values == NULL)))
+    {
+        eprintf("Invalid block of %u bytes at %p", length, values);
+        errno = EINVAL;
+        return -1;
+    }
+    data.block[0] = length;
+    memcpy(data.block + 1, values, length);
+    return i2cbus_smbus(dev, I2C_SMBUS_WRITE, command, I2C_SMBUS_BLOCK_DATA, &data);
+}
+
+int i2cbus_smbus_block_process_call(i2cbus *dev, unsigned char command, unsigned char length,
+                                    unsigned char *values)
+{
+    union i2c_smbus_data data;
+    if (unlikely(length > I2C_SMBUS_BLOCK_MAX || values == NULL))
+    {
+        eprintf("Invalid block of %u bytes at %p", length, values);
+        errno = EINVAL;
+        return -1;
+    }
+    data.block[0] = length;
+    memcpy(data.block + 1, values, length);
+    if (i2cbus_smbus(dev, I2C_SMBUS_WRITE, command, I2C_SMBUS_BLOCK_PROC_CALL, &data) < 0)
+        return -1;
+    return i2cbus_smbus_block_out(&data, values);
+}
+
+int i2cbus_smbus_read_i2c_block_data(i2cbus *dev, unsigned char command, unsigned char length,
+                                     unsigned char *values)
+{
+    union i2c_smbus_data data;
+    if (unlikely(length == 0 || length > I2C_SMBUS_BLOCK_MAX || values == NULL))
+    {
+        eprintf("Invalid block of %u bytes at %p", length, values);
+        errno = EINVAL;
+        return -1;
+    }
+    data.block[0] = length;
+    if (i2cbus_smbus(dev, I2C_SMBUS_READ, command, I2C_SMBUS_I2C_BLOCK_DATA, &data) < 0)
+        return -1;
+    return i2cbus_smbus_block_out(&data, values);
+}
+
+int i2cbus_smbus_write_i2c_block_data(i2cbus *dev, unsigned char command, unsigned char length,
+                                      const unsigned char *values)
+{
+    union i2c_smbus_data data;
+    if (unlikely(length == 0 || length > I2C_SMBUS_BLOCK_MAX || values == NULL))
+    {
+        eprintf("Invalid block of %u bytes at %p", length, values);
+        errno = EINVAL;
+        return -1;
+    }
+    data.block[0] = length;
+    memcpy(data.block + 1, values, length);
+    return i2cbus_smbus(dev, I2C_SMBUS_WRITE, command, I2C_SMBUS_I2C_BLOCK_DATA, &data);
+}
+
+i2cbus_method i2cbus_select_method(unsigned long funcs, int outlen, int inlen)
+{
+    if (outlen < 0 || inlen < 0 || (outlen == 0 && inlen == 0))
+        return I2CBUS_METHOD_UNSUPPORTED;
+    if (funcs & I2C_FUNC_I2C)
+        return I2CBUS_METHOD_I2C;
+    if (inlen == 0) // write: the first byte goes out as the SMBus command
+    {
+        if (outlen == 1 && (funcs & I2C_FUNC_SMBUS_WRITE_BYTE))
+            return I2CBUS_METHOD_SMBUS_BYTE;
+        if (outlen == 2 && (funcs & I2C_FUNC_SMBUS_WRITE_BYTE_DATA))
+            return I2CBUS_METHOD_SMBUS_BYTE_DATA;
+        if (outlen == 3 && (funcs & I2C_FUNC_SMBUS_WRITE_WORD_DATA))
+            return I2CBUS_METHOD_SMBUS_WORD_DATA;
+        if (outlen >= 2 && outlen <= I2C_SMBUS_BLOCK_MAX + 1 && (funcs & I2C_FUNC_SMBUS_WRITE_I2C_BLOCK))
+            return I2CBUS_METHOD_SMBUS_I2C_BLOCK;
+    }
+    else if (outlen == 0) // read without a command
+    {
+        if (inlen == 1 && (funcs & I2C_FUNC_SMBUS_READ_BYTE))
+            return I2CBUS_METHOD_SMBUS_BYTE;
+    }
+    else if (outlen == 1) // command, repeated start, read
+    {
+        if (inlen == 1 && (funcs & I2C_FUNC_SMBUS_READ_BYTE_DATA))
+            return I2CBUS_METHOD_SMBUS_BYTE_DATA;
+        if (inlen == 2 && (funcs & I2C_FUNC_SMBUS_READ_WORD_DATA))
+            return I2CBUS_METHOD_SMBUS_WORD_DATA;
+        if (inlen <= I2C_SMBUS_BLOCK_MAX && (funcs & I2C_FUNC_SMBUS_READ_I2C_BLOCK))
+            return I2CBUS_METHOD_SMBUS_I2C_BLOCK;
+    }
+    return I2CBUS_METHOD_UNSUPPORTED;
+}
+
+/**
+ * @brief Carry out a plain I2C transfer (write outbuf, repeated start,
+ * read inbuf; either may be empty) with the equivalent SMBus transaction
+ * chosen by i2cbus_select_method(), for adapters without I2C_FUNC_I2C.
+ * Must be called with the bus lock held.
+ *
+ * @return int inlen if anything was read, outlen otherwise; -1 on failure
+ * (errno is set, EOPNOTSUPP if the adapter has no equivalent transaction)
+ */
+static int i2cbus_smbus_xfer_locked(i2cbus *dev, const unsigned char *outbuf, int outlen,
+                                    unsigned char *inbuf, int inlen)
+{
+    union i2c_smbus_data data;
+    int rd = inlen > 0;
+    switch (i2cbus_select_method(dev->bus->funcs, outlen, inlen))
+    {
+    case I2CBUS_METHOD_SMBUS_BYTE:
+        if (!rd)
+            return i2cbus_smbus_locked(dev, I2C_SMBUS_WRITE, outbuf[0], I2C_SMBUS_BYTE, NULL) < 0 ? -1 : 1;
+        if (i2cbus_smbus_locked(dev, I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &data) < 0)
+            return -1;
+        inbuf[0] = data.byte;
+        return 1;
+    case I2CBUS_METHOD_SMBUS_BYTE_DATA:
+        if (!rd)
+        {
+            data.byte = outbuf[1];
+            return i2cbus_smbus_locked(dev, I2C_SMBUS_WRITE, outbuf[0], I2C_SMBUS_BYTE_DATA, &data) < 0 ? -1 : 2;
+        }
+        if (i2cbus_smbus_locked(dev, I2C_SMBUS_READ, outbuf[0], I2C_SMBUS_BYTE_DATA, &data) < 0)
+            return -1;
+        inbuf[0] = data.byte;
+        return 1;
+    case I2CBUS_METHOD_SMBUS_WORD_DATA: // SMBus words go LSB first, keep the wire order
+        if (!rd)
+        {
+            data.word = outbuf[1] | (outbuf[2] << 8);
+            return i2cbus_smbus_locked(dev, I2C_SMBUS_WRITE, outbuf[0], I2C_SMBUS_WORD_DATA, &data) < 0 ? -1 : 3;
+        }
+        if (i2cbus_smbus_locked(dev, I2C_SMBUS_READ, outbuf[0], I2C_SMBUS_WORD_DATA, &data) < 0)
+            return -1;
+        inbuf[0] = data.word & 0xff;
+        inbuf[1] = data.word >> 8;
+        return 2;
+    case I2CBUS_METHOD_SMBUS_I2C_BLOCK:
+        if (!rd)
+        {
+            data.block[0] = outlen - 1;
+            memcpy(data.block + 1, outbuf + 1, outlen - 1);
+            return i2cbus_smbus_locked(dev, I2C_SMBUS_WRITE, outbuf[0], I2C_SMBUS_I2C_BLOCK_DATA, &data) < 0 ? -1 : outlen;
+        }
+        data.block[0] = inlen;
+        if (i2cbus_smbus_locked(dev, I2C_SMBUS_READ, outbuf[0], I2C_SMBUS_I2C_BLOCK_DATA, &data) < 0)
+            return -1;
+        memcpy(inbuf, data.block + 1, inlen);
+        return inlen;
+    default:
+#ifdef I2C_DEBUG
+        eprintf("No SMBus transaction for a %d/%d byte transfer on bus %d", outlen, inlen, dev->id);
+#endif
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+}
+
+/**
+ * @brief Body of i2cbus_read_reg(). Must be called with the bus lock held.
+ *
+ * @return int len on success, -1 on failure (errno is set)
+ */
+static int i2cbus_read_reg_locked(i2cbus *dev, unsigned int reg, int reg_bytes, unsigned char *buf, int len)
+{
+    unsigned char regbuf[2] = {reg_bytes == 2 ? reg >> 8 : reg, reg & 0xff};
+    unsigned long funcs = dev->bus->funcs;
+    if (funcs & I2C_FUNC_I2C)
+        return i2cbus_rdwr_locked(dev, regbuf, reg_bytes, buf, len);
+    if (reg_bytes == 2)
+    {
+        // SMBus only, 16-bit register: set the register pointer with a
+        // two byte write, then receive bytes one at a time from it (current
+        // address reads), which relies on the pointer auto-incrementing
+        if (i2cbus_select_method(funcs, 2, 0) == I2CBUS_METHOD_UNSUPPORTED ||
+            i2cbus_select_method(funcs, 0, 1) == I2CBUS_METHOD_UNSUPPORTED)
+        {
+            errno = EOPNOTSUPP;
+            return -1;
+        }
+        if (i2cbus_smbus_xfer_locked(dev, regbuf, 2, NULL, 0) != 2)
+            return -1;
+        for (int off = 0; off < len; off++)
+        {
+            if (i2cbus_smbus_xfer_locked(dev, NULL, 0, buf + off, 1) != 1)
+                return -1;
+        }
+        return len;
+    }
+    // SMBus only: read in I2C block sized chunks, or byte by byte if the
+    // adapter has no I2C block read; relies on the register pointer of
+    // the device auto-incrementing
+    for (int off = 0, n; off < len; off += n)
+    {
+        n = len - off > I2C_SMBUS_BLOCK_MAX ? I2C_SMBUS_BLOCK_MAX : len - off;
+        if (i2cbus_select_method(funcs, 1, n) == I2CBUS_METHOD_UNSUPPORTED)
+            n = 1;
+        unsigned char cmd = reg + off;
+        if (i2cbus_smbus_xfer_locked(dev, &cmd, 1, buf + off, n) != n)
+            return -1;
+    }
+    return len;
+}
+
+struct i2cbus_read_reg_args
+{
+    unsigned int reg;
+    int reg_bytes;
+    void *buf;
+    int len;
+};
+
+static int i2cbus_read_reg_op(i2cbus *dev, void *arg)
+{
+    struct i2cbus_read_reg_args *a = arg;
+    return i2cbus_read_reg_locked(dev, a->reg, a->reg_bytes, a->buf, a->len);
+}
+
+int i2cbus_read_reg(i2cbus *dev, unsigned int reg, int reg_bytes, void *buf, int len)
+{
+    if (unlikely(dev == NULL || dev->fd < 0))
+    {
+        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev ? dev->fd : -1);
+        return -1;
+    }
+    if (unlikely(buf == NULL || len <= 0 || reg_bytes < 1 || reg_bytes > 2))
+    {
+        eprintf("Invalid read of %d bytes to %p with %d byte register", len, buf, reg_bytes);
+        errno = EINVAL;
+        return -1;
+    }
+    struct i2cbus_read_reg_args a = {.reg = reg, .reg_bytes = reg_bytes, .buf = buf, .len = len};
+    return i2cbus_retry(dev, i2cbus_read_reg_op, &a, len, NULL, 0, 0);
+}
+
+unsigned long i2cbus_get_funcs(i2cbus *dev)
+{
+    if (unlikely(dev == NULL || dev->fd < 0))
+        return 0;
+    return dev->bus->funcs;
+}
+
+#define I2CBUS_MSG_MAXLEN 8192 /// Largest message accepted by the i2c-dev driver
+
+int i2cbus_batch_init(i2cbus_batch *batch, i2cbus *dev)
+{
+    if (unlikely(batch == NULL))
+    {
+        eprintf("Invalid batch pointer NULL");
+        return -1;
+    }
+    if (unlikely(dev == NULL || dev->fd < 0))
+    {
+        eprintf("Invalid device pointer %p", dev);
+        return -1;
+    }
+    batch->dev = dev;
+    batch->msgs = NULL;
+    batch->num = 0;
+    batch->cap = 0;
+    return 1;
+}
+
+/**
+ * @brief Append a message to the batch, growing the message array as needed.
+ *
+ * @return int Number of queued segments on success, negative on error
+ */
+static int i2cbus_batch_add(i2cbus_batch *batch, int addr, unsigned short flags, void *buf, int len)
+{
+    if (unlikely(batch == NULL || batch->dev == NULL))
+    {
+        eprintf("Invalid batch descriptor");
+        return -1;
+    }
+    if (unlikely(buf == NULL))
+    {
+        eprintf("Invalid buffer pointer NULL");
+        return -1;
+    }
+    if (unlikely(len <= 0 || len > I2CBUS_MSG_MAXLEN))
+    {
+        eprintf("Invalid segment length %d", len);
+        return -1;
+    }
+    if (addr < 0)
+        addr = batch->dev->addr;
+    if (batch->num == batch->cap)
+    {
+        int cap = batch->cap ? batch->cap * 2 : 8;
+        struct i2c_msg *msgs = realloc(batch->msgs, cap * sizeof(struct i2c_msg));
+        if (msgs == NULL)
+        {
+            eprintf("Could not allocate memory for %d segments", cap);
+            return -2;
+        }
+        batch->msgs = msgs;
+        batch->cap = cap;
+    }
+    struct i2c_msg *msg = &(batch->msgs[batch->num]);
+    msg->addr = addr;
+    msg->flags = flags;
+    msg->len = len;
+    msg->buf = buf;
+    return ++(batch->num);
+}
+
+int i2cbus_batch_write(i2cbus_batch *batch, int addr, void *buf, int len)
+{
+    return i2cbus_batch_add(batch, addr, 0, buf, len);
+}
+
+int i2cbus_batch_read(i2cbus_batch *batch, int addr, void *buf, int len)
+{
+    return i2cbus_batch_add(batch, addr, I2C_M_RD, buf, len);
+}
+
+int i2cbus_batch_xfer(i2cbus_batch *batch, int addr,
+                      void *outbuf, int outlen,
+                      void *inbuf, int inlen)
+{
+    int ret = i2cbus_batch_add(batch, addr, 0, outbuf, outlen);
+    if (ret < 0)
+        return ret;
+    ret = i2cbus_batch_add(batch, addr, I2C_M_RD, inbuf, inlen);
+    if (ret < 0)
+        batch->num--; // drop the unpaired write
+    return ret;
+}
+
+/**
+ * @brief Run the segments of a batch one transfer at a time, joining each
+ * write followed by a read from the same slave into one transfer with a
+ * repeated start, for transfers I2C_RDWR cannot carry as queued (PEC), or
+ * on adapters without I2C_RDWR, where each transfer falls back to the
+ * matching SMBus transaction. Must be called with the bus lock held.
+ *
+ * @return int num on success, -1 on failure (errno is set)
+ */
+static int i2cbus_batch_each_locked(i2cbus *dev, struct i2c_msg *msgs, int num)
+{
+    i2cbus seg = *dev;
+    for (int i = 0; i < num; i++)
+    {
+        int status, expect;
+        seg.addr = msgs[i].addr;
+        if (!(msgs[i].flags & I2C_M_RD) && i + 1 < num && (msgs[i + 1].flags & I2C_M_RD) && msgs[i + 1].addr == msgs[i].addr)
+        {
+            status = i2cbus_rdwr_locked(&seg, msgs[i].buf, msgs[i].len, msgs[i + 1].buf, msgs[i + 1].len);
+            expect = msgs[++i].len;
+        }
+        else
+        {
+            status = i2cbus_msg_locked(&seg, msgs[i].flags & I2C_M_RD, msgs[i].buf, msgs[i].len);
+            expect = msgs[i].len;
+        }
+        if (status != expect)
+            return -1;
+    }
+    return num;
+}
+
+int i2cbus_batch_run(i2cbus_batch *batch)
+{
+    if (unlikely(batch == NULL || batch->dev == NULL || batch->dev->fd < 0))
+    {
+        eprintf("Invalid batch descriptor");
+        return -1;
+    }
+    i2cbus *dev = batch->dev;
+    int status = i2cbus_bus_lock(dev->bus);
+    if (status)
+    {
+        eprintf("Mutex lock returned %d, error", status);
+        return -1;
+    }
+    int done = 0;
+    // the PEC byte of each message has to be added and checked on its own,
+    // and SMBus-only adapters take one transaction per transfer
+    if (unlikely((dev->flags & I2CBUS_FLAG_PEC) || !(dev->bus->funcs & I2C_FUNC_I2C)))
+    {
+        done = i2cbus_batch_each_locked(dev, batch->msgs, batch->num);
+        i2cbus_bus_unlock(dev->bus);
+        return done;
+    }
+    while (done < batch->num)
+    {
+        int n = batch->num - done;
+        if (n > I2C_RDWR_IOCTL_MAX_MSGS)
+        {
+            n = I2C_RDWR_IOCTL_MAX_MSGS;
+            // do not split a write-then-read pair to the same slave
+            struct i2c_msg *last = &(batch->msgs[done + n - 1]);
+            if (!(last->flags & I2C_M_RD) && (last[1].flags & I2C_M_RD) && last[1].addr == last->addr)
+                n--;
+        }
+        status = i2cbus_rdwr_ioctl(dev, &(batch->msgs[done]), n);
+        if (status != n)
+        {
+#ifdef I2C_DEBUG
+            eprintf("I2C_RDWR of %d segments failed with status %d, errno %d", n, status, errno);
+#endif
+            done = -1;
+            break;
+        }
+        done += n;
+    }
+    i2cbus_bus_unlock(dev->bus);
+    return done;
+}
+
+void i2cbus_batch_reset(i2cbus_batch *batch)
+{
+    if (batch != NULL)
+        batch->num = 0;
+}
+
+void i2cbus_batch_free(i2cbus_batch *batch)
+{
+    if (batch != NULL)
+    {
+        free(batch->msgs);
+        batch->msgs = NULL;
+        batch->num = 0;
+        batch->cap = 0;
+    }
+}
+
+#define I2CBUS_REQ_PENDING 0 /// Request submitted, no waiter
+#define I2CBUS_REQ_WAITING 1 /// Request submitted, a thread is blocked in i2cbus_req_wait()
+#define I2CBUS_REQ_DONE 2    /// Request complete
+
+#define I2CBUS_REQ_BARRIER ((i2cbus_req_type)-1) /// No operation, queued by i2cbus_close() behind the requests of a device
+
+/**
+ * @brief Push a request onto the queue of a bus. Wait-free, callable
+ * from any number of threads.
+ *
+ */
+static inline void i2cbus_queue_push(struct i2cbus_state *st, i2cbus_req *req)
+{
+    __atomic_store_n(&(req->next), NULL, __ATOMIC_RELAXED);
+    // sequentially consistent, so that a submitter that pushes after an
+    // exiting worker looked at the queue sees that the worker is gone
+    i2cbus_req *prev = atomic_exchange(&(st->qhead), req);
+    __atomic_store_n(&(prev->next), req, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Pop the oldest request off the queue of a bus. Only called by
+ * the worker thread of the bus.
+ *
+ * @return i2cbus_req* Oldest request, NULL if the queue is empty or a
+ * push is in progress
+ */
+static i2cbus_req *i2cbus_queue_pop(struct i2cbus_state *st)
+{
+    i2cbus_req *tail = st->qtail;
+    i2cbus_req *next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+    if (tail == &(st->qstub))
+    {
+        if (next == NULL)
+            return NULL;
+        st->qtail = next;
+        tail = next;
+        next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL)
+    {
+        st->qtail = next;
+        return tail;
+    }
+    if (tail != atomic_load_explicit(&(st->qhead), memory_order_acquire))
+        return NULL; // a producer is between exchange and link
+    i2cbus_queue_push(st, &(st->qstub));
+    next = __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE);
+    if (next != NULL)
+    {
+        st->qtail = next;
+        return tail;
+    }
+    return NULL;
+}
 
-#ifdef eprintf
-#undef eprintf
-#endif
+/**
+ * @brief Check whether the queue of a bus holds requests, including
+ * requests whose push has not completed yet.
+ *
+ */
+static inline int i2cbus_queue_pending(struct i2cbus_state *st)
+{
+    i2cbus_req *tail = st->qtail;
+    return __atomic_load_n(&(tail->next), __ATOMIC_ACQUIRE) != NULL ||
+           atomic_load(&(st->qhead)) != tail;
+}
 
-#define eprintf(str, ...)                                                                       \
-    {                                                                                           \
-        fprintf(stderr, "[%s/%s():%d] " str "\n", __FILE__, __func__, __LINE__, ##__VA_ARGS__); \
-        fflush(stderr);                                                                         \
+/**
+ * @brief Execute a request and signal its completion.
+ *
+ */
+static void i2cbus_req_complete(i2cbus_req *req)
+{
+    // closed from a completion callback, which cannot wait for its queue
+    if (unlikely(req->dev->bus == NULL))
+    {
+        errno = EBADF;
+        req->status = -1;
+        goto done;
+    }
+    if (req->type == I2CBUS_REQ_BARRIER)
+    {
+        req->status = 0;
+        goto done;
+    }
+    switch (req->type)
+    {
+    case I2CBUS_REQ_WRITE:
+        req->status = i2cbus_write(req->dev, req->outbuf, req->outlen);
+        break;
+    case I2CBUS_REQ_READ:
+        req->status = i2cbus_read(req->dev, req->inbuf, req->inlen);
+        break;
+    case I2CBUS_REQ_XFER:
+        req->status = i2cbus_xfer(req->dev, req->outbuf, req->outlen, req->inbuf, req->inlen, req->timeout_usec);
+        break;
+    case I2CBUS_REQ_XFER_YIELD:
+        req->status = i2cbus_xfer_yield(req->dev, req->outbuf, req->outlen, req->inbuf, req->inlen, req->timeout_usec);
+        break;
+    default:
+        errno = EINVAL;
+        req->status = -1;
+        break;
+    }
+done:
+    req->err = req->status < 0 ? errno : 0;
+    if (req->cb != NULL)
+        req->cb(req);
+    int efd = req->efd; // req may be reused as soon as it is marked done
+    if (__atomic_exchange_n(&(req->done), I2CBUS_REQ_DONE, __ATOMIC_ACQ_REL) == I2CBUS_REQ_WAITING)
+        syscall(SYS_futex, &(req->done), FUTEX_WAKE_PRIVATE, INT32_MAX, NULL, NULL, 0);
+    if (efd >= 0)
+    {
+        uint64_t one = 1;
+        if (write(efd, &one, sizeof(one)) != sizeof(one))
+            eprintf("Failed to signal completion eventfd %d, errno %d", efd, errno);
     }
+}
 
-static int i2clock_initd = 0; /// Indicate that the I2C bus has not been initialized
+static const int i2cbus_prio_rank[I2CBUS_PRIO_CLASSES] = {1, 0, 2}; /// Rank of each class, 0 runs first
 
-#ifndef I2CBUS_MAX_NUM
-#define I2CBUS_MAX_NUM 2 /// Maximum 2 /dev/i2cX
-#endif
 /**
- * @brief Set of mutexes for the I2C bus
+ * @brief Requests of one class waiting in the worker, oldest first,
+ * linked through i2cbus_req::next once popped off the submission queue.
  *
  */
-pthread_mutex_t i2cbus_locks[I2CBUS_MAX_NUM];
+struct i2cbus_prio_list
+{
+    i2cbus_req *head;
+    i2cbus_req *tail;
+};
 
-int i2cbus_open(i2cbus *dev, int id, int addr)
+/**
+ * @brief Pick the next request to run: the oldest request of the class of
+ * best rank once aged by one rank per aging interval waited, the oldest
+ * of those that tie.
+ *
+ * @return i2cbus_req* Request removed from its list, NULL if all lists are empty
+ */
+static i2cbus_req *i2cbus_sched_pick(struct i2cbus_state *st, struct i2cbus_prio_list *list)
 {
-    int ret = 0;
-    char fname[256];
-    if (i2clock_initd++ == 0) // only do it when the lock init is zero
+    uint64_t aging = atomic_load_explicit(&(st->aging_ns), memory_order_relaxed);
+    uint64_t now = aging ? i2cbus_now_ns() : 0;
+    int best = -1, best_rank = I2CBUS_PRIO_CLASSES, top_rank = I2CBUS_PRIO_CLASSES;
+    for (int c = 0; c < I2CBUS_PRIO_CLASSES; c++)
     {
-        pthread_mutexattr_t attr;
-        ret = pthread_mutexattr_init(&attr);
-        if (ret)
-        {
-            eprintf("Could not initialize mutex attribute");
-            ret = -1;
-            goto err;
-        }
-        ret = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-        if (ret)
+        i2cbus_req *req = list[c].head;
+        if (req == NULL)
+            continue;
+        int rank = i2cbus_prio_rank[c];
+        top_rank = rank < top_rank ? rank : top_rank;
+        if (aging && now > req->queued_ns)
         {
-            eprintf("Could not initialize mutex attribute");
-            pthread_mutexattr_destroy(&attr);
-            ret = -1;
-            goto err;
+            uint64_t steps = (now - req->queued_ns) / aging;
+            rank = steps >= (uint64_t)rank ? 0 : rank - (int)steps;
         }
-        for (int i = 0; i < I2CBUS_MAX_NUM; i++)
+        if (best < 0 || rank < best_rank || (rank == best_rank && req->queued_ns < list[best].head->queued_ns))
         {
-            ret = pthread_mutex_init(&(i2cbus_locks[i]), &attr);
-            if (ret)
-            {
-                eprintf("Failed to init mutex %d, ", i);
-                perror("mutex init");
-                pthread_mutexattr_destroy(&attr);
-                ret = -2;
-                goto err;
-            }
+            best = c;
+            best_rank = rank;
         }
-        pthread_mutexattr_destroy(&attr);
-    }
-    // check 1: memory
-    if (dev == NULL)
-    {
-        eprintf("Error: Device descriptor is NULL");
-        ret = -3;
-        goto err;
     }
-    // check 2: id > I2CBUS_MAX_NUM - 1
-    if (!(id < I2CBUS_MAX_NUM))
+    if (best < 0)
+        return NULL;
+    i2cbus_req *req = list[best].head;
+    list[best].head = req->next;
+    if (list[best].head == NULL)
+        list[best].tail = NULL;
+    if (i2cbus_prio_rank[best] > top_rank)
+        i2cbus_stat_add(&(st->stats.aged), 1);
+    return req;
+}
+
+/**
+ * @brief Exit the worker of a bus that has been asked to stop, unless
+ * requests came in. A submitter either pushes before the queue is checked
+ * here, or finds worker cleared after its push and starts a new worker.
+ *
+ * @return int 1 if the worker has been retired and must return, 0 otherwise
+ */
+static int i2cbus_worker_exit(struct i2cbus_state *st)
+{
+    pthread_mutex_lock(&i2cbus_worker_lock);
+    atomic_store(&(st->worker), 0);
+    // nobody writes to wakefd any more unless their request is queued
+    atomic_store(&(st->sleeping), 0);
+    if (i2cbus_queue_pending(st))
     {
-        eprintf("System supports up to %d ID, you provided %d.", I2CBUS_MAX_NUM - 1, id);
-        ret = -4;
-        goto err;
+        atomic_store(&(st->worker), 1);
+        pthread_mutex_unlock(&i2cbus_worker_lock);
+        return 0;
     }
-    // check 3: addr valid range
-    if (addr < 8)
+    close(st->wakefd);
+    st->wakefd = -1;
+    pthread_mutex_unlock(&i2cbus_worker_lock);
+    return 1;
+}
+
+/**
+ * @brief Worker thread of a bus: moves submitted requests into the list of
+ * their class and runs them one at a time in scheduling order, sleeping on
+ * the wake eventfd while nothing is waiting, until it is stopped.
+ *
+ */
+static void *i2cbus_worker(void *arg)
+{
+    struct i2cbus_state *st = arg;
+    struct i2cbus_prio_list list[I2CBUS_PRIO_CLASSES] = {{NULL, NULL}};
+    uint64_t cnt;
+    i2cbus_worker_self = st;
+    for (;;)
     {
-        fprintf(stderr, "%s: Address 0x%02x is invalid\n", __func__, addr);
-        ret = -5;
-        goto err;
+        // take in everything submitted so far, so that a realtime request
+        // that came in during the last transfer runs next
+        i2cbus_req *req;
+        while ((req = i2cbus_queue_pop(st)) != NULL)
+        {
+            struct i2cbus_prio_list *l = &list[req->prio];
+            req->next = NULL;
+            if (l->tail != NULL)
+                l->tail->next = req;
+            else
+                l->head = req;
+            l->tail = req;
+        }
+        if ((req = i2cbus_sched_pick(st, list)) != NULL)
+        {
+            i2cbus_req_complete(req);
+            continue;
+        }
+        atomic_store(&(st->sleeping), 1);
+        if (i2cbus_queue_pending(st))
+        {
+            atomic_store(&(st->sleeping), 0);
+            sched_yield(); // let a producer finish linking its request
+            continue;
+        }
+        if (atomic_load(&(st->stop)))
+        {
+            if (i2cbus_worker_exit(st))
+                break;
+            continue;
+        }
+        if (read(st->wakefd, &cnt, sizeof(cnt)) < 0 && errno != EINTR)
+        {
+            eprintf("Worker for bus %d failed to wait on eventfd, errno %d", st->id, errno);
+            usleep(1000);
+        }
+        atomic_store(&(st->sleeping), 0);
     }
+    return NULL;
+}
 
-    // Try to open the file descriptor
-    // step 1: Create file name
-    if (snprintf(fname, 256, "/dev/i2c-%d", id) < 0)
+/**
+ * @brief Start the worker thread of a bus if it is not running yet.
+ *
+ * @return int 0 on success, negative on error
+ */
+static int i2cbus_worker_start(struct i2cbus_state *st)
+{
+    int ret = 0;
+    pthread_mutex_lock(&i2cbus_worker_lock);
+    if (atomic_load(&(st->worker)))
+        goto out;
+    if (st->wakefd < 0 && (st->wakefd = eventfd(0, EFD_CLOEXEC)) < 0)
     {
-        eprintf("Failed to generate device filename using snprintf. FATAL Error!");
-        ret = -6;
-        goto err;
+        eprintf("Could not create eventfd for bus %d, errno %d", st->id, errno);
+        ret = -1;
+        goto out;
     }
-    if ((dev->fd = open(fname, O_RDWR)) < 0)
+    atomic_store(&(st->stop), 0);
+    int status = pthread_create(&(st->worker_thread), NULL, i2cbus_worker, st);
+    if (status)
     {
-        eprintf("Failed to open %s. Error %d\n", fname, errno);
-        ret = -errno;
-        goto err;
+        eprintf("Could not create worker thread for bus %d, error %d", st->id, status);
+        ret = -1;
+        goto out;
     }
-    if (ioctl(dev->fd, I2C_SLAVE, addr) < 0)
+    char name[16];
+    snprintf(name, sizeof(name), "i2cbus-%d", st->id);
+    pthread_setname_np(st->worker_thread, name);
+    atomic_store(&(st->worker), 1);
+out:
+    pthread_mutex_unlock(&i2cbus_worker_lock);
+    return ret;
+}
+
+/**
+ * @brief Stop the worker thread of a bus once it has run the requests
+ * already queued, and wait for it to exit. Called when the last device on
+ * the bus is closed; a later submission starts a new worker.
+ *
+ */
+static void i2cbus_worker_stop(struct i2cbus_state *st)
+{
+    pthread_mutex_lock(&i2cbus_worker_lock);
+    // not running, or already being stopped by another thread
+    if (!atomic_load(&(st->worker)) || atomic_load(&(st->stop)))
     {
-        eprintf("Failed to open I2C slave address 0x%02x on bus %s with error %d, returning...", addr, fname, errno);
-        close(dev->fd);
-        ret = -errno;
-        goto err;
+        pthread_mutex_unlock(&i2cbus_worker_lock);
+        return;
     }
-    // if we are here, then everything was successful
-    dev->id = id;                    // assign device id
-    dev->lock = &(i2cbus_locks[id]); // assign lock
-    return dev->fd;
-err:
-    i2clock_initd--;
-    return -1;
+    pthread_t thread = st->worker_thread;
+    atomic_store(&(st->stop), 1);
+    uint64_t one = 1;
+    if (write(st->wakefd, &one, sizeof(one)) != sizeof(one))
+        eprintf("Failed to wake worker of bus %d, errno %d", st->id, errno);
+    pthread_mutex_unlock(&i2cbus_worker_lock);
+    if (pthread_equal(thread, pthread_self()))
+        pthread_detach(thread); // closed from a completion callback, exits after it
+    else
+        pthread_join(thread, NULL);
 }
 
-int i2cbus_close(i2cbus *dev)
+/**
+ * @brief Wait until the worker of a bus has run the requests submitted
+ * so far, by queueing a no-op request behind them in the lowest class:
+ * requests submitted earlier rank at least as high and are older, so the
+ * scheduler runs them first, aged or not. Returns at once if no worker
+ * runs, and on the worker itself, which cannot wait for its own queue.
+ *
+ */
+static void i2cbus_worker_drain(struct i2cbus_state *st, i2cbus *dev)
+{
+    if (!atomic_load(&(st->worker)) || i2cbus_worker_self == st)
+        return;
+    i2cbus_req req = {
+        .dev = dev,
+        .type = I2CBUS_REQ_BARRIER,
+        .prio = I2CBUS_PRIO_BULK,
+        .cb = NULL,
+        .efd = -1,
+    };
+    if (i2cbus_submit(&req) > 0)
+        i2cbus_req_wait(&req);
+}
+
+int i2cbus_submit(i2cbus_req *req)
 {
-    if (--i2clock_initd == 0) // only do it when the lock init is zero
+    if (unlikely(req == NULL))
     {
-        for (int i = 0; i < I2CBUS_MAX_NUM; i++)
-        {
-            int ret = pthread_mutex_destroy(&(i2cbus_locks[i]));
-            if (ret != 0)
-            {
-                eprintf("Failed to destroy mutex %d, ", i);
-                perror("mutex destroy");
-                return -1;
-            }
-        }
+        eprintf("Invalid request pointer NULL");
+        return -1;
     }
-    if (dev != NULL)
+    if (unlikely(req->dev == NULL || req->dev->fd < 0 || req->dev->bus == NULL))
     {
-        if (dev->fd > 0)
-            return close(dev->fd);
+        eprintf("Invalid device pointer %p", req->dev);
+        return -1;
     }
-    else
+    if (unlikely((unsigned int)req->prio >= I2CBUS_PRIO_CLASSES))
     {
-        eprintf("Invalid device descriptor");
+        eprintf("Invalid scheduling class %d", req->prio);
         return -3;
     }
-    // will never reach this point
-    return -1;
+    struct i2cbus_state *st = req->dev->bus;
+    if (unlikely(!atomic_load_explicit(&(st->worker), memory_order_acquire)) && i2cbus_worker_start(st) < 0)
+        return -2;
+    req->status = -1;
+    req->err = 0;
+    req->queued_ns = i2cbus_now_ns();
+    __atomic_store_n(&(req->done), I2CBUS_REQ_PENDING, __ATOMIC_RELAXED);
+    i2cbus_queue_push(st, req);
+    // the worker may have exited between the check above and the push
+    if (unlikely(!atomic_load(&(st->worker))))
+    {
+        if (i2cbus_worker_start(st) < 0)
+            eprintf("Request queued on bus %d runs once a worker starts", st->id);
+        return 1;
+    }
+    if (atomic_exchange(&(st->sleeping), 0))
+    {
+        uint64_t one = 1;
+        if (write(st->wakefd, &one, sizeof(one)) != sizeof(one))
+            eprintf("Failed to wake worker of bus %d, errno %d", st->id, errno);
+    }
+    return 1;
 }
 
-#ifdef __GNUC__
-#define likely(x) __builtin_expect(!!(x), 1)
-#define unlikely(x) __builtin_expect(!!(x), 0)
-#else
-#define likely(x) (x)
-#define unlikely(x) (x)
-#endif
+int i2cbus_req_done(i2cbus_req *req)
+{
+    return __atomic_load_n(&(req->done), __ATOMIC_ACQUIRE) == I2CBUS_REQ_DONE;
+}
 
-int i2cbus_write(i2cbus *dev, void *buf, int len)
+int i2cbus_req_wait(i2cbus_req *req)
 {
-    // usual checks
-    if (unlikely(dev == NULL || dev->fd < 0))
+    // a completion callback waiting on its own worker would never wake up
+    if (unlikely(i2cbus_worker_self != NULL && i2cbus_worker_self == req->dev->bus && !i2cbus_req_done(req)))
     {
-        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev->fd);
-        return -1;
+        eprintf("Waiting on bus %d from its worker thread would deadlock", i2cbus_worker_self->id);
+        errno = EDEADLK;
+        return -EDEADLK;
     }
-    if (unlikely(buf == NULL))
+    int state = I2CBUS_REQ_PENDING;
+    if (__atomic_compare_exchange_n(&(req->done), &state, I2CBUS_REQ_WAITING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        state = I2CBUS_REQ_WAITING;
+    while (state != I2CBUS_REQ_DONE)
     {
-        eprintf("Invalid write buffer pointer NULL");
-        return -1;
+        syscall(SYS_futex, &(req->done), FUTEX_WAIT_PRIVATE, I2CBUS_REQ_WAITING, NULL, NULL, 0);
+        state = __atomic_load_n(&(req->done), __ATOMIC_ACQUIRE);
     }
-    int status = pthread_mutex_lock(dev->lock);
-    if (status)
+    return req->status;
+}
+
+int i2cbus_xfer_prio(i2cbus *dev, i2cbus_req_prio prio, void *outbuf, int outlen,
+                     void *inbuf, int inlen, unsigned long timeout_usec)
+{
+    i2cbus_req req = {
+        .dev = dev,
+        .type = I2CBUS_REQ_XFER,
+        .prio = prio,
+        .outbuf = outbuf,
+        .outlen = outlen,
+        .inbuf = inbuf,
+        .inlen = inlen,
+        .timeout_usec = timeout_usec,
+        .cb = NULL,
+        .efd = -1,
+    };
+    if (unlikely(i2cbus_worker_self != NULL && dev != NULL && i2cbus_worker_self == dev->bus))
     {
-        eprintf("Mutex lock returned %d, error", status);
-        return -1;
+        eprintf("Synchronous request on bus %d from its worker thread would deadlock", i2cbus_worker_self->id);
+        errno = EDEADLK;
+        return -EDEADLK;
     }
-    status = write(dev->fd, buf, len);
-    if (status != len)
+    int ret = i2cbus_submit(&req);
+    if (ret < 0)
+        return ret;
+    ret = i2cbus_req_wait(&req);
+    if (ret < 0)
+        errno = req.err;
+    return ret;
+}
+
+int i2cbus_set_bus_aging(unsigned int bus, unsigned long aging_usec)
+{
+    struct i2cbus_state *st = i2cbus_state_find(bus);
+    if (unlikely(st == NULL))
     {
-#ifdef I2C_DEBUG
-        eprintf("Failed to write %d bytes, wrote %d bytes, errno %d", len, status, errno);
-#endif
+        eprintf("Bus index %u has not been opened", bus);
+        return -100;
     }
-    pthread_mutex_unlock(dev->lock);
-    return status;
+    atomic_store_explicit(&(st->aging_ns), aging_usec * 1000ULL, memory_order_relaxed);
+    return 1;
 }
 
-int i2cbus_read(i2cbus *dev, void *buf, int len)
+int i2cbus_set_lock_shm(const char *name)
 {
-    // usual checks
-    if (unlikely(dev == NULL || dev->fd < 0))
+    pthread_once(&i2cbus_init_once, i2cbus_init);
+    if (i2cbus_init_status)
     {
-        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev->fd);
+        errno = EAGAIN;
         return -1;
     }
-    if (unlikely(buf == NULL))
+    if (name == NULL)
     {
-        eprintf("Invalid write buffer pointer NULL");
+        eprintf("Invalid shared memory object name");
+        errno = EINVAL;
         return -1;
     }
-    int status = pthread_mutex_lock(dev->lock);
-    if (status)
+    int ret = -1, fd = -1;
+    struct i2cbus_shm *shm = MAP_FAILED;
+    struct stat sb;
+    pthread_mutex_lock(&i2cbus_table_lock);
+    // bus states pick their lock when they are created
+    if (i2cbus_shm != NULL || atomic_load_explicit(&i2cbus_table, memory_order_relaxed) != NULL)
     {
-        eprintf("Mutex lock returned %d, error", status);
-        return -1;
+        eprintf("Shared locks are already set up or a bus has already been opened");
+        errno = EBUSY;
+        goto out;
     }
-    status = read(dev->fd, buf, len);
-    if (status != len)
+    if (i2cbus_lock_protocol == PTHREAD_PRIO_PROTECT || i2cbus_lock_fair)
     {
-#ifdef I2C_DEBUG
-        eprintf("Failed to read %d bytes, read %d bytes, errno %d", len, status, errno);
-#endif
+        eprintf("Shared bus locks support neither the priority ceiling protocol nor fair locking");
+        errno = ENOTSUP;
+        goto out;
     }
-    pthread_mutex_unlock(dev->lock);
-    return status;
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0660)) < 0)
+    {
+        eprintf("Could not open shared memory object %s, errno %d", name, errno);
+        goto out;
+    }
+    // a fresh object is zero filled, i.e. every slot is free
+    if (fstat(fd, &sb) < 0 || (sb.st_size == 0 && ftruncate(fd, sizeof(struct i2cbus_shm)) < 0))
+    {
+        eprintf("Could not size shared memory object %s, errno %d", name, errno);
+        goto out;
+    }
+    if (sb.st_size != 0 && (size_t)sb.st_size != sizeof(struct i2cbus_shm))
+    {
+        eprintf("Shared memory object %s has size %lld, expected %zu", name, (long long)sb.st_size, sizeof(struct i2cbus_shm));
+        errno = EPROTO;
+        goto out;
+    }
+    shm = mmap(NULL, sizeof(struct i2cbus_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm == MAP_FAILED)
+    {
+        eprintf("Could not map shared memory object %s, errno %d", name, errno);
+        goto out;
+    }
+    unsigned int magic = 0;
+    if (!atomic_compare_exchange_strong(&(shm->magic), &magic, I2CBUS_SHM_MAGIC) && magic != I2CBUS_SHM_MAGIC)
+    {
+        eprintf("Shared memory object %s has an unknown layout (0x%08x)", name, magic);
+        munmap(shm, sizeof(struct i2cbus_shm));
+        errno = EPROTO;
+        goto out;
+    }
+    i2cbus_shm = shm;
+    ret = 1;
+out:
+    if (fd >= 0)
+        close(fd);
+    pthread_mutex_unlock(&i2cbus_table_lock);
+    return ret;
 }
 
-int i2cbus_xfer(i2cbus *dev,
-                void *outbuf, int outlen,
-                void *inbuf, int inlen,
-                unsigned long timeout_usec)
+int i2cbus_set_lock_protocol(int protocol, int prioceiling)
 {
-    // usual checks
-    if (unlikely(dev == NULL || dev->fd < 0))
+    pthread_once(&i2cbus_init_once, i2cbus_init);
+    if (i2cbus_init_status)
     {
-        eprintf("Invalid device pointer %p or file descriptor %d", dev, dev->fd);
+        errno = EAGAIN;
         return -1;
     }
-    if (unlikely(outbuf == NULL))
+    if (protocol != PTHREAD_PRIO_NONE && protocol != PTHREAD_PRIO_INHERIT && protocol != PTHREAD_PRIO_PROTECT)
     {
-        eprintf("Invalid write buffer pointer NULL");
+        eprintf("Invalid lock protocol %d", protocol);
+        errno = EINVAL;
         return -1;
     }
-    if (unlikely(inbuf == NULL))
+    if (protocol == PTHREAD_PRIO_PROTECT &&
+        (prioceiling < sched_get_priority_min(SCHED_FIFO) || prioceiling > sched_get_priority_max(SCHED_FIFO)))
     {
-        eprintf("Invalid read buffer pointer NULL");
+        eprintf("Invalid priority ceiling %d", prioceiling);
+        errno = EINVAL;
         return -1;
     }
-    int status = pthread_mutex_lock(dev->lock);
-    if (status)
+    int ret = 0;
+    pthread_mutex_lock(&i2cbus_table_lock);
+    // robust mutexes, which the shared locks are, cannot be priority protected
+    if (protocol == PTHREAD_PRIO_PROTECT && i2cbus_shm != NULL)
     {
-        eprintf("Mutex lock returned %d, error", status);
-        return -1;
+        eprintf("Shared bus locks do not support the priority ceiling protocol");
+        ret = ENOTSUP;
+        goto out;
     }
-#ifdef I2C_DEBUG
-    eprintf("Sending %d bytes ->", outlen);
-    for (int i = 0; i < outlen; i++)
+    // the ceiling only sticks once the protocol is set
+    if ((ret = pthread_mutexattr_setprotocol(&i2cbus_lock_attr, protocol)))
+        goto out;
+    if (protocol == PTHREAD_PRIO_PROTECT && (ret = pthread_mutexattr_setprioceiling(&i2cbus_lock_attr, prioceiling)))
     {
-        fprintf(stderr, " %02xh", ((unsigned char *)outbuf)[i]);
+        eprintf("Could not set priority ceiling %d, error %d", prioceiling, ret);
+        pthread_mutexattr_setprotocol(&i2cbus_lock_attr, i2cbus_lock_protocol);
+        goto out;
     }
-    eprintf("\n");
-#endif
-    status = write(dev->fd, outbuf, outlen);
-    if (status != outlen)
+    if (protocol != PTHREAD_PRIO_PROTECT)
+        pthread_mutexattr_setprotocol(&i2cbus_shm_attr, protocol);
+    i2cbus_lock_protocol = protocol;
+out:
+    pthread_mutex_unlock(&i2cbus_table_lock);
+    if (ret)
     {
-#ifdef I2C_DEBUG
-        eprintf("Failed to write %d bytes, wrote %d bytes, errno %d", outlen, status, errno);
-#endif
-        goto ret;
+        errno = ret;
+        return -1;
     }
-    if (timeout_usec > 0)
+    return 1;
+}
+
+int i2cbus_set_lock_fair(int fair)
+{
+    pthread_mutex_lock(&i2cbus_table_lock);
+    // the waiters of a fair lock queue up on their own stacks
+    if (fair && i2cbus_shm != NULL)
     {
-        usleep(timeout_usec);
+        pthread_mutex_unlock(&i2cbus_table_lock);
+        eprintf("Shared bus locks do not support fair locking");
+        errno = ENOTSUP;
+        return -1;
     }
-    status = read(dev->fd, inbuf, inlen);
-    if (status != inlen)
+    i2cbus_lock_fair = fair != 0;
+    pthread_mutex_unlock(&i2cbus_table_lock);
+    return 1;
+}
+
+int i2cbus_lock(unsigned int bus)
+{
+    struct i2cbus_state *st = i2cbus_state_find(bus);
+    if (unlikely(st == NULL))
     {
-#ifdef I2C_DEBUG
-        eprintf("Failed to read %d bytes, read %d bytes, errno %d", inlen, status, errno);
-#endif
-        goto ret;
+        eprintf("Bus index %u has not been opened", bus);
+        return -100;
     }
-#ifdef I2C_DEBUG
-    eprintf("Receiving %d bytes ->", inlen);
-    for (int i = 0; i < inlen; i++)
+    int ret = i2cbus_bus_lock(st);
+    if (ret)
+        return -ret;
+    return 1;
+}
+
+int i2cbus_trylock(unsigned int bus)
+{
+    struct i2cbus_state *st = i2cbus_state_find(bus);
+    if (unlikely(st == NULL))
     {
-        fprintf(stderr, " %02xh", ((unsigned char *)inbuf)[i]);
+        eprintf("Bus index %u has not been opened", bus);
+        return -100;
     }
-    eprintf("\n");
-#endif
-ret:
-    pthread_mutex_unlock(dev->lock);
-    return status;
+    int ret = st->fair ? i2cbus_fairlock_trylock(st->fair) : pthread_mutex_trylock(st->mtx);
+    if (unlikely(ret == EOWNERDEAD))
+        ret = i2cbus_bus_recover(st);
+    if (ret)
+        return -ret;
+    i2cbus_stat_add(&(st->stats.lock_acquisitions), 1);
+    return 1;
 }
 
-int i2cbus_lock(unsigned int bus)
+int i2cbus_timedlock(unsigned int bus, const struct timespec *deadline)
 {
-    if (unlikely(bus >= I2CBUS_MAX_NUM))
+    struct i2cbus_state *st = i2cbus_state_find(bus);
+    if (unlikely(st == NULL || deadline == NULL))
     {
-        eprintf("Bus index %d not supported, maximum is %d", bus, I2CBUS_MAX_NUM - 1);
+        eprintf("Bus index %u has not been opened or deadline pointer %p invalid", bus, deadline);
         return -100;
     }
-    int ret = pthread_mutex_lock(&(i2cbus_locks[bus]));
+    int ret = i2cbus_bus_timedlock(st, deadline);
     if (ret)
         return -ret;
     return 1;
 }
 
-int i2cbus_trylock(unsigned int bus)
+int i2cbus_unlock(unsigned int bus)
+{
+    struct i2cbus_state *st = i2cbus_state_find(bus);
+    if (unlikely(st == NULL))
+    {
+        eprintf("Bus index %u has not been opened", bus);
+        return -100;
+    }
+    int ret = i2cbus_bus_unlock(st);
+    if (ret)
+        return -ret;
+    return 1;
+}
+int i2cbus_set_bus_policy(unsigned int bus, const i2cbus_policy *policy)
 {
-    if (unlikely(bus >= I2CBUS_MAX_NUM))
+    struct i2cbus_state *st = i2cbus_state_find(bus);
+    if (unlikely(st == NULL || policy == NULL))
     {
-        eprintf("Bus index %d not supported, maximum is %d", bus, I2CBUS_MAX_NUM - 1);
+        eprintf("Bus index %u has not been opened or policy pointer %p invalid", bus, policy);
         return -100;
     }
-    int ret = pthread_mutex_trylock(&(i2cbus_locks[bus]));
+    int ret = i2cbus_bus_lock_quiet(st);
     if (ret)
         return -ret;
+    st->policy = *policy;
+    i2cbus_bus_unlock(st);
     return 1;
 }
 
-int i2cbus_unlock(unsigned int bus)
+int i2cbus_get_stats(unsigned int bus, i2cbus_stats *stats)
 {
-    if (unlikely(bus >= I2CBUS_MAX_NUM))
+    struct i2cbus_state *st = i2cbus_state_find(bus);
+    if (unlikely(st == NULL || stats == NULL))
     {
-        eprintf("Bus index %d not supported, maximum is %d", bus, I2CBUS_MAX_NUM - 1);
+        eprintf("Bus index %u has not been opened or stats pointer %p invalid", bus, stats);
         return -100;
     }
-    int ret = pthread_mutex_unlock(&(i2cbus_locks[bus]));
+    struct i2cbus_counters *ctr = &(st->stats);
+    stats->transactions = atomic_load_explicit(&(ctr->transactions), memory_order_relaxed);
+    stats->bytes_out = atomic_load_explicit(&(ctr->bytes_out), memory_order_relaxed);
+    stats->bytes_in = atomic_load_explicit(&(ctr->bytes_in), memory_order_relaxed);
+    stats->errors = atomic_load_explicit(&(ctr->errors), memory_order_relaxed);
+    stats->nacks = atomic_load_explicit(&(ctr->nacks), memory_order_relaxed);
+    stats->pec_errors = atomic_load_explicit(&(ctr->pec_errors), memory_order_relaxed);
+    stats->retries = atomic_load_explicit(&(ctr->retries), memory_order_relaxed);
+    for (int i = 0; i < I2CBUS_STATS_ERRNO_MAX; i++)
+        stats->errno_count[i] = atomic_load_explicit(&(ctr->errno_count[i]), memory_order_relaxed);
+    stats->lock_acquisitions = atomic_load_explicit(&(ctr->lock_acquisitions), memory_order_relaxed);
+    stats->lock_contended = atomic_load_explicit(&(ctr->lock_contended), memory_order_relaxed);
+    stats->lock_wait_ns = atomic_load_explicit(&(ctr->lock_wait_ns), memory_order_relaxed);
+    stats->lock_recovered = atomic_load_explicit(&(ctr->lock_recovered), memory_order_relaxed);
+    stats->deadline_misses = atomic_load_explicit(&(ctr->deadline_misses), memory_order_relaxed);
+    stats->aged = atomic_load_explicit(&(ctr->aged), memory_order_relaxed);
+    stats->xfer_ns = atomic_load_explicit(&(ctr->xfer_ns), memory_order_relaxed);
+    for (int i = 0; i < I2CBUS_STATS_HIST_BUCKETS; i++)
+        stats->xfer_hist[i] = atomic_load_explicit(&(ctr->xfer_hist[i]), memory_order_relaxed);
+    return 1;
+}
+
+int i2cbus_reset_stats(unsigned int bus)
+{
+    struct i2cbus_state *st = i2cbus_state_find(bus);
+    if (unlikely(st == NULL))
+    {
+        eprintf("Bus index %u has not been opened", bus);
+        return -100;
+    }
+    int ret = i2cbus_bus_lock_quiet(st);
     if (ret)
         return -ret;
+    struct i2cbus_counters *ctr = &(st->stats);
+    atomic_store_explicit(&(ctr->transactions), 0, memory_order_relaxed);
+    atomic_store_explicit(&(ctr->bytes_out), 0, memory_order_relaxed);
+    atomic_store_explicit(&(ctr->bytes_in), 0, memory_order_relaxed);
+    atomic_store_explicit(&(ctr->errors), 0, memory_order_relaxed);
+    atomic_store_explicit(&(ctr->nacks), 0, memory_order_relaxed);
+    atomic_store_explicit(&(ctr->pec_errors), 0, memory_order_relaxed);
+    atomic_store_explicit(&(ctr->retries), 0, memory_order_relaxed);
+    atomic_store_explicit(&(ctr->deadline_misses), 0, memory_order_relaxed);
+    atomic_store_explicit(&(ctr->aged), 0, memory_order_relaxed);
+    for (int i = 0; i < I2CBUS_STATS_ERRNO_MAX; i++)
+        atomic_store_explicit(&(ctr->errno_count[i]), 0, memory_order_relaxed);
+    atomic_store_explicit(&(ctr->lock_acquisitions), 0, memory_order_relaxed);
+    atomic_store_explicit(&(ctr->lock_contended), 0, memory_order_relaxed);
+    atomic_store_explicit(&(ctr->lock_wait_ns), 0, memory_order_relaxed);
+    atomic_store_explicit(&(ctr->lock_recovered), 0, memory_order_relaxed);
+    atomic_store_explicit(&(ctr->xfer_ns), 0, memory_order_relaxed);
+    for (int i = 0; i < I2CBUS_STATS_HIST_BUCKETS; i++)
+        atomic_store_explicit(&(ctr->xfer_hist[i]), 0, memory_order_relaxed);
+    i2cbus_bus_unlock(st);
     return 1;
-}
\ No newline at end of file
+}
+
+unsigned long long i2cbus_stats_hist_value(int idx)
+{
+    if (idx < I2CBUS_STATS_HIST_SUB)
+        return idx < 0 ? 0 : idx;
+    int shift = (idx >> I2CBUS_STATS_HIST_SUB_BITS) - 1;
+    return ((unsigned long long)(I2CBUS_STATS_HIST_SUB + (idx & (I2CBUS_STATS_HIST_SUB - 1)))) << shift;
+}
+
+unsigned long long i2cbus_stats_percentile(const i2cbus_stats *stats, double pct)
+{
+    unsigned long long total = 0, seen = 0;
+    for (int i = 0; i < I2CBUS_STATS_HIST_BUCKETS; i++)
+        total += stats->xfer_hist[i];
+    if (total == 0)
+        return 0;
+    unsigned long long target = total * pct / 100.0;
+    for (int i = 0; i < I2CBUS_STATS_HIST_BUCKETS; i++)
+    {
+        seen += stats->xfer_hist[i];
+        if (seen > target)
+            return i2cbus_stats_hist_value(i);
+    }
+    return i2cbus_stats_hist_value(I2CBUS_STATS_HIST_BUCKETS - 1);
+}
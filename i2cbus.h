@@ -13,7 +13,92 @@
 #ifdef __cplusplus 
 extern "C" {
 #endif
+#include <stddef.h>
+#include <time.h>
 #include <pthread.h>
+#include "i2cbus_api.h"
+
+struct i2c_msg;
+struct i2cbus_state;
+
+/**
+ * @brief Flag for i2cbus::flags: perform the write and read phases of
+ * i2cbus_xfer() as a single I2C_RDWR transaction with a repeated start
+ * (when no inter-phase timeout is requested).
+ * 
+ */
+#define I2CBUS_FLAG_RDWR 0x1
+/**
+ * @brief Flag for i2cbus::flags: use SMBus Packet Error Checking. SMBus
+ * transactions use the PEC support of the kernel (I2C_PEC) and fail with
+ * EOPNOTSUPP on adapters without it. Over plain I2C, i2cbus_write(),
+ * i2cbus_read() and the i2cbus_xfer() family append a PEC byte to each
+ * write transaction and read and check one at the end of each read
+ * transaction; a bad PEC fails the transfer with EBADMSG. Batches run
+ * their segments one transfer at a time to carry the PEC bytes.
+ * 
+ */
+#define I2CBUS_FLAG_PEC 0x2
+
+/**
+ * @brief Transport backend of a bus. The operations have the semantics
+ * of open(), close() and ioctl() on the i2c-dev character device, and
+ * return -1 with errno set on failure. A backend must at least support
+ * the I2C_RDWR request.
+ * 
+ */
+typedef struct i2cbus_backend
+{
+    const char *name; ///< Backend name, for diagnostics
+    /**
+     * @brief Open bus id, returning a non-negative handle or -1.
+     */
+    int (*open)(const struct i2cbus_backend *be, int id);
+    /**
+     * @brief Close a handle returned by open.
+     */
+    int (*close)(const struct i2cbus_backend *be, int handle);
+    /**
+     * @brief Perform an i2c-dev ioctl request (I2C_RDWR, ...) on a handle.
+     */
+    int (*ioctl)(const struct i2cbus_backend *be, int handle, unsigned long request, void *arg);
+    void *priv; ///< Backend private data
+} i2cbus_backend;
+
+/**
+ * @brief Backend using the Linux i2c-dev character devices (/dev/i2c-X).
+ * 
+ */
+I2CBUS_API extern const i2cbus_backend i2cbus_backend_chardev;
+
+/**
+ * @brief Timeout and retry policy of a bus or a device. The kernel
+ * adapter timeout and retry count are set on the bus file descriptor
+ * (I2C_TIMEOUT, I2C_RETRIES) only when they differ from what was set
+ * last. Transfers that fail with a NACK (ENXIO, EREMOTEIO) or EAGAIN are
+ * tried again up to user_retries times, with the bus lock released during
+ * the backoff. A lock the caller holds itself (i2cbus_lock(), register
+ * maps, batches) stays held, so the bus is blocked for the whole backoff.
+ * Only enable user retries for idempotent transfers.
+ * 
+ */
+typedef struct
+{
+    int timeout_ms;              ///< Kernel adapter timeout in ms (rounded up to 10 ms), 0 to keep the current setting
+    int retries;                 ///< Kernel adapter retries on arbitration loss, -1 to keep the current setting
+    int user_retries;            ///< Times a NACKed transfer is tried again in userspace
+    unsigned int backoff_us;     ///< Delay before the first userspace retry, doubled for every retry after
+    unsigned int backoff_max_us; ///< Upper bound of the retry delay, 0 for I2CBUS_BACKOFF_MAX_US
+} i2cbus_policy;
+#ifndef I2CBUS_BACKOFF_MAX_US
+#define I2CBUS_BACKOFF_MAX_US 100000 ///< Upper bound of the retry delay of policies that set none (us)
+#endif
+/**
+ * @brief Initializer of a policy that keeps the kernel settings and does
+ * not retry in userspace.
+ * 
+ */
+#define I2CBUS_POLICY_INIT {.timeout_ms = 0, .retries = -1, .user_retries = 0, .backoff_us = 0, .backoff_max_us = 0}
 
 /**
  * @brief Structure describing an I2C bus.
@@ -21,27 +106,64 @@ extern "C" {
  */
 typedef struct
 {
-    int fd;                ///< I2C device file descriptor
+    int fd;                ///< I2C bus file descriptor (backend handle), shared by all devices on /dev/i2c-X
     int id;                ///< I2C device file id (X in /dev/i2c-X)
-    pthread_mutex_t *lock; ///< Lock corresponding to the /dev/i2c-X file, assigned from the locks array indexed by id
+    int addr;              ///< I2C slave address
+    unsigned int flags;    ///< Transfer mode flags (I2CBUS_FLAG_*), cleared by i2cbus_open()
+    /**
+     * @brief Lock corresponding to the /dev/i2c-X file, assigned from the
+     * bus table indexed by id. Deprecated: use i2cbus_lock(),
+     * i2cbus_trylock(), i2cbus_timedlock() and i2cbus_unlock(), which work
+     * with every kind of bus lock. A bus with a fair lock
+     * (i2cbus_set_lock_fair()) has no mutex, and this is NULL.
+     */
+    pthread_mutex_t *lock I2CBUS_DEPRECATED("use i2cbus_lock()/i2cbus_unlock(); NULL on buses with fair locks");
+    struct i2cbus_state *bus; ///< Bus state shared by all devices on /dev/i2c-X (opaque)
+    const i2cbus_backend *be; ///< Transport backend of the bus
+    const i2cbus_policy *policy; ///< Timeout and retry policy of the device, NULL to follow the bus policy (cleared by i2cbus_open())
 } i2cbus;
 /**
- * @brief Open an I2C bus file descriptor using the supplied parameters.
+ * @brief Open an I2C device using the supplied parameters.
  * 
+ * The /dev/i2c-X file is opened once, by the first device on the bus, and
+ * shared by every device on that bus. The address is checked once with
+ * I2C_SLAVE, which fails with EBUSY if a kernel driver has claimed it.
+ * Transfers address the slave in each message (I2C_RDWR), so the returned
+ * file descriptor is shared and not bound to the slave of this device:
+ * do not read() or write() on it directly.
  * 
  * @param dev i2c device descriptor
  * @param id i2c device file ID (X in /dev/i2c-X)
+ * @param addr i2c slave address (7-bit, 0x08 to 0x7f)
+ * @return int fd, non-negative on success, negative on error: -5 for an invalid
+ * address, negative errno of I2C_SLAVE (e.g. -EBUSY) if the address cannot be used.
+ * See open() for details.
+ */
+I2CBUS_API int i2cbus_open(i2cbus *dev, int id, int addr);
+/**
+ * @brief Open an I2C device on a bus provided by the given backend,
+ * e.g. a simulated bus. All devices on a bus must use the same backend.
+ * 
+ * @param dev i2c device descriptor
+ * @param id Bus ID, passed to the open operation of the backend
  * @param addr i2c slave address
- * @return int fd, non-negative on success, negative on error. See open() for details.
+ * @param be Transport backend
+ * @return int Backend handle, non-negative on success, negative on error.
  */
-int i2cbus_open(i2cbus *dev, int id, int addr);
+I2CBUS_API int i2cbus_open_backend(i2cbus *dev, int id, int addr, const i2cbus_backend *be);
 /**
- * @brief Close the file descriptor for the I2C device. 
+ * @brief Close the I2C device. Requests already submitted for the device
+ * (see i2cbus_submit()) are run first, and when the last device on the bus
+ * is closed the worker thread of the bus is stopped after that, before the
+ * bus file descriptor is closed. This call waits for the worker, so a
+ * device must not be closed while holding the bus lock with i2cbus_lock().
+ * Closed from a completion callback, it cannot wait for the worker it runs
+ * on: requests of the device still queued then fail with EBADF.
  * 
  * @param dev i2c device descriptor.
  * @returns (int) Return code from close() or negative on error.
  */
-int i2cbus_close(i2cbus *dev);
+I2CBUS_API int i2cbus_close(i2cbus *dev);
 /**
  * @brief Write bytes to the i2c device.
  * Note: Bus access by this function is protected by a recursive
@@ -52,7 +174,9 @@ int i2cbus_close(i2cbus *dev);
  * @param len Length of byte array
  * @return int Length of bytes written on success, -1 on failure
  */
-int i2cbus_write(i2cbus *dev, void *buf, int len);
+#ifndef I2CBUS_INLINE_CHECKS
+I2CBUS_API int i2cbus_write(i2cbus *dev, void *buf, int len);
+#endif
 /**
  * @brief Read bytes from the i2c device.
  * Note: Bus access by this function is protected by a recursive
@@ -63,13 +187,20 @@ int i2cbus_write(i2cbus *dev, void *buf, int len);
  * @param len Length of byte array
  * @return int Length of bytes read on success, -1 on failure
  */
-int i2cbus_read(i2cbus *dev, void *buf, int len);
+#ifndef I2CBUS_INLINE_CHECKS
+I2CBUS_API int i2cbus_read(i2cbus *dev, void *buf, int len);
+#endif
 /**
  * @brief Function to do a write, and get the reply in one operation
  * in order to avoid read/write mangling with multiple threads 
  * accessing the bus. Avoid using this function if you have read or
  * write buffer lengths zero.
  * 
+ * If I2CBUS_FLAG_RDWR is set in dev->flags and timeout_usec is 0,
+ * the transfer is performed as in i2cbus_xfer_rdwr(). On adapters
+ * without I2C_FUNC_I2C it always is, as one SMBus transaction, and
+ * timeout_usec is ignored.
+ * 
  * Note: Bus access by this function is protected by a recursive
  * pthread mutex.
  * 
@@ -81,32 +212,744 @@ int i2cbus_read(i2cbus *dev, void *buf, int len);
  * @param timeout_usec Timeout between read and write (in microseconds)
  * @return int Length of bytes read on success, -1 on failure
  */
-int i2cbus_xfer(i2cbus *dev,
-                void *outbuf, int outlen,
-                void *inbuf, int inlen,
-                unsigned long timeout_usec);
+#ifndef I2CBUS_INLINE_CHECKS
+I2CBUS_API int i2cbus_xfer(i2cbus *dev,
+                           void *outbuf, int outlen,
+                           void *inbuf, int inlen,
+                           unsigned long timeout_usec);
+#endif
+/**
+ * @brief i2cbus_write() without the argument checks. dev must be open
+ * and buf must not be NULL.
+ * 
+ */
+I2CBUS_API int i2cbus_write_unchecked(i2cbus *dev, void *buf, int len);
+/**
+ * @brief i2cbus_read() without the argument checks. dev must be open
+ * and buf must not be NULL.
+ * 
+ */
+I2CBUS_API int i2cbus_read_unchecked(i2cbus *dev, void *buf, int len);
+/**
+ * @brief i2cbus_xfer() without the argument checks. dev must be open
+ * and neither buffer may be NULL.
+ * 
+ */
+I2CBUS_API int i2cbus_xfer_unchecked(i2cbus *dev,
+                                     void *outbuf, int outlen,
+                                     void *inbuf, int inlen,
+                                     unsigned long timeout_usec);
+
+#ifdef I2CBUS_INLINE_CHECKS
+/*
+ * Header-inline argument checks: define I2CBUS_INLINE_CHECKS before
+ * including this header to have the checks of i2cbus_write(),
+ * i2cbus_read() and i2cbus_xfer() inlined into the caller, which then
+ * calls straight into the unchecked entry points. Invalid arguments
+ * return -1 without logging.
+ */
+static inline int i2cbus_write(i2cbus *dev, void *buf, int len)
+{
+    if (__builtin_expect(dev == NULL || dev->fd < 0 || buf == NULL, 0))
+        return -1;
+    return i2cbus_write_unchecked(dev, buf, len);
+}
+
+static inline int i2cbus_read(i2cbus *dev, void *buf, int len)
+{
+    if (__builtin_expect(dev == NULL || dev->fd < 0 || buf == NULL, 0))
+        return -1;
+    return i2cbus_read_unchecked(dev, buf, len);
+}
+
+static inline int i2cbus_xfer(i2cbus *dev,
+                              void *outbuf, int outlen,
+                              void *inbuf, int inlen,
+                              unsigned long timeout_usec)
+{
+    if (__builtin_expect(dev == NULL || dev->fd < 0 || outbuf == NULL || inbuf == NULL, 0))
+        return -1;
+    return i2cbus_xfer_unchecked(dev, outbuf, outlen, inbuf, inlen, timeout_usec);
+}
+#endif
+/**
+ * @brief Perform a write followed by a read as a single I2C_RDWR
+ * transaction, joined by a repeated start instead of a STOP/START.
+ * No other bus traffic can be inserted between the two phases, and
+ * only one system call is made. Requires adapter support for plain
+ * I2C transfers.
+ * 
+ * Note: Bus access by this function is protected by a recursive
+ * pthread mutex.
+ * 
+ * @param dev i2c device descriptor
+ * @param outbuf Pointer to byte array to write (MSB first)
+ * @param outlen Length of output byte array
+ * @param inbuf Pointer to byte array to read to (MSB first), can be the same as outbuf
+ * @param inlen Length of input byte array
+ * @return int Length of bytes read on success, -1 on failure
+ */
+I2CBUS_API int i2cbus_xfer_rdwr(i2cbus *dev,
+                                void *outbuf, int outlen,
+                                void *inbuf, int inlen);
+/**
+ * @brief Variant of i2cbus_xfer() that releases the bus lock while it
+ * waits between the write and the read phases, so that other devices on
+ * the bus can be accessed during e.g. an ADC conversion. The wait is an
+ * absolute CLOCK_MONOTONIC sleep measured from the end of the write.
+ * 
+ * Note: Other transactions, including ones to the same slave, may take
+ * place between the two phases. If the calling thread already holds the
+ * bus lock through i2cbus_lock(), the bus is not released during the wait.
+ * On adapters without plain I2C the phases are joined into one SMBus
+ * transaction, as i2cbus_xfer() does (see i2cbus_select_method()), so
+ * there is no wait, and transfers without an SMBus equivalent fail with
+ * EOPNOTSUPP before anything is written.
+ * 
+ * @param dev i2c device descriptor
+ * @param outbuf Pointer to byte array to write (MSB first)
+ * @param outlen Length of output byte array
+ * @param inbuf Pointer to byte array to read to (MSB first), can be the same as outbuf
+ * @param inlen Length of input byte array
+ * @param timeout_usec Timeout between read and write (in microseconds)
+ * @return int Length of bytes read on success, -1 on failure
+ */
+I2CBUS_API int i2cbus_xfer_yield(i2cbus *dev,
+                                 void *outbuf, int outlen,
+                                 void *inbuf, int inlen,
+                                 unsigned long timeout_usec);
+/**
+ * @brief Variant of i2cbus_write() that must complete by an absolute
+ * CLOCK_MONOTONIC deadline. The call fails fast with ETIMEDOUT, without
+ * touching the bus, once the bus lock cannot be acquired early enough for
+ * the transfer to finish in time. The duration of the transfer is
+ * estimated from recent transfers on the bus (a moving average of the time
+ * per byte). A transfer that has started is not cut short, and a retry
+ * that would start too late is not made.
+ * 
+ * @param dev i2c device descriptor
+ * @param buf Pointer to byte array to write (MSB first)
+ * @param len Length of byte array
+ * @param deadline Absolute CLOCK_MONOTONIC deadline, NULL for none
+ * @return int Length of bytes written on success, -1 on failure (errno is set, ETIMEDOUT if out of time)
+ */
+I2CBUS_API int i2cbus_write_deadline(i2cbus *dev, void *buf, int len, const struct timespec *deadline);
+/**
+ * @brief Variant of i2cbus_read() that must complete by an absolute
+ * CLOCK_MONOTONIC deadline, see i2cbus_write_deadline().
+ * 
+ * @param dev i2c device descriptor
+ * @param buf Pointer to byte array to read to (MSB first)
+ * @param len Length of byte array
+ * @param deadline Absolute CLOCK_MONOTONIC deadline, NULL for none
+ * @return int Length of bytes read on success, -1 on failure (errno is set, ETIMEDOUT if out of time)
+ */
+I2CBUS_API int i2cbus_read_deadline(i2cbus *dev, void *buf, int len, const struct timespec *deadline);
+/**
+ * @brief Variant of i2cbus_xfer() that must complete by an absolute
+ * CLOCK_MONOTONIC deadline, see i2cbus_write_deadline(). The wait between
+ * the phases counts towards the estimated duration.
+ * 
+ * @param dev i2c device descriptor
+ * @param outbuf Pointer to byte array to write (MSB first)
+ * @param outlen Length of output byte array
+ * @param inbuf Pointer to byte array to read to (MSB first), can be the same as outbuf
+ * @param inlen Length of input byte array
+ * @param timeout_usec Timeout between read and write (in microseconds)
+ * @param deadline Absolute CLOCK_MONOTONIC deadline, NULL for none
+ * @return int Length of bytes read on success, -1 on failure (errno is set, ETIMEDOUT if out of time)
+ */
+I2CBUS_API int i2cbus_xfer_deadline(i2cbus *dev,
+                                    void *outbuf, int outlen,
+                                    void *inbuf, int inlen,
+                                    unsigned long timeout_usec,
+                                    const struct timespec *deadline);
+/**
+ * @brief SMBus quick command: only the R/W bit is sent, e.g. to probe
+ * for a slave.
+ * 
+ * SMBus functions issue a single I2C_SMBUS ioctl per transaction, so the
+ * kernel generates the repeated starts and the adapter needs only SMBus
+ * support. The slave address of the device is bound to the bus with
+ * I2C_SLAVE, which is skipped while it is still bound from the previous
+ * SMBus transaction on the bus. Bus access is protected by the same
+ * recursive bus mutex as i2cbus_write().
+ * 
+ * @param dev i2c device descriptor
+ * @param value R/W bit to send (1 for read, 0 for write)
+ * @return int 0 on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_smbus_write_quick(i2cbus *dev, unsigned char value);
+/**
+ * @brief SMBus receive byte: read one byte without a command.
+ * 
+ * @param dev i2c device descriptor
+ * @return int Byte read on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_smbus_read_byte(i2cbus *dev);
+/**
+ * @brief SMBus send byte: write one byte without a command.
+ * 
+ * @param dev i2c device descriptor
+ * @param value Byte to write
+ * @return int 0 on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_smbus_write_byte(i2cbus *dev, unsigned char value);
+/**
+ * @brief SMBus read byte: read the byte register selected by command.
+ * 
+ * @param dev i2c device descriptor
+ * @param command Command (register) byte
+ * @return int Byte read on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_smbus_read_byte_data(i2cbus *dev, unsigned char command);
+/**
+ * @brief SMBus write byte: write the byte register selected by command.
+ * 
+ * @param dev i2c device descriptor
+ * @param command Command (register) byte
+ * @param value Byte to write
+ * @return int 0 on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_smbus_write_byte_data(i2cbus *dev, unsigned char command, unsigned char value);
+/**
+ * @brief SMBus read word: read the 16-bit register selected by command.
+ * SMBus words are transferred least significant byte first.
+ * 
+ * @param dev i2c device descriptor
+ * @param command Command (register) byte
+ * @return int Word read on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_smbus_read_word_data(i2cbus *dev, unsigned char command);
+/**
+ * @brief SMBus write word: write the 16-bit register selected by command.
+ * 
+ * @param dev i2c device descriptor
+ * @param command Command (register) byte
+ * @param value Word to write
+ * @return int 0 on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_smbus_write_word_data(i2cbus *dev, unsigned char command, unsigned short value);
+/**
+ * @brief SMBus process call: write a word and read a word back in one
+ * transaction.
+ * 
+ * @param dev i2c device descriptor
+ * @param command Command (register) byte
+ * @param value Word to write
+ * @return int Word read on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_smbus_process_call(i2cbus *dev, unsigned char command, unsigned short value);
+/**
+ * @brief SMBus block read: the slave sends a byte count followed by up
+ * to I2C_SMBUS_BLOCK_MAX (32) bytes.
+ * 
+ * @param dev i2c device descriptor
+ * @param command Command (register) byte
+ * @param values Buffer for the block, at least 32 bytes
+ * @return int Number of bytes read on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_smbus_read_block_data(i2cbus *dev, unsigned char command, unsigned char *values);
+/**
+ * @brief SMBus block write: send a byte count followed by the block.
+ * 
+ * @param dev i2c device descriptor
+ * @param command Command (register) byte
+ * @param length Number of bytes to write, at most 32
+ * @param values Block to write
+ * @return int 0 on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_smbus_write_block_data(i2cbus *dev, unsigned char command, unsigned char length,
+                                             const unsigned char *values);
+/**
+ * @brief SMBus block process call: write a block and read a block back in
+ * one transaction.
+ * 
+ * @param dev i2c device descriptor
+ * @param command Command (register) byte
+ * @param length Number of bytes to write, at most 32
+ * @param values Block to write, replaced by the block read (at least 32 bytes)
+ * @return int Number of bytes read on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_smbus_block_process_call(i2cbus *dev, unsigned char command, unsigned char length,
+                                               unsigned char *values);
+/**
+ * @brief I2C block read: read length bytes starting at the register
+ * selected by command, without a byte count on the wire.
+ * 
+ * @param dev i2c device descriptor
+ * @param command Command (register) byte
+ * @param length Number of bytes to read, 1 to 32
+ * @param values Buffer for the block
+ * @return int Number of bytes read on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_smbus_read_i2c_block_data(i2cbus *dev, unsigned char command, unsigned char length,
+                                                unsigned char *values);
+/**
+ * @brief I2C block write: write length bytes starting at the register
+ * selected by command, without a byte count on the wire.
+ * 
+ * @param dev i2c device descriptor
+ * @param command Command (register) byte
+ * @param length Number of bytes to write, 1 to 32
+ * @param values Block to write
+ * @return int 0 on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_smbus_write_i2c_block_data(i2cbus *dev, unsigned char command, unsigned char length,
+                                                 const unsigned char *values);
+
+/**
+ * @brief Transaction used to carry out a plain I2C transfer, depending
+ * on what the adapter supports. See i2cbus_select_method().
+ * 
+ */
+typedef enum
+{
+    I2CBUS_METHOD_UNSUPPORTED = 0, ///< The adapter has no transaction for the transfer
+    I2CBUS_METHOD_I2C,             ///< Plain I2C messages (I2C_RDWR)
+    I2CBUS_METHOD_SMBUS_BYTE,      ///< SMBus send or receive byte
+    I2CBUS_METHOD_SMBUS_BYTE_DATA, ///< SMBus write or read byte data
+    I2CBUS_METHOD_SMBUS_WORD_DATA, ///< SMBus write or read word data
+    I2CBUS_METHOD_SMBUS_I2C_BLOCK, ///< SMBus write or read I2C block data
+} i2cbus_method;
+
+/**
+ * @brief Pick the cheapest transaction the adapter supports for a
+ * transfer that writes outlen bytes and then, after a repeated start,
+ * reads inlen bytes (either phase may be empty). Plain I2C is used when
+ * available. Otherwise an SMBus transaction that puts the same bytes on
+ * the wire is chosen, with the first byte written as the SMBus command.
+ * 
+ * i2cbus_write(), i2cbus_read() and the i2cbus_xfer() family use this
+ * to fall back to SMBus on adapters without I2C_FUNC_I2C, and fail with
+ * EOPNOTSUPP when there is no equivalent. i2cbus_xfer() and
+ * i2cbus_xfer_yield() always use a repeated start on such adapters,
+ * dropping any inter-phase timeout, and batches (i2cbus_batch_run(), and
+ * so register maps and read plans) run each write-then-read pair or
+ * single segment as a transaction of its own. This function has no side
+ * effects, so it can be checked against any capability mask.
+ * 
+ * @param funcs Adapter functionality, I2C_FUNC_* from linux/i2c.h
+ * @param outlen Bytes to write
+ * @param inlen Bytes to read
+ * @return i2cbus_method Transaction to use
+ */
+I2CBUS_API i2cbus_method i2cbus_select_method(unsigned long funcs, int outlen, int inlen);
+/**
+ * @brief Functionality of the adapter of a device's bus, queried with
+ * I2C_FUNCS once when the bus is opened.
+ * 
+ * @param dev i2c device descriptor
+ * @return unsigned long I2C_FUNC_* mask, 0 if dev is not open
+ */
+I2CBUS_API unsigned long i2cbus_get_funcs(i2cbus *dev);
+/**
+ * @brief Read len bytes starting at register reg: the register address
+ * is written MSB first, followed by a repeated start and the read. Uses
+ * a single I2C_RDWR transaction where plain I2C is available. On
+ * SMBus-only adapters, 8-bit registers are read with SMBus byte, word
+ * or I2C block reads of up to 32 bytes each. 16-bit registers are
+ * selected with an SMBus byte data (or I2C block) write of the register
+ * address and read one SMBus receive byte at a time, without a repeated
+ * start; this needs I2C_FUNC_SMBUS_READ_BYTE and fails with EOPNOTSUPP
+ * otherwise. Both assume the register pointer of the device
+ * auto-increments.
+ * 
+ * Note: Bus access by this function is protected by a recursive
+ * pthread mutex.
+ * 
+ * @param dev i2c device descriptor
+ * @param reg Register address
+ * @param reg_bytes Register address width in bytes (1 or 2)
+ * @param buf Buffer to read to
+ * @param len Number of bytes to read
+ * @return int len on success, -1 on failure (errno is set)
+ */
+I2CBUS_API int i2cbus_read_reg(i2cbus *dev, unsigned int reg, int reg_bytes, void *buf, int len);
+
+/**
+ * @brief Update an SMBus PEC (CRC-8, polynomial x^8 + x^2 + x + 1) with a
+ * buffer. The PEC of a transaction covers every byte on the wire,
+ * including the address bytes (address << 1 | R/W bit), and starts at 0.
+ * 
+ * @param crc PEC of the preceding bytes, 0 to start
+ * @param buf Bytes to add
+ * @param len Number of bytes
+ * @return unsigned char Updated PEC
+ */
+I2CBUS_API unsigned char i2cbus_pec(unsigned char crc, const void *buf, size_t len);
+
+/**
+ * @brief Queue of I2C message segments executed as one locked bus
+ * operation by i2cbus_batch_run(). Segments may target any slave
+ * address on the bus of the device the batch was created with.
+ * 
+ */
+typedef struct
+{
+    i2cbus *dev;          ///< Device whose bus (and lock) the batch runs on
+    struct i2c_msg *msgs; ///< Queued message segments
+    int num;              ///< Number of queued segments
+    int cap;              ///< Allocated length of msgs
+} i2cbus_batch;
+/**
+ * @brief Initialize an empty batch on the bus of the given device.
+ * 
+ * @param batch Batch to initialize
+ * @param dev i2c device descriptor, opened with i2cbus_open()
+ * @return int 1 on success, negative on error
+ */
+I2CBUS_API int i2cbus_batch_init(i2cbus_batch *batch, i2cbus *dev);
+/**
+ * @brief Queue a write segment. The buffer is not copied and must stay
+ * valid until i2cbus_batch_run() returns.
+ * 
+ * @param batch Batch descriptor
+ * @param addr Slave address, or negative to use the address of batch->dev
+ * @param buf Pointer to byte array to write (MSB first)
+ * @param len Length of byte array (1 to 8192)
+ * @return int Number of queued segments on success, negative on error
+ */
+I2CBUS_API int i2cbus_batch_write(i2cbus_batch *batch, int addr, void *buf, int len);
+/**
+ * @brief Queue a read segment. The buffer is filled in by i2cbus_batch_run().
+ * 
+ * @param batch Batch descriptor
+ * @param addr Slave address, or negative to use the address of batch->dev
+ * @param buf Pointer to byte array to read to (MSB first)
+ * @param len Length of byte array (1 to 8192)
+ * @return int Number of queued segments on success, negative on error
+ */
+I2CBUS_API int i2cbus_batch_read(i2cbus_batch *batch, int addr, void *buf, int len);
+/**
+ * @brief Queue a write segment followed by a read segment from the same
+ * slave. The pair is never split across I2C_RDWR calls, so the read
+ * always follows the write with a repeated start.
+ * 
+ * @param batch Batch descriptor
+ * @param addr Slave address, or negative to use the address of batch->dev
+ * @param outbuf Pointer to byte array to write (MSB first)
+ * @param outlen Length of output byte array (1 to 8192)
+ * @param inbuf Pointer to byte array to read to (MSB first)
+ * @param inlen Length of input byte array (1 to 8192)
+ * @return int Number of queued segments on success, negative on error
+ */
+I2CBUS_API int i2cbus_batch_xfer(i2cbus_batch *batch, int addr,
+                                 void *outbuf, int outlen,
+                                 void *inbuf, int inlen);
+/**
+ * @brief Execute all queued segments under a single acquisition of the
+ * bus lock, using as few I2C_RDWR calls as I2C_RDWR_IOCTL_MAX_MSGS allows.
+ * A STOP condition is only generated at the end of each I2C_RDWR call.
+ * With I2CBUS_FLAG_PEC set on batch->dev, every segment, or write segment
+ * followed by a read from the same slave, is instead sent as a transfer
+ * of its own with a PEC byte, and every read is checked against its PEC.
+ * On adapters without I2C_FUNC_I2C, segments are sent the same way, each
+ * transfer as the SMBus transaction i2cbus_select_method() picks; segments
+ * without an SMBus equivalent fail with EOPNOTSUPP.
+ * The queued segments are kept, so the batch can be run repeatedly.
+ * 
+ * @param batch Batch descriptor
+ * @return int Number of segments executed on success, -1 on failure (errno is set).
+ * On failure, segments in earlier I2C_RDWR calls have been executed.
+ */
+I2CBUS_API int i2cbus_batch_run(i2cbus_batch *batch);
+/**
+ * @brief Remove all queued segments, keeping the allocated storage.
+ * 
+ * @param batch Batch descriptor
+ */
+I2CBUS_API void i2cbus_batch_reset(i2cbus_batch *batch);
+/**
+ * @brief Release the storage held by a batch.
+ * 
+ * @param batch Batch descriptor
+ */
+I2CBUS_API void i2cbus_batch_free(i2cbus_batch *batch);
+/**
+ * @brief Operation performed by an asynchronous request.
+ * 
+ */
+typedef enum
+{
+    I2CBUS_REQ_WRITE = 0, ///< i2cbus_write(dev, outbuf, outlen)
+    I2CBUS_REQ_READ,      ///< i2cbus_read(dev, inbuf, inlen)
+    I2CBUS_REQ_XFER,      ///< i2cbus_xfer(dev, outbuf, outlen, inbuf, inlen, timeout_usec)
+    I2CBUS_REQ_XFER_YIELD, ///< i2cbus_xfer_yield(dev, outbuf, outlen, inbuf, inlen, timeout_usec)
+} i2cbus_req_type;
+
+/**
+ * @brief Scheduling class of an asynchronous request. The worker of a bus
+ * always runs the oldest request of the highest class waiting, except that
+ * a request is promoted one class for every aging interval it has waited
+ * (see i2cbus_set_bus_aging()), so that bulk traffic is delayed but never
+ * starved. Requests are not preempted: a long bulk transfer should be
+ * split into several requests to let realtime requests run in between.
+ * 
+ */
+typedef enum
+{
+    I2CBUS_PRIO_NORMAL = 0, ///< Default class
+    I2CBUS_PRIO_REALTIME,   ///< Runs before the other classes, e.g. periodic sensor samples
+    I2CBUS_PRIO_BULK,       ///< Runs when no other class is waiting, e.g. firmware or EEPROM transfers
+} i2cbus_req_prio;
+
+#define I2CBUS_PRIO_CLASSES 3 ///< Number of scheduling classes
+#ifndef I2CBUS_AGING_USEC
+#define I2CBUS_AGING_USEC 50000 ///< Default aging interval of a bus (us)
+#endif
+
+typedef struct i2cbus_req i2cbus_req;
+/**
+ * @brief Completion callback of an asynchronous request. Called from the
+ * bus worker thread; must not block for long, as it delays the rest of
+ * the queue of the bus. It may submit further requests, but must not wait
+ * for a request on the same bus: i2cbus_xfer_prio() and i2cbus_req_wait()
+ * fail with -EDEADLK there.
+ * 
+ */
+typedef void (*i2cbus_req_cb)(i2cbus_req *req);
+/**
+ * @brief Asynchronous transfer request, see i2cbus_submit(). The request
+ * is owned by the library from submission until it is complete, and
+ * must not be modified or freed in the meantime.
+ * 
+ */
+struct i2cbus_req
+{
+    i2cbus *dev;               ///< i2c device descriptor
+    i2cbus_req_type type;      ///< Operation to perform
+    i2cbus_req_prio prio;      ///< Scheduling class
+    void *outbuf;              ///< Pointer to byte array to write (MSB first)
+    int outlen;                ///< Length of output byte array
+    void *inbuf;               ///< Pointer to byte array to read to (MSB first)
+    int inlen;                 ///< Length of input byte array
+    unsigned long timeout_usec; ///< Timeout between write and read (I2CBUS_REQ_XFER*)
+    i2cbus_req_cb cb;          ///< Completion callback, NULL for none
+    void *arg;                 ///< User data, not used by the library
+    int efd;                   ///< eventfd incremented on completion, negative for none
+    int status;                ///< Return value of the operation, valid after completion
+    int err;                   ///< errno of the operation on failure, valid after completion
+    int done;                  ///< Completion state (internal, use i2cbus_req_done())
+    unsigned long long queued_ns; ///< Submission time (internal)
+    i2cbus_req *next;          ///< Queue link (internal)
+};
+/**
+ * @brief Queue a request for the worker thread of the bus of req->dev.
+ * This call never blocks on the bus lock: the request is placed on a
+ * lock-free queue drained by one worker thread per bus, which is started
+ * by the first submission on the bus and stopped when the last device on
+ * the bus is closed (i2cbus_close()). The worker runs requests in the order of their class
+ * (req->prio), and in submission order within a class. Calls that lock
+ * the bus directly do not go through the worker and compete with it for
+ * the bus lock. Completion is signalled through the callback, the
+ * eventfd, i2cbus_req_done() and i2cbus_req_wait(), in that order.
+ * 
+ * @param req Request to submit, with dev, type, buffers, cb and efd filled in
+ * @return int 1 on success, negative on error
+ */
+I2CBUS_API int i2cbus_submit(i2cbus_req *req);
+/**
+ * @brief Check whether a submitted request is complete.
+ * 
+ * @param req Submitted request
+ * @return int Non-zero if the request is complete
+ */
+I2CBUS_API int i2cbus_req_done(i2cbus_req *req);
+/**
+ * @brief Block until a submitted request is complete.
+ * 
+ * @param req Submitted request
+ * @return int req->status, -EDEADLK (errno is set) if called from the
+ * worker thread of the bus of an incomplete request
+ */
+I2CBUS_API int i2cbus_req_wait(i2cbus_req *req);
+/**
+ * @brief Perform an i2cbus_xfer() through the worker thread of the bus, in
+ * scheduling class prio, and wait for it to complete. Use instead of
+ * i2cbus_xfer() so that the transfer is ordered against the requests of
+ * other threads by class.
+ * 
+ * @param dev i2c device descriptor
+ * @param prio Scheduling class
+ * @param outbuf Pointer to byte array to write (MSB first)
+ * @param outlen Length of output byte array
+ * @param inbuf Pointer to byte array to read to (MSB first)
+ * @param inlen Length of input byte array
+ * @param timeout_usec Timeout between write and read
+ * @return int Return value of i2cbus_xfer() (errno is set on failure), -2 if
+ * the worker could not be started, -3 for an invalid class, -EDEADLK (errno
+ * is set) if called from the worker thread of the bus, e.g. in a completion
+ * callback
+ */
+I2CBUS_API int i2cbus_xfer_prio(i2cbus *dev, i2cbus_req_prio prio, void *outbuf, int outlen,
+                                void *inbuf, int inlen, unsigned long timeout_usec);
+/**
+ * @brief Set the aging interval of the worker of a bus. A request that has
+ * waited this long runs as if it were one class higher, after twice as
+ * long two classes higher, and so on, and runs before the requests of
+ * the class it reached that were submitted after it. This bounds the
+ * wait of a bulk request under sustained realtime traffic to about two
+ * intervals plus the realtime requests already queued.
+ * 
+ * @param bus Bus index (X in /dev/i2c-X)
+ * @param aging_usec Aging interval (default I2CBUS_AGING_USEC), 0 for strict priority
+ * @return int 1 on success, -100 if no device has been opened on the bus
+ */
+I2CBUS_API int i2cbus_set_bus_aging(unsigned int bus, unsigned long aging_usec);
+#define I2CBUS_STATS_ERRNO_MAX 134                                ///< Error numbers counted individually (index 0 counts all others)
+#define I2CBUS_STATS_HIST_SUB_BITS 3                              ///< log2 of linear histogram buckets per power of two
+#define I2CBUS_STATS_HIST_SUB (1 << I2CBUS_STATS_HIST_SUB_BITS)   ///< Linear histogram buckets per power of two
+#define I2CBUS_STATS_HIST_BUCKETS (38 << I2CBUS_STATS_HIST_SUB_BITS) ///< Histogram buckets, covering up to 2^40 ns
+/**
+ * @brief Snapshot of the runtime statistics of a bus, see i2cbus_get_stats().
+ * 
+ */
+typedef struct
+{
+    unsigned long long transactions;                         ///< Bus transactions (I2C_RDWR and I2C_SMBUS calls)
+    unsigned long long bytes_out;                            ///< Bytes written in successful transactions
+    unsigned long long bytes_in;                             ///< Bytes read in successful transactions
+    unsigned long long errors;                               ///< Failed transactions
+    unsigned long long nacks;                                ///< Transactions failed with ENXIO or EREMOTEIO (NACK)
+    unsigned long long pec_errors;                           ///< Transactions that received a bad PEC byte
+    unsigned long long retries;                              ///< Transfers tried again by the retry policy
+    unsigned long long deadline_misses;                      ///< Deadline calls that gave up with ETIMEDOUT
+    unsigned long long aged;                                 ///< Asynchronous requests run ahead of a higher class by aging
+    unsigned long long errno_count[I2CBUS_STATS_ERRNO_MAX];  ///< Failed transactions by errno
+    unsigned long long lock_acquisitions;                    ///< Bus lock acquisitions
+    unsigned long long lock_contended;                       ///< Bus lock acquisitions that had to wait
+    unsigned long long lock_wait_ns;                         ///< Total time spent waiting for the bus lock (ns)
+    unsigned long long lock_recovered;                       ///< Shared bus lock acquisitions after the holder died
+    unsigned long long xfer_ns;                              ///< Total time spent in transactions (ns)
+    unsigned long long xfer_hist[I2CBUS_STATS_HIST_BUCKETS]; ///< Log-linear histogram of transaction times
+} i2cbus_stats;
+/**
+ * @brief Set the timeout and retry policy of a bus, followed by every
+ * device on the bus that has no policy of its own (i2cbus::policy). The
+ * policy is copied. Batches are not retried.
+ * 
+ * @param bus Bus index (X in /dev/i2c-X)
+ * @param policy Policy to set
+ * @return int 1 on success, negative on error (negative of error returned by pthread_mutex_lock,
+ * -100 if no device has been opened on the bus)
+ */
+I2CBUS_API int i2cbus_set_bus_policy(unsigned int bus, const i2cbus_policy *policy);
+/**
+ * @brief Take a snapshot of the statistics of a bus. Counters are kept
+ * for every transaction and bus lock acquisition, and the snapshot is
+ * taken without locking the bus.
+ * 
+ * @param bus Bus index (X in /dev/i2c-X)
+ * @param stats Pointer to store the snapshot
+ * @return int 1 on success, -100 if no device has been opened on the bus
+ */
+I2CBUS_API int i2cbus_get_stats(unsigned int bus, i2cbus_stats *stats);
+/**
+ * @brief Reset the statistics of a bus.
+ * 
+ * @param bus Bus index (X in /dev/i2c-X)
+ * @return int 1 on success, negative on error
+ */
+I2CBUS_API int i2cbus_reset_stats(unsigned int bus);
+/**
+ * @brief Lower bound of a transaction time histogram bucket.
+ * 
+ * @param idx Bucket index
+ * @return unsigned long long Bucket value in nanoseconds
+ */
+I2CBUS_API unsigned long long i2cbus_stats_hist_value(int idx);
+/**
+ * @brief Estimate a percentile of the transaction time from a snapshot.
+ * 
+ * @param stats Statistics snapshot
+ * @param pct Percentile (0 to 100)
+ * @return unsigned long long Transaction time in nanoseconds
+ */
+I2CBUS_API unsigned long long i2cbus_stats_percentile(const i2cbus_stats *stats, double pct);
+/**
+ * @brief Serialize bus access across processes: keep the bus locks in the
+ * named POSIX shared memory object (see shm_open(), e.g. "/i2cbus"),
+ * created with mode 0660 if it does not exist. Every process that sets up
+ * the same name shares the lock of each bus, and all bus access, including
+ * i2cbus_lock(), i2cbus_trylock() and i2cbus_unlock(), goes through it.
+ * The locks are robust pthread mutexes: when a process dies holding one,
+ * the next process to acquire it recovers it, and uncontended locking
+ * costs about as much as a plain futex. Must be called before the first
+ * bus is opened.
+ * 
+ * @param name Shared memory object name
+ * @return int 1 on success, -1 on error (errno is set, EBUSY if a bus is already open)
+ */
+I2CBUS_API int i2cbus_set_lock_shm(const char *name);
+/**
+ * @brief Set the protocol of the locks of buses opened for the first time
+ * after the call, e.g. to keep a real-time thread from waiting on a
+ * low-priority thread that holds the bus lock (priority inversion). The
+ * lock of a bus is created when the bus is first opened and kept; a
+ * shared lock keeps the protocol of the process that created it. With
+ * PTHREAD_PRIO_PROTECT, the threads using the bus should run under
+ * SCHED_FIFO or SCHED_RR at or below the ceiling: glibc fails the first
+ * lock of a SCHED_OTHER thread with EINVAL.
+ * 
+ * @param protocol PTHREAD_PRIO_NONE (default), PTHREAD_PRIO_INHERIT, or
+ * PTHREAD_PRIO_PROTECT (priority ceiling, not available with i2cbus_set_lock_shm())
+ * @param prioceiling Priority ceiling for PTHREAD_PRIO_PROTECT, within
+ * sched_get_priority_min(SCHED_FIFO) and sched_get_priority_max(SCHED_FIFO);
+ * ignored otherwise
+ * @return int 1 on success, -1 on error (errno is set, EINVAL for a ceiling out of range)
+ */
+I2CBUS_API int i2cbus_set_lock_protocol(int protocol, int prioceiling);
+/**
+ * @brief Use fair FIFO locks for buses opened for the first time after the
+ * call. Threads that find the bus taken queue up and get it in arrival
+ * order, handed over directly by the unlock of the holder, instead of
+ * whichever thread wins the race for the mutex. This bounds the wait of
+ * every thread under heavy contention, at the cost of a wake-up per
+ * handover. Fair locks are recursive and support timed waits, but do not
+ * follow the lock protocol (i2cbus_set_lock_protocol()), and are not
+ * available with i2cbus_set_lock_shm(). The deprecated i2cbus::lock is
+ * NULL for devices on a bus with a fair lock; use i2cbus_lock() instead.
+ * 
+ * @param fair Non-zero for fair locks, 0 for mutexes (default)
+ * @return int 1 on success, -1 on error (errno is set)
+ */
+I2CBUS_API int i2cbus_set_lock_fair(int fair);
 /**
  * @brief Acquire lock on an i2c bus.
  * 
  * @param bus Bus index (X in /dev/i2c-X)
- * @return int Positive on success, negative on error (negative of error returned by pthread_mutex_lock)
+ * @return int Positive on success, negative on error (negative of error returned by pthread_mutex_lock,
+ * -100 if no device has been opened on the bus)
  */
-int i2cbus_lock(unsigned int bus);
+I2CBUS_API int i2cbus_lock(unsigned int bus);
 /**
  * @brief Try to acquire lock on an i2c bus,
  * for timing jitter sensitive applications.
  * 
  * @param bus Bus index (X in /dev/i2c-X)
- * @return int Positive on success, negative on error (negative of error returned by pthread_mutex_trylock)
+ * @return int Positive on success, negative on error (negative of error returned by pthread_mutex_trylock,
+ * -100 if no device has been opened on the bus)
+ */
+I2CBUS_API int i2cbus_trylock(unsigned int bus);
+/**
+ * @brief Acquire lock on an i2c bus, waiting no later than an absolute
+ * CLOCK_MONOTONIC deadline.
+ * 
+ * @param bus Bus index (X in /dev/i2c-X)
+ * @param deadline Absolute CLOCK_MONOTONIC time to give up at
+ * @return int Positive on success, negative on error (negative of error returned by pthread_mutex_clocklock,
+ * -ETIMEDOUT if the deadline passed, -100 if no device has been opened on the bus)
  */
-int i2cbus_trylock(unsigned int bus);
+I2CBUS_API int i2cbus_timedlock(unsigned int bus, const struct timespec *deadline);
 /**
  * @brief Unlock an i2c bus.
  * 
  * @param bus Bus index (X in /dev/i2c-X)
- * @return int int Positive on success, negative on error (negative of error returned by pthread_mutex_lock)
+ * @return int int Positive on success, negative on error (negative of error returned by pthread_mutex_lock,
+ * -100 if no device has been opened on the bus)
  */
-int i2cbus_unlock(unsigned int bus);
+I2CBUS_API int i2cbus_unlock(unsigned int bus);
 #ifdef __cplusplus 
 }
 #endif
@@ -0,0 +1,37 @@
+/**
+ * @file i2cbus_api.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Symbol export control for libi2cbus.
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef __I2CBUS_API_H
+#define __I2CBUS_API_H
+
+/**
+ * @brief Marks a symbol as part of the public API. The library is built
+ * with -fvisibility=hidden, so everything without this marker stays
+ * private to libi2cbus.so.
+ * 
+ */
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define I2CBUS_API __attribute__((visibility("default")))
+#else
+#define I2CBUS_API
+#endif
+
+/**
+ * @brief Marks a declaration as deprecated, so that uses outside the
+ * library warn at compile time.
+ * 
+ */
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 5))
+#define I2CBUS_DEPRECATED(msg) __attribute__((deprecated(msg)))
+#else
+#define I2CBUS_DEPRECATED(msg)
+#endif
+
+#endif
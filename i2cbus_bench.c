@@ -0,0 +1,824 @@
+/**
+ * @file i2cbus_bench.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Benchmark harness for the i2cbus hot paths.
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ * Runs a fixed operation from 1 to N threads spread over 1 to M buses and
+ * reports throughput, latency percentiles, bus lock wait time and how
+ * evenly the threads were served (per-thread p99 and op count). Buses
+ * are simulated (i2cbus_sim) unless -c selects a character device bus.
+ * With -r, measures instead how long a 1 kHz SCHED_FIFO control thread
+ * waits for the bus lock against low-priority background traffic, under
+ * the lock protocol selected with -P. With -q, measures how long a 1 kHz
+ * sensor read through the bus worker takes against bulk reads, with all
+ * requests in one scheduling class and then in separate classes.
+ *
+ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include "i2cbus.h"
+#include "i2cbus_sim.h"
+
+#define SIM_BUS_BASE 32   /// First simulated bus ID
+#define SIM_ADDR 0x50     /// Address of the simulated slaves
+#define MAX_THREADS 256   /// Most benchmark threads
+#define RT_PRIO_LOW 10    /// SCHED_FIFO priority of the background threads (-r)
+#define RT_PRIO_MID 20    /// SCHED_FIFO priority of the CPU load thread (-r)
+#define RT_PRIO_HIGH 30   /// SCHED_FIFO priority of the control thread (-r)
+#define RT_PERIOD_NS 1000000UL /// Control loop period (-r)
+#define RT_LOAD_NS 2000000UL   /// Busy and idle time of the CPU load thread (-r)
+#define SCHED_SENSOR_LEN 6     /// Bytes read by the sensor thread (-q)
+
+// log-linear latency histogram: 16 linear sub-buckets per power of two
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t bucket[HIST_BUCKETS];
+} hist_t;
+
+static inline int hist_index(uint64_t ns)
+{
+    if (ns < HIST_SUB)
+        return ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int shift = msb - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) + ((ns >> shift) & (HIST_SUB - 1));
+}
+
+static inline uint64_t hist_value(int idx)
+{
+    if (idx < HIST_SUB)
+        return idx;
+    int shift = (idx >> HIST_SUB_BITS) - 1;
+    return ((uint64_t)(HIST_SUB + (idx & (HIST_SUB - 1)))) << shift;
+}
+
+static inline void hist_add(hist_t *h, uint64_t ns)
+{
+    h->bucket[hist_index(ns)]++;
+    h->count++;
+}
+
+static void hist_merge(hist_t *dst, const hist_t *src)
+{
+    dst->count += src->count;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        dst->bucket[i] += src->bucket[i];
+}
+
+static uint64_t hist_percentile(const hist_t *h, double pct)
+{
+    if (h->count == 0)
+        return 0;
+    uint64_t target = (uint64_t)(h->count * pct / 100.0);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->bucket[i];
+        if (seen > target)
+            return hist_value(i);
+    }
+    return hist_value(HIST_BUCKETS - 1);
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+typedef enum
+{
+    OP_XFER,
+    OP_RDWR,
+    OP_READ,
+    OP_WRITE,
+    OP_SMBUS,
+} bench_op;
+
+static const char *op_names[] = {"xfer", "rdwr", "read", "write", "smbus"};
+
+typedef struct
+{
+    i2cbus dev;
+    bench_op op;
+    int len;
+    volatile int *stop;
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t max_ns;
+    hist_t lat;
+} worker_t;
+
+static void *bench_worker(void *arg)
+{
+    worker_t *w = arg;
+    unsigned char out[64] = {0}, in[64];
+    while (!*(w->stop))
+    {
+        uint64_t t0 = now_ns();
+        int ret, expect = w->len;
+        switch (w->op)
+        {
+        case OP_XFER:
+        case OP_RDWR:
+            ret = i2cbus_xfer(&(w->dev), out, 1, in, w->len, 0);
+            break;
+        case OP_READ:
+            ret = i2cbus_read(&(w->dev), in, w->len);
+            break;
+        case OP_SMBUS:
+            // register read: byte, word or I2C block depending on the length
+            if (w->len == 1)
+                ret = i2cbus_smbus_read_byte_data(&(w->dev), 0) < 0 ? -1 : 1;
+            else if (w->len == 2)
+                ret = i2cbus_smbus_read_word_data(&(w->dev), 0) < 0 ? -1 : 2;
+            else
+                ret = i2cbus_smbus_read_i2c_block_data(&(w->dev), 0, w->len, in);
+            break;
+        default:
+            ret = i2cbus_write(&(w->dev), out, w->len + 1);
+            expect = w->len + 1;
+            break;
+        }
+        uint64_t t1 = now_ns();
+        if (ret != expect)
+            w->errors++;
+        w->ops++;
+        hist_add(&(w->lat), t1 - t0);
+        if (t1 - t0 > w->max_ns)
+            w->max_ns = t1 - t0;
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    i2cbus dev;
+    int len;
+    volatile int *stop;
+    uint64_t loops;
+    uint64_t errors;
+    uint64_t max_ns;
+    hist_t wait;
+} rt_control_t;
+
+/**
+ * @brief Control loop: every RT_PERIOD_NS, lock the bus and read a
+ * register, recording how long the lock took.
+ *
+ */
+static void *rt_control(void *arg)
+{
+    rt_control_t *c = arg;
+    unsigned char out[1] = {0}, in[64];
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!*(c->stop))
+    {
+        next.tv_nsec += RT_PERIOD_NS;
+        if (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        uint64_t t0 = now_ns();
+        if (i2cbus_lock(c->dev.id) < 0)
+        {
+            c->errors++;
+            continue;
+        }
+        uint64_t wait = now_ns() - t0;
+        if (i2cbus_xfer(&(c->dev), out, 1, in, c->len, 0) != c->len)
+            c->errors++;
+        i2cbus_unlock(c->dev.id);
+        c->loops++;
+        hist_add(&(c->wait), wait);
+        if (wait > c->max_ns)
+            c->max_ns = wait;
+    }
+    return NULL;
+}
+
+/**
+ * @brief CPU load between the control and background priorities: busy
+ * for RT_LOAD_NS, then idle for as long. It preempts a background thread
+ * holding the bus lock, and so delays the control thread, unless the lock
+ * protocol raises the priority of the holder.
+ *
+ */
+static void *rt_load(void *arg)
+{
+    volatile int *stop = arg;
+    while (!*stop)
+    {
+        uint64_t end = now_ns() + RT_LOAD_NS;
+        while (now_ns() < end)
+            ;
+        nanosleep(&(struct timespec){.tv_sec = 0, .tv_nsec = RT_LOAD_NS}, NULL);
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    volatile int *stop;
+    int duration_ms;
+} rt_timer_t;
+
+/**
+ * @brief End the run after its duration. Runs above every other thread so
+ * it gets the CPU on time.
+ *
+ */
+static void *rt_timer(void *arg)
+{
+    rt_timer_t *t = arg;
+    usleep(t->duration_ms * 1000);
+    *(t->stop) = 1;
+    return NULL;
+}
+
+/**
+ * @brief Start a SCHED_FIFO thread pinned to CPU 0.
+ *
+ * @return int 0 on success, error number from pthread_create() on failure
+ */
+static int rt_start(pthread_t *thread, int prio, void *(*fn)(void *), void *arg)
+{
+    pthread_attr_t attr;
+    struct sched_param sp = {.sched_priority = prio};
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(0, &cpus);
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+    pthread_attr_setschedparam(&attr, &sp);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    int ret = pthread_create(thread, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    return ret;
+}
+
+/**
+ * @brief Priority inversion scenario: nbg background threads run op at
+ * low priority, a CPU load thread at medium priority and the control
+ * thread at high priority, all on CPU 0.
+ *
+ */
+static int run_rt(const i2cbus_backend *be, int id, int addr, bench_op op, int len, int nbg, int duration_ms)
+{
+    static worker_t workers[MAX_THREADS];
+    static rt_control_t control;
+    pthread_t threads[MAX_THREADS], load, ctl, timer;
+    volatile int stop = 0;
+    rt_timer_t timing = {.stop = &stop, .duration_ms = duration_ms};
+    int nopen = 0, nstarted = 0, ret = 1, err;
+    uint64_t start = 0;
+    memset(&control, 0, sizeof(control));
+    control.len = len;
+    control.stop = &stop;
+    if (i2cbus_open_backend(&(control.dev), id, addr, be) < 0)
+    {
+        fprintf(stderr, "Could not open bus %d\n", id);
+        return 1;
+    }
+    for (int i = 0; i < nbg; i++)
+    {
+        worker_t *w = &workers[i];
+        memset(w, 0, sizeof(worker_t));
+        w->op = op;
+        w->len = len;
+        w->stop = &stop;
+        if (i2cbus_open_backend(&(w->dev), id, addr, be) < 0)
+        {
+            fprintf(stderr, "Could not open bus %d\n", id);
+            goto out;
+        }
+        if (op == OP_RDWR)
+            w->dev.flags |= I2CBUS_FLAG_RDWR;
+        nopen++;
+    }
+    // the main thread keeps its scheduling: with a priority ceiling, glibc
+    // does not let a thread that has taken the bus lock leave SCHED_FIFO
+    for (int i = 0; i < nbg; i++)
+    {
+        if ((err = rt_start(&threads[i], RT_PRIO_LOW, bench_worker, &workers[i])))
+            goto fail;
+        nstarted++;
+    }
+    if ((err = rt_start(&load, RT_PRIO_MID, rt_load, (void *)&stop)))
+        goto fail;
+    if ((err = rt_start(&ctl, RT_PRIO_HIGH, rt_control, &control)))
+    {
+        stop = 1;
+        pthread_join(load, NULL);
+        goto fail;
+    }
+    start = now_ns();
+    if ((err = rt_start(&timer, RT_PRIO_HIGH + 1, rt_timer, &timing)))
+        stop = 1;
+    else
+        pthread_join(timer, NULL);
+    pthread_join(ctl, NULL);
+    pthread_join(load, NULL);
+    if (err)
+        goto fail;
+    ret = 0;
+    goto out;
+fail:
+    fprintf(stderr, "Could not start SCHED_FIFO thread: %s%s\n", strerror(err),
+            err == EPERM ? " (-r needs CAP_SYS_NICE)" : "");
+out:
+    stop = 1;
+    uint64_t ops = 0;
+    for (int i = 0; i < nstarted; i++)
+    {
+        pthread_join(threads[i], NULL);
+        ops += workers[i].ops;
+    }
+    for (int i = 0; i < nopen; i++)
+        i2cbus_close(&(workers[i].dev));
+    i2cbus_close(&(control.dev));
+    if (ret)
+        return ret;
+    double secs = (now_ns() - start) / 1e9;
+    printf("%8s %10s %10s %10s %10s %12s %8s\n",
+           "loops", "p50(ns)", "p99(ns)", "p999(ns)", "max(ns)", "bg ops/s", "errors");
+    printf("%8llu %10llu %10llu %10llu %10llu %12.0f %8llu\n",
+           (unsigned long long)control.loops,
+           (unsigned long long)hist_percentile(&(control.wait), 50),
+           (unsigned long long)hist_percentile(&(control.wait), 99),
+           (unsigned long long)hist_percentile(&(control.wait), 99.9),
+           (unsigned long long)control.max_ns, ops / secs,
+           (unsigned long long)control.errors);
+    return 0;
+}
+
+typedef struct
+{
+    i2cbus dev;
+    i2cbus_req_prio prio;
+    int len;
+    volatile int *stop;
+    uint64_t ops;
+    uint64_t errors;
+    uint64_t max_ns;
+    hist_t lat;
+} sched_thread_t;
+
+/**
+ * @brief Sensor loop: every RT_PERIOD_NS, read a sample through the bus
+ * worker, recording how long the read took.
+ *
+ */
+static void *sched_sensor(void *arg)
+{
+    sched_thread_t *t = arg;
+    unsigned char out[1] = {0}, in[SCHED_SENSOR_LEN];
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while (!*(t->stop))
+    {
+        next.tv_nsec += RT_PERIOD_NS;
+        if (next.tv_nsec >= 1000000000L)
+        {
+            next.tv_nsec -= 1000000000L;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        uint64_t t0 = now_ns();
+        if (i2cbus_xfer_prio(&(t->dev), t->prio, out, 1, in, SCHED_SENSOR_LEN, 0) != SCHED_SENSOR_LEN)
+            t->errors++;
+        uint64_t lat = now_ns() - t0;
+        t->ops++;
+        hist_add(&(t->lat), lat);
+        if (lat > t->max_ns)
+            t->max_ns = lat;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Bulk loop: back-to-back reads through the bus worker.
+ *
+ */
+static void *sched_bulk(void *arg)
+{
+    sched_thread_t *t = arg;
+    unsigned char out[1] = {0}, in[64];
+    while (!*(t->stop))
+    {
+        if (i2cbus_xfer_prio(&(t->dev), t->prio, out, 1, in, t->len, 0) != t->len)
+            t->errors++;
+        t->ops++;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Scheduler scenario: a 1 kHz sensor thread and nbulk bulk threads
+ * share a bus through its worker, first with every request in the normal
+ * class, then with the sensor in the realtime and the bulk reads in the
+ * bulk class.
+ *
+ */
+static int run_sched(const i2cbus_backend *be, int id, int addr, int len, int nbulk, int duration_ms)
+{
+    static sched_thread_t bulk[MAX_THREADS];
+    static sched_thread_t sensor;
+    pthread_t threads[MAX_THREADS], sthread;
+    printf("%8s %8s %10s %10s %10s %10s %12s %8s\n",
+           "classes", "loops", "p50(ns)", "p99(ns)", "p999(ns)", "max(ns)", "bulk ops/s", "errors");
+    for (int classes = 0; classes < 2; classes++)
+    {
+        volatile int stop = 0;
+        int nopen = 0, ok = 1;
+        memset(&sensor, 0, sizeof(sensor));
+        sensor.prio = classes ? I2CBUS_PRIO_REALTIME : I2CBUS_PRIO_NORMAL;
+        sensor.stop = &stop;
+        if (i2cbus_open_backend(&(sensor.dev), id, addr, be) < 0)
+        {
+            fprintf(stderr, "Could not open bus %d\n", id);
+            return 1;
+        }
+        for (int i = 0; i < nbulk; i++)
+        {
+            sched_thread_t *t = &bulk[i];
+            memset(t, 0, sizeof(sched_thread_t));
+            t->prio = classes ? I2CBUS_PRIO_BULK : I2CBUS_PRIO_NORMAL;
+            t->len = len;
+            t->stop = &stop;
+            if (i2cbus_open_backend(&(t->dev), id, addr, be) < 0)
+            {
+                fprintf(stderr, "Could not open bus %d\n", id);
+                ok = 0;
+                break;
+            }
+            nopen++;
+        }
+        for (int i = 0; ok && i < nbulk; i++)
+            pthread_create(&threads[i], NULL, sched_bulk, &bulk[i]);
+        if (ok)
+            pthread_create(&sthread, NULL, sched_sensor, &sensor);
+        uint64_t start = now_ns();
+        if (ok)
+            usleep(duration_ms * 1000);
+        stop = 1;
+        uint64_t ops = 0, errors = 0;
+        if (ok)
+        {
+            pthread_join(sthread, NULL);
+            for (int i = 0; i < nbulk; i++)
+                pthread_join(threads[i], NULL);
+        }
+        for (int i = 0; i < nopen; i++)
+        {
+            ops += bulk[i].ops;
+            errors += bulk[i].errors;
+            i2cbus_close(&(bulk[i].dev));
+        }
+        i2cbus_close(&(sensor.dev));
+        if (!ok)
+            return 1;
+        double secs = (now_ns() - start) / 1e9;
+        printf("%8s %8llu %10llu %10llu %10llu %10llu %12.0f %8llu\n",
+               classes ? "rt/bulk" : "normal", (unsigned long long)sensor.ops,
+               (unsigned long long)hist_percentile(&(sensor.lat), 50),
+               (unsigned long long)hist_percentile(&(sensor.lat), 99),
+               (unsigned long long)hist_percentile(&(sensor.lat), 99.9),
+               (unsigned long long)sensor.max_ns, ops / secs,
+               (unsigned long long)(errors + sensor.errors));
+        fflush(stdout);
+    }
+    return 0;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -t N     run with 1, 2, 4 ... N threads (default 4)\n"
+            "  -b M     spread threads over 1, 2, 4 ... M buses (default 2)\n"
+            "  -o OP    operation: xfer, rdwr, read, write, smbus (default xfer)\n"
+            "  -n LEN   bytes read or written per operation (default 2, max 63, 32 for smbus)\n"
+            "  -d MS    duration of each run in milliseconds (default 500)\n"
+            "  -f KHZ   simulated bus clock in kHz, 0 for zero-time transfers (default 0)\n"
+            "  -c ID    use /dev/i2c-ID instead of simulated buses (single bus)\n"
+            "  -a ADDR  slave address on /dev/i2c-ID (default 0x50)\n"
+            "  -s NAME  keep the bus locks in shared memory object NAME (cross-process locking)\n"
+            "  -r       measure the bus lock wait of a 1 kHz real-time control thread against\n"
+            "           -t low-priority background threads running OP (needs CAP_SYS_NICE)\n"
+            "  -q       measure the latency of a 1 kHz sensor read through the bus worker against\n"
+            "           -t threads reading LEN bytes, without and with scheduling classes\n"
+            "  -P PROTO bus lock protocol: none, inherit, protect (default none)\n"
+            "  -F       fair FIFO bus locks\n"
+            "  -v       print the bus statistics of each run\n",
+            prog);
+}
+
+/**
+ * @brief Look for an i2c-stub adapter, which only implements SMBus
+ * transfers, so the other operations run through the SMBus fallback.
+ *
+ * @return int Bus ID of the stub, -1 if none is loaded
+ */
+static int find_i2c_stub(void)
+{
+    DIR *dir = opendir("/sys/bus/i2c/devices");
+    if (dir == NULL)
+        return -1;
+    struct dirent *ent;
+    int id = -1;
+    while (id < 0 && (ent = readdir(dir)) != NULL)
+    {
+        int bus;
+        if (sscanf(ent->d_name, "i2c-%d", &bus) != 1)
+            continue;
+        char path[512], name[64] = {0};
+        snprintf(path, sizeof(path), "/sys/bus/i2c/devices/%s/name", ent->d_name);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL)
+            continue;
+        if (fgets(name, sizeof(name), fp) != NULL && strncmp(name, "SMBus stub driver", 17) == 0)
+            id = bus;
+        fclose(fp);
+    }
+    closedir(dir);
+    return id;
+}
+
+int main(int argc, char *argv[])
+{
+    int max_threads = 4, max_buses = 2, len = 2, duration_ms = 500;
+    int khz = 0, chardev = -1, addr = SIM_ADDR, verbose = 0;
+    const char *shm = NULL;
+    int rt = 0, sched = 0, protocol = PTHREAD_PRIO_NONE, fair = 0;
+    bench_op op = OP_XFER;
+    int c;
+    while ((c = getopt(argc, argv, "t:b:o:n:d:f:c:a:s:rqP:Fvh")) != -1)
+    {
+        switch (c)
+        {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'b':
+            max_buses = atoi(optarg);
+            break;
+        case 'o':
+            for (op = OP_XFER; op <= OP_SMBUS; op++)
+                if (strcmp(optarg, op_names[op]) == 0)
+                    break;
+            if (op > OP_SMBUS)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'n':
+            len = atoi(optarg);
+            break;
+        case 'd':
+            duration_ms = atoi(optarg);
+            break;
+        case 'f':
+            khz = atoi(optarg);
+            break;
+        case 'c':
+            chardev = atoi(optarg);
+            break;
+        case 'a':
+            addr = strtol(optarg, NULL, 0);
+            break;
+        case 's':
+            shm = optarg;
+            break;
+        case 'r':
+            rt = 1;
+            break;
+        case 'q':
+            sched = 1;
+            break;
+        case 'P':
+            if (strcmp(optarg, "none") == 0)
+                protocol = PTHREAD_PRIO_NONE;
+            else if (strcmp(optarg, "inherit") == 0)
+                protocol = PTHREAD_PRIO_INHERIT;
+            else if (strcmp(optarg, "protect") == 0)
+                protocol = PTHREAD_PRIO_PROTECT;
+            else
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'F':
+            fair = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (max_threads < 1 || max_threads > MAX_THREADS || max_buses < 1 || len < 1 || len > 63 || duration_ms < 1 ||
+        (op == OP_SMBUS && len > 32))
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    if (protocol != PTHREAD_PRIO_NONE && i2cbus_set_lock_protocol(protocol, RT_PRIO_HIGH) < 0)
+    {
+        fprintf(stderr, "Could not set the bus lock protocol: %s\n", strerror(errno));
+        return 1;
+    }
+    if (fair && i2cbus_set_lock_fair(1) < 0)
+    {
+        fprintf(stderr, "Could not select fair bus locks: %s\n", strerror(errno));
+        return 1;
+    }
+    if (shm != NULL && i2cbus_set_lock_shm(shm) < 0)
+    {
+        fprintf(stderr, "Could not set up shared bus locks in %s: %s\n", shm, strerror(errno));
+        return 1;
+    }
+    const i2cbus_backend *be = &i2cbus_backend_sim;
+    if (chardev >= 0)
+    {
+        be = &i2cbus_backend_chardev;
+        max_buses = 1;
+        if (op != OP_SMBUS && chardev == find_i2c_stub())
+            fprintf(stderr, "Note: /dev/i2c-%d is i2c-stub, which only implements SMBus; %s runs as SMBus transactions\n",
+                    chardev, op_names[op]);
+    }
+    else
+    {
+        int stub = find_i2c_stub();
+        if (stub >= 0)
+            fprintf(stderr, "Note: i2c-stub found on /dev/i2c-%d, benchmark it with -c %d -o smbus\n", stub, stub);
+        i2cbus_sim_timing timing = {0, 0};
+        if (khz > 0)
+        {
+            timing.byte_ns = 9000000UL / khz; // 8 data bits and ACK
+            timing.xfer_ns = 2000000UL / khz; // start and stop
+        }
+        for (int b = 0; b < max_buses; b++)
+        {
+            if (i2cbus_sim_create(SIM_BUS_BASE + b, &timing) < 0 ||
+                i2cbus_sim_add_device(SIM_BUS_BASE + b, addr, 8, 256) < 0)
+                return 1;
+        }
+    }
+
+    printf("# op %s, %d bytes, %s, %d ms per run\n", op_names[op], len,
+           chardev >= 0 ? "chardev" : (khz > 0 ? "simulated bus" : "zero-time simulated bus"), duration_ms);
+    if (khz > 0 && chardev < 0)
+        printf("# simulated clock %d kHz\n", khz);
+    if (shm != NULL)
+        printf("# bus locks in shared memory object %s\n", shm);
+    if (protocol != PTHREAD_PRIO_NONE)
+        printf("# bus lock protocol %s\n", protocol == PTHREAD_PRIO_INHERIT ? "inherit" : "protect");
+    if (fair)
+        printf("# fair FIFO bus locks\n");
+    if (rt)
+    {
+        printf("# control thread at %lu Hz (SCHED_FIFO %d) against %d background threads (SCHED_FIFO %d) "
+               "and CPU load (SCHED_FIFO %d) on CPU 0\n",
+               1000000000UL / RT_PERIOD_NS, RT_PRIO_HIGH, max_threads, RT_PRIO_LOW, RT_PRIO_MID);
+        return run_rt(be, chardev >= 0 ? chardev : SIM_BUS_BASE, addr, op, len, max_threads, duration_ms);
+    }
+    if (sched)
+    {
+        printf("# %d byte sensor read at %lu Hz against %d threads reading %d bytes, through the bus worker\n",
+               SCHED_SENSOR_LEN, 1000000000UL / RT_PERIOD_NS, max_threads, len);
+        return run_sched(be, chardev >= 0 ? chardev : SIM_BUS_BASE, addr, len, max_threads, duration_ms);
+    }
+    printf("%7s %5s %12s %10s %10s %10s %12s %12s %10s %10s %10s %8s %8s\n",
+           "threads", "buses", "ops/s", "p50(ns)", "p99(ns)", "p999(ns)", "lockwait(ns)", "contended%",
+           "max(ns)", "thrp99lo", "thrp99hi", "minops%", "errors");
+
+    static worker_t workers[MAX_THREADS];
+    for (int nbus = 1; nbus <= max_buses; nbus = nbus < max_buses && nbus * 2 > max_buses ? max_buses : nbus * 2)
+    {
+        for (int nthr = 1; nthr <= max_threads; nthr = nthr < max_threads && nthr * 2 > max_threads ? max_threads : nthr * 2)
+        {
+            volatile int stop = 0;
+            pthread_t threads[MAX_THREADS];
+            int ok = 1;
+            for (int i = 0; i < nthr; i++)
+            {
+                worker_t *w = &workers[i];
+                memset(w, 0, sizeof(worker_t));
+                w->op = op;
+                w->len = len;
+                w->stop = &stop;
+                int id = chardev >= 0 ? chardev : SIM_BUS_BASE + (i % nbus);
+                if (i2cbus_open_backend(&(w->dev), id, addr, be) < 0)
+                {
+                    fprintf(stderr, "Could not open bus %d\n", id);
+                    ok = 0;
+                    nthr = i;
+                    break;
+                }
+                if (op == OP_RDWR)
+                    w->dev.flags |= I2CBUS_FLAG_RDWR;
+            }
+            // with fewer threads than buses, only the first nthr buses are opened
+            int nused = nthr < nbus ? nthr : nbus;
+            for (int b = 0; ok && b < nused; b++)
+                i2cbus_reset_stats(chardev >= 0 ? chardev : SIM_BUS_BASE + b);
+            for (int i = 0; ok && i < nthr; i++)
+                pthread_create(&threads[i], NULL, bench_worker, &workers[i]);
+            uint64_t start = now_ns();
+            if (ok)
+                usleep(duration_ms * 1000);
+            stop = 1;
+            hist_t lat = {0};
+            uint64_t ops = 0, errors = 0, max_ns = 0, minops = UINT64_MAX;
+            uint64_t thr_p99_lo = UINT64_MAX, thr_p99_hi = 0;
+            for (int i = 0; i < nthr; i++)
+            {
+                if (ok)
+                    pthread_join(threads[i], NULL);
+                ops += workers[i].ops;
+                errors += workers[i].errors;
+                // spread between the best and the worst served thread
+                uint64_t p99 = hist_percentile(&(workers[i].lat), 99);
+                thr_p99_lo = p99 < thr_p99_lo ? p99 : thr_p99_lo;
+                thr_p99_hi = p99 > thr_p99_hi ? p99 : thr_p99_hi;
+                max_ns = workers[i].max_ns > max_ns ? workers[i].max_ns : max_ns;
+                minops = workers[i].ops < minops ? workers[i].ops : minops;
+                hist_merge(&lat, &(workers[i].lat));
+                i2cbus_close(&(workers[i].dev));
+            }
+            if (!ok)
+                return 1;
+            // lock figures come from the library, which times every acquisition
+            uint64_t lock_ns = 0, lock_acq = 0, lock_cont = 0;
+            for (int b = 0; b < nused; b++)
+            {
+                i2cbus_stats st;
+                if (i2cbus_get_stats(chardev >= 0 ? chardev : SIM_BUS_BASE + b, &st) < 0)
+                    continue;
+                lock_ns += st.lock_wait_ns;
+                lock_acq += st.lock_acquisitions;
+                lock_cont += st.lock_contended;
+            }
+            double secs = (now_ns() - start) / 1e9;
+            printf("%7d %5d %12.0f %10llu %10llu %10llu %12.0f %12.1f %10llu %10llu %10llu %8.1f %8llu\n",
+                   nthr, nbus, ops / secs,
+                   (unsigned long long)hist_percentile(&lat, 50),
+                   (unsigned long long)hist_percentile(&lat, 99),
+                   (unsigned long long)hist_percentile(&lat, 99.9),
+                   lock_acq ? (double)lock_ns / lock_acq : 0.0,
+                   lock_acq ? 100.0 * lock_cont / lock_acq : 0.0,
+                   (unsigned long long)max_ns, (unsigned long long)thr_p99_lo, (unsigned long long)thr_p99_hi,
+                   ops ? 100.0 * minops * nthr / ops : 0.0,
+                   (unsigned long long)errors);
+            for (int b = 0; verbose && b < nused; b++)
+            {
+                i2cbus_stats st;
+                int id = chardev >= 0 ? chardev : SIM_BUS_BASE + b;
+                if (i2cbus_get_stats(id, &st) < 0)
+                    continue;
+                printf("#   bus %d: %llu xfers, %llu B out, %llu B in, %llu errors (%llu NACK), "
+                       "xfer mean %.0f ns p99 %llu ns, lock %llu/%llu contended, wait %llu ns\n",
+                       id, st.transactions, st.bytes_out, st.bytes_in, st.errors, st.nacks,
+                       st.transactions ? (double)st.xfer_ns / st.transactions : 0.0,
+                       i2cbus_stats_percentile(&st, 99), st.lock_contended, st.lock_acquisitions,
+                       st.lock_wait_ns);
+            }
+            fflush(stdout);
+            if (nthr == max_threads)
+                break;
+        }
+        if (nbus == max_buses || chardev >= 0)
+            break;
+    }
+    return 0;
+}
@@ -0,0 +1,126 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "i2cbus_fairlock_priv.h"
+
+/**
+ * @brief Queue node of a thread waiting for a fair lock, on its stack.
+ *
+ */
+struct i2cbus_fairlock_waiter
+{
+    int granted;                         ///< Set to 1 when the lock is handed over (futex word)
+    struct i2cbus_fairlock_waiter *prev; ///< Older waiter
+    struct i2cbus_fairlock_waiter *next; ///< Newer waiter
+};
+
+int i2cbus_fairlock_init(i2cbus_fairlock *fl)
+{
+    fl->state = 0;
+    fl->owner = 0;
+    fl->depth = 0;
+    fl->head = NULL;
+    fl->tail = NULL;
+    return pthread_mutex_init(&(fl->qlock), NULL);
+}
+
+int i2cbus_fairlock_wait(i2cbus_fairlock *fl, const struct timespec *deadline)
+{
+    struct i2cbus_fairlock_waiter self = {.granted = 0, .prev = NULL, .next = NULL};
+    pthread_mutex_lock(&(fl->qlock));
+    // take the lock if it has come free, or mark it as having waiters so
+    // that the unlock of the holder comes through the queue
+    for (;;)
+    {
+        int state = __atomic_load_n(&(fl->state), __ATOMIC_RELAXED);
+        if (state == 0 && __atomic_compare_exchange_n(&(fl->state), &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            pthread_mutex_unlock(&(fl->qlock));
+            goto owned;
+        }
+        if (state == 2 || (state == 1 && __atomic_compare_exchange_n(&(fl->state), &state, 2, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)))
+            break;
+    }
+    self.prev = fl->tail;
+    if (fl->tail != NULL)
+        fl->tail->next = &self;
+    else
+        fl->head = &self;
+    fl->tail = &self;
+    pthread_mutex_unlock(&(fl->qlock));
+
+    int ret = 0;
+    while (!__atomic_load_n(&(self.granted), __ATOMIC_ACQUIRE))
+    {
+        // absolute CLOCK_MONOTONIC timeout
+        if (syscall(SYS_futex, &(self.granted), FUTEX_WAIT_BITSET_PRIVATE, 0, deadline, NULL, FUTEX_BITSET_MATCH_ANY) < 0 &&
+            errno == ETIMEDOUT)
+        {
+            ret = ETIMEDOUT;
+            break;
+        }
+    }
+    if (ret)
+    {
+        pthread_mutex_lock(&(fl->qlock));
+        if (__atomic_load_n(&(self.granted), __ATOMIC_ACQUIRE))
+        {
+            ret = 0; // handed over just in time
+        }
+        else
+        {
+            if (self.prev != NULL)
+                self.prev->next = self.next;
+            else
+                fl->head = self.next;
+            if (self.next != NULL)
+                self.next->prev = self.prev;
+            else
+                fl->tail = self.prev;
+            // still held by someone, who no longer has to hand it over
+            if (fl->head == NULL)
+                __atomic_store_n(&(fl->state), 1, __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&(fl->qlock));
+        if (ret)
+            return ret;
+    }
+owned:
+    __atomic_store_n(&(fl->owner), (unsigned long)pthread_self(), __ATOMIC_RELAXED);
+    fl->depth = 1;
+    return 0;
+}
+
+int i2cbus_fairlock_handoff(i2cbus_fairlock *fl)
+{
+    pthread_mutex_lock(&(fl->qlock));
+    struct i2cbus_fairlock_waiter *next = fl->head;
+    if (next == NULL)
+    {
+        // the queued threads all timed out
+        __atomic_store_n(&(fl->state), 0, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        fl->head = next->next;
+        if (fl->head != NULL)
+            fl->head->prev = NULL;
+        else
+            fl->tail = NULL;
+        // the lock stays held, by next from now on
+        if (fl->head == NULL)
+            __atomic_store_n(&(fl->state), 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&(next->granted), 1, __ATOMIC_RELEASE);
+        // next may already have seen granted and returned, in which case
+        // this is at worst a spurious wake-up for whoever waits there now
+        syscall(SYS_futex, &(next->granted), FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+    pthread_mutex_unlock(&(fl->qlock));
+    return 0;
+}
@@ -0,0 +1,112 @@
+/**
+ * @file i2cbus_fairlock_priv.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief FIFO queue lock used as the bus lock in fair mode. Not part of the API.
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#ifndef __I2CBUS_FAIRLOCK_PRIV_H
+#define __I2CBUS_FAIRLOCK_PRIV_H
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+struct i2cbus_fairlock_waiter;
+
+/**
+ * @brief Recursive FIFO lock. Threads that find the lock held queue up,
+ * park on a futex in their own queue node, and are handed the lock in
+ * arrival order by the unlock of the holder: the lock is never free while
+ * threads are queued, so nobody can barge ahead of them, including the
+ * previous holder coming straight back.
+ *
+ */
+typedef struct
+{
+    int state;                           ///< 0 free, 1 held, 2 held with threads queued
+    unsigned long owner;                 ///< pthread_self() of the holder, 0 if none
+    int depth;                           ///< Recursion depth of the holder
+    pthread_mutex_t qlock;               ///< Protects the queue
+    struct i2cbus_fairlock_waiter *head; ///< Oldest queued thread
+    struct i2cbus_fairlock_waiter *tail; ///< Newest queued thread
+} i2cbus_fairlock;
+
+/**
+ * @brief Initialize a fair lock.
+ *
+ * @return int 0 on success, error number from pthread_mutex_init() on failure
+ */
+int i2cbus_fairlock_init(i2cbus_fairlock *fl);
+
+/**
+ * @brief Queue up for a fair lock and wait until it is handed over.
+ *
+ * @param fl Fair lock
+ * @param deadline Absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @return int 0 once the lock is held, ETIMEDOUT if the deadline passed first
+ */
+int i2cbus_fairlock_wait(i2cbus_fairlock *fl, const struct timespec *deadline);
+
+/**
+ * @brief Hand a fair lock to the oldest queued thread, or free it if the
+ * queue has emptied.
+ *
+ * @return int 0
+ */
+int i2cbus_fairlock_handoff(i2cbus_fairlock *fl);
+
+/**
+ * @brief Acquire a fair lock if it is free and nobody is queued for it, or
+ * if the calling thread already holds it.
+ *
+ * @return int 0 on success, EBUSY if the lock is taken
+ */
+static inline int i2cbus_fairlock_trylock(i2cbus_fairlock *fl)
+{
+    unsigned long self = (unsigned long)pthread_self();
+    if (__atomic_load_n(&(fl->owner), __ATOMIC_RELAXED) == self)
+    {
+        fl->depth++;
+        return 0;
+    }
+    int expect = 0;
+    if (!__atomic_compare_exchange_n(&(fl->state), &expect, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return EBUSY;
+    __atomic_store_n(&(fl->owner), self, __ATOMIC_RELAXED);
+    fl->depth = 1;
+    return 0;
+}
+
+/**
+ * @brief Acquire a fair lock, waiting in line if it is taken.
+ *
+ * @param deadline Absolute CLOCK_MONOTONIC time to give up at, NULL to wait indefinitely
+ * @return int 0 on success, ETIMEDOUT if the deadline passed first
+ */
+static inline int i2cbus_fairlock_lock(i2cbus_fairlock *fl, const struct timespec *deadline)
+{
+    int ret = i2cbus_fairlock_trylock(fl);
+    return ret == EBUSY ? i2cbus_fairlock_wait(fl, deadline) : ret;
+}
+
+/**
+ * @brief Release a fair lock, handing it to the next thread in line.
+ *
+ * @return int 0 on success, EPERM if the calling thread does not hold the lock
+ */
+static inline int i2cbus_fairlock_unlock(i2cbus_fairlock *fl)
+{
+    if (__atomic_load_n(&(fl->owner), __ATOMIC_RELAXED) != (unsigned long)pthread_self())
+        return EPERM;
+    if (--fl->depth > 0)
+        return 0;
+    __atomic_store_n(&(fl->owner), 0, __ATOMIC_RELAXED);
+    int expect = 1;
+    if (__atomic_compare_exchange_n(&(fl->state), &expect, 0, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        return 0;
+    return i2cbus_fairlock_handoff(fl);
+}
+#endif // __I2CBUS_FAIRLOCK_PRIV_H
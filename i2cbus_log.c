@@ -0,0 +1,235 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "i2cbus_log.h"
+
+#if (I2CBUS_LOG_QUEUE & (I2CBUS_LOG_QUEUE - 1)) != 0
+#error "I2CBUS_LOG_QUEUE must be a power of 2"
+#endif
+
+/**
+ * @brief Queue cell. seq equals the enqueue position when the cell is
+ * free, and the position plus one once the message has been written.
+ *
+ */
+struct log_cell
+{
+    size_t seq;
+    char msg[I2CBUS_LOG_MSGLEN];
+};
+
+static struct log_cell log_cells[I2CBUS_LOG_QUEUE];
+static size_t log_enq = 0;      /// Next enqueue position
+static size_t log_deq = 0;      /// Next dequeue position, written by the writer only
+static unsigned long log_dropped = 0; /// Messages lost because the queue was full
+static sem_t log_sem;           /// Counts queued messages for the writer
+static int log_async = 0;       /// Non-zero while the writer thread runs
+static int log_stopping = 0;    /// Set to make the writer thread exit
+static pthread_t log_thread;    /// Writer thread, valid while log_async is set
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t log_sink_lock = PTHREAD_MUTEX_INITIALIZER;
+static i2cbus_log_sink log_sink = NULL;
+static void *log_sink_arg = NULL;
+
+static void log_default_sink(const char *msg, void *arg)
+{
+    (void)arg;
+    fputs(msg, stderr);
+    fflush(stderr);
+}
+
+static void log_write(const char *msg)
+{
+    pthread_mutex_lock(&log_sink_lock);
+    if (log_sink != NULL)
+        log_sink(msg, log_sink_arg);
+    else
+        log_default_sink(msg, NULL);
+    pthread_mutex_unlock(&log_sink_lock);
+}
+
+/**
+ * @brief Pass all complete messages in the queue to the sink.
+ *
+ */
+static void log_drain(void)
+{
+    for (;;)
+    {
+        struct log_cell *cell = &log_cells[log_deq & (I2CBUS_LOG_QUEUE - 1)];
+        if (__atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE) != log_deq + 1)
+            break;
+        log_write(cell->msg);
+        __atomic_store_n(&(cell->seq), log_deq + I2CBUS_LOG_QUEUE, __ATOMIC_RELEASE);
+        __atomic_store_n(&log_deq, log_deq + 1, __ATOMIC_RELEASE);
+    }
+    unsigned long dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped)
+    {
+        char msg[80];
+        snprintf(msg, sizeof(msg), "[i2cbus_log] %lu messages dropped, log queue full\n", dropped);
+        log_write(msg);
+    }
+}
+
+static void *log_writer(void *arg)
+{
+    (void)arg;
+    while (!__atomic_load_n(&log_stopping, __ATOMIC_ACQUIRE))
+    {
+        if (sem_wait(&log_sem) == 0)
+            log_drain();
+    }
+    return NULL;
+}
+
+static void log_start(void)
+{
+    for (size_t i = 0; i < I2CBUS_LOG_QUEUE; i++)
+        log_cells[i].seq = i;
+    if (sem_init(&log_sem, 0, 0) != 0)
+        return;
+    if (pthread_create(&log_thread, NULL, log_writer, NULL) == 0)
+    {
+        pthread_setname_np(log_thread, "i2cbus-log");
+        __atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Flush the queue and stop the writer thread, at exit or when the
+ * library is unloaded, so that no thread is left running its code. Later
+ * messages are written synchronously.
+ *
+ */
+__attribute__((destructor)) static void log_stop(void)
+{
+    if (!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+        return;
+    i2cbus_log_flush();
+    __atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+    // exit() called from a sink runs on the writer thread itself
+    if (pthread_equal(log_thread, pthread_self()))
+        return;
+    __atomic_store_n(&log_stopping, 1, __ATOMIC_RELEASE);
+    sem_post(&log_sem);
+    pthread_join(log_thread, NULL);
+    log_drain(); // messages queued while the writer was stopping
+}
+
+/**
+ * @brief Apply the rate limit of a call site.
+ *
+ * @return int Number of messages suppressed before this one, -1 if this
+ * message must be suppressed
+ */
+static int log_ratelimit(i2cbus_log_site *site)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    int64_t window = __atomic_load_n(&(site->window), __ATOMIC_RELAXED);
+    if (ts.tv_sec >= window + I2CBUS_LOG_INTERVAL &&
+        __atomic_compare_exchange_n(&(site->window), &window, (int64_t)ts.tv_sec, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        __atomic_store_n(&(site->count), 0, __ATOMIC_RELAXED);
+    if (__atomic_fetch_add(&(site->count), 1, __ATOMIC_RELAXED) >= I2CBUS_LOG_BURST)
+    {
+        __atomic_fetch_add(&(site->suppressed), 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return __atomic_exchange_n(&(site->suppressed), 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Format a message into buf, ending it with a newline.
+ *
+ */
+static void log_format(char *buf, int suppressed, const char *fmt, va_list ap)
+{
+    int len = vsnprintf(buf, I2CBUS_LOG_MSGLEN, fmt, ap);
+    if (len < 0)
+        len = 0;
+    if (len > I2CBUS_LOG_MSGLEN - 2)
+        len = I2CBUS_LOG_MSGLEN - 2;
+    if (suppressed > 0)
+    {
+        int n = snprintf(buf + len, I2CBUS_LOG_MSGLEN - 1 - len, " [%d similar messages suppressed]", suppressed);
+        if (n > 0)
+            len += n < I2CBUS_LOG_MSGLEN - 1 - len ? n : I2CBUS_LOG_MSGLEN - 2 - len;
+    }
+    buf[len] = '\n';
+    buf[len + 1] = '\0';
+}
+
+void i2cbus_log_emit(i2cbus_log_site *site, const char *fmt, ...)
+{
+    int suppressed = log_ratelimit(site);
+    if (suppressed < 0)
+        return;
+    pthread_once(&log_once, log_start);
+    va_list ap;
+    va_start(ap, fmt);
+    if (!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+    {
+        // no writer thread: fall back to writing synchronously
+        char buf[I2CBUS_LOG_MSGLEN];
+        log_format(buf, suppressed, fmt, ap);
+        va_end(ap);
+        log_write(buf);
+        return;
+    }
+    size_t pos = __atomic_load_n(&log_enq, __ATOMIC_RELAXED);
+    struct log_cell *cell;
+    for (;;)
+    {
+        cell = &log_cells[pos & (I2CBUS_LOG_QUEUE - 1)];
+        size_t seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+        intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+        if (dif == 0)
+        {
+            if (__atomic_compare_exchange_n(&log_enq, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (dif < 0)
+        {
+            __atomic_fetch_add(&log_dropped, 1 + suppressed, __ATOMIC_RELAXED);
+            va_end(ap);
+            return;
+        }
+        else
+        {
+            pos = __atomic_load_n(&log_enq, __ATOMIC_RELAXED);
+        }
+    }
+    log_format(cell->msg, suppressed, fmt, ap);
+    va_end(ap);
+    __atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+    sem_post(&log_sem);
+}
+
+void i2cbus_log_set_sink(i2cbus_log_sink sink, void *arg)
+{
+    pthread_mutex_lock(&log_sink_lock);
+    log_sink = sink;
+    log_sink_arg = arg;
+    pthread_mutex_unlock(&log_sink_lock);
+}
+
+void i2cbus_log_flush(void)
+{
+    if (!__atomic_load_n(&log_async, __ATOMIC_ACQUIRE))
+        return;
+    size_t target = __atomic_load_n(&log_enq, __ATOMIC_ACQUIRE);
+    struct timespec wait = {0, 1000000};
+    for (int i = 0; i < 1000 && (intptr_t)(__atomic_load_n(&log_deq, __ATOMIC_ACQUIRE) - target) < 0; i++)
+    {
+        sem_post(&log_sem); // a message may be queued before its sem_post
+        nanosleep(&wait, NULL);
+    }
+}
@@ -0,0 +1,84 @@
+/**
+ * @file i2cbus_log.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Non-blocking, rate-limited error logging.
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef __I2CBUS_LOG_H
+#define __I2CBUS_LOG_H
+#ifdef __cplusplus 
+extern "C" {
+#endif
+#include <stdint.h>
+#include "i2cbus_api.h"
+
+#ifndef I2CBUS_LOG_BURST
+#define I2CBUS_LOG_BURST 10 ///< Messages per call site per rate limit interval
+#endif
+#ifndef I2CBUS_LOG_INTERVAL
+#define I2CBUS_LOG_INTERVAL 5 ///< Rate limit interval in seconds
+#endif
+#define I2CBUS_LOG_QUEUE 256 ///< Messages the queue can hold (power of 2)
+#define I2CBUS_LOG_MSGLEN 256 ///< Longest message, including the call site prefix
+
+/**
+ * @brief Rate limit state of a logging call site.
+ * 
+ */
+typedef struct
+{
+    int64_t window;  ///< Start of the current interval (seconds)
+    int count;       ///< Messages in the current interval
+    int suppressed;  ///< Messages suppressed since the last one emitted
+} i2cbus_log_site;
+
+/**
+ * @brief Log sink, called from the log writer thread with one complete
+ * line (including the trailing newline) at a time.
+ * 
+ */
+typedef void (*i2cbus_log_sink)(const char *msg, void *arg);
+
+/**
+ * @brief Log a message from a call site: the message is formatted and
+ * queued for the writer thread, never written synchronously. Messages
+ * beyond the rate limit of the call site, or that do not fit in the
+ * queue, are counted and reported later.
+ * 
+ */
+#define I2CBUS_LOG(str, ...)                                                                  \
+    {                                                                                         \
+        static i2cbus_log_site _i2cbus_log_site;                                              \
+        i2cbus_log_emit(&_i2cbus_log_site, "[%s/%s():%d] " str, __FILE__, __func__, __LINE__, \
+                        ##__VA_ARGS__);                                                       \
+    }
+
+/**
+ * @brief Rate limit, format and queue a message. Use I2CBUS_LOG().
+ * 
+ * @param site Call site state
+ * @param fmt printf format
+ */
+I2CBUS_API void i2cbus_log_emit(i2cbus_log_site *site, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+/**
+ * @brief Replace the log sink. The default sink writes to stderr.
+ * 
+ * @param sink Sink function, NULL to restore the default
+ * @param arg Argument passed to the sink
+ */
+I2CBUS_API void i2cbus_log_set_sink(i2cbus_log_sink sink, void *arg);
+/**
+ * @brief Wait (up to one second) until all messages queued so far have
+ * been passed to the sink. Called automatically at exit and when the
+ * library is unloaded, which also stops the writer thread.
+ * 
+ */
+I2CBUS_API void i2cbus_log_flush(void);
+#ifdef __cplusplus 
+}
+#endif
+#endif
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "i2cbus_plan.h"
+#include "i2cbus_log.h"
+
+#ifdef eprintf
+#undef eprintf
+#endif
+
+#define eprintf(str, ...) I2CBUS_LOG(str, ##__VA_ARGS__)
+
+/**
+ * @brief Requested register and its output slot, for sorting.
+ *
+ */
+struct plan_entry
+{
+    unsigned int reg;
+    int idx;
+};
+
+static int plan_entry_cmp(const void *a, const void *b)
+{
+    const struct plan_entry *x = a, *y = b;
+    if (x->reg != y->reg)
+        return x->reg < y->reg ? -1 : 1;
+    return x->idx - y->idx;
+}
+
+int i2cbus_plan_init(i2cbus_plan *plan, i2cbus *dev, const i2cbus_plan_config *cfg,
+                     const unsigned int *regs, int nregs)
+{
+    if (plan == NULL || dev == NULL || cfg == NULL || regs == NULL || nregs <= 0)
+    {
+        eprintf("Invalid argument: plan %p, device %p, config %p, registers %p (%d)", plan, dev, cfg, regs, nregs);
+        return -1;
+    }
+    if ((cfg->reg_bits != 8 && cfg->reg_bits != 16) || (cfg->val_bits != 8 && cfg->val_bits != 16) || cfg->max_burst < 0)
+    {
+        eprintf("Unsupported plan layout: %d bit address, %d bit value, burst %d", cfg->reg_bits, cfg->val_bits, cfg->max_burst);
+        return -1;
+    }
+    memset(plan, 0, sizeof(i2cbus_plan));
+    plan->dev = dev;
+    plan->cfg = *cfg;
+    plan->nregs = nregs;
+    int rlen = cfg->reg_bits / 8;
+    int vlen = cfg->val_bits / 8;
+    if (plan->cfg.max_burst == 0)
+        plan->cfg.max_burst = 32;
+    if (plan->cfg.max_gap < 0) // a new burst costs a register address write and two address bytes
+        plan->cfg.max_gap = (rlen + 2 + vlen - 1) / vlen;
+
+    int ret = -2;
+    struct plan_entry *sorted = malloc(nregs * sizeof(struct plan_entry));
+    plan->slot = malloc(nregs * sizeof(int));
+    plan->spans = malloc(nregs * sizeof(i2cbus_plan_span));
+    if (sorted == NULL || plan->slot == NULL || plan->spans == NULL)
+    {
+        eprintf("Could not allocate plan for %d registers", nregs);
+        goto err;
+    }
+    for (int i = 0; i < nregs; i++)
+    {
+        if (regs[i] >= (1U << cfg->reg_bits))
+        {
+            eprintf("Register 0x%x does not fit in %d bits", regs[i], cfg->reg_bits);
+            ret = -1;
+            goto err;
+        }
+        sorted[i].reg = regs[i];
+        sorted[i].idx = i;
+    }
+    qsort(sorted, nregs, sizeof(struct plan_entry), plan_entry_cmp);
+
+    // merge into spans
+    i2cbus_plan_span *span = NULL;
+    int offset = 0;
+    for (int i = 0; i < nregs; i++)
+    {
+        unsigned int reg = sorted[i].reg;
+        if (span != NULL && reg < span->start + span->count) // repeated register
+        {
+            plan->slot[sorted[i].idx] = span->offset + (reg - span->start) * vlen;
+            continue;
+        }
+        if (span == NULL ||
+            reg - (span->start + span->count) > (unsigned int)plan->cfg.max_gap ||
+            reg - span->start + 1 > (unsigned int)plan->cfg.max_burst)
+        {
+            if (span != NULL)
+                offset += span->count * vlen;
+            span = &(plan->spans[plan->nspans++]);
+            span->start = reg;
+            span->count = 0;
+            span->offset = offset;
+        }
+        span->count = reg - span->start + 1;
+        plan->slot[sorted[i].idx] = span->offset + (reg - span->start) * vlen;
+    }
+    offset += span->count * vlen;
+    free(sorted);
+    sorted = NULL;
+
+    plan->addrbuf = malloc(plan->nspans * rlen);
+    plan->scratch = malloc(offset);
+    if (plan->addrbuf == NULL || plan->scratch == NULL)
+    {
+        eprintf("Could not allocate plan buffers for %d bursts", plan->nspans);
+        goto err;
+    }
+    if ((ret = i2cbus_batch_init(&(plan->batch), dev)) < 0)
+        goto err;
+    for (int i = 0; i < plan->nspans; i++)
+    {
+        span = &(plan->spans[i]);
+        unsigned char *addr = plan->addrbuf + i * rlen;
+        if (rlen == 2)
+        {
+            addr[0] = span->start >> 8;
+            addr[1] = span->start;
+        }
+        else
+        {
+            addr[0] = span->start;
+        }
+        ret = i2cbus_batch_xfer(&(plan->batch), -1, addr, rlen, plan->scratch + span->offset, span->count * vlen);
+        if (ret < 0)
+            goto err;
+    }
+    return plan->nspans;
+err:
+    free(sorted);
+    i2cbus_plan_free(plan);
+    return ret;
+}
+
+int i2cbus_plan_exec(i2cbus_plan *plan, void *out)
+{
+    if (plan == NULL || plan->scratch == NULL || out == NULL)
+    {
+        eprintf("Invalid argument: plan %p, output %p", plan, out);
+        return -1;
+    }
+    if (i2cbus_batch_run(&(plan->batch)) < 0)
+        return -1;
+    int vlen = plan->cfg.val_bits / 8;
+    unsigned char *dst = out;
+    if (vlen == 1)
+    {
+        for (int i = 0; i < plan->nregs; i++)
+            dst[i] = plan->scratch[plan->slot[i]];
+    }
+    else
+    {
+        for (int i = 0; i < plan->nregs; i++)
+            memcpy(dst + i * vlen, plan->scratch + plan->slot[i], vlen);
+    }
+    return plan->nspans;
+}
+
+void i2cbus_plan_free(i2cbus_plan *plan)
+{
+    if (plan == NULL)
+        return;
+    i2cbus_batch_free(&(plan->batch));
+    free(plan->spans);
+    free(plan->slot);
+    free(plan->addrbuf);
+    free(plan->scratch);
+    plan->spans = NULL;
+    plan->slot = NULL;
+    plan->addrbuf = NULL;
+    plan->scratch = NULL;
+    plan->nspans = 0;
+}
@@ -0,0 +1,91 @@
+/**
+ * @file i2cbus_plan.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Read planner merging register reads into burst transfers.
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef __I2CBUS_PLAN_H
+#define __I2CBUS_PLAN_H
+#ifdef __cplusplus 
+extern "C" {
+#endif
+#include "i2cbus.h"
+
+/**
+ * @brief Register layout and merge policy of a read plan.
+ * 
+ */
+typedef struct
+{
+    int reg_bits;  ///< Register address width in bits (8 or 16), sent MSB first
+    int val_bits;  ///< Register value width in bits (8 or 16)
+    int max_gap;   ///< Most unused registers read to join two bursts, negative to use the cost of a new burst (address and register bytes)
+    int max_burst; ///< Most registers per burst, 0 for 32
+} i2cbus_plan_config;
+
+/**
+ * @brief Burst read of consecutive registers.
+ * 
+ */
+typedef struct
+{
+    unsigned int start; ///< First register
+    int count;          ///< Number of registers
+    int offset;         ///< Offset of the data in the scratch buffer
+} i2cbus_plan_span;
+
+/**
+ * @brief Precomputed set of burst reads covering a list of registers.
+ * The device must auto-increment the register address on reads.
+ * 
+ */
+typedef struct
+{
+    i2cbus *dev;                    ///< i2c device descriptor
+    i2cbus_plan_config cfg;         ///< Register layout and merge policy
+    int nregs;                      ///< Number of requested registers
+    int nspans;                     ///< Number of burst reads
+    i2cbus_plan_span *spans;        ///< Burst reads, in register order
+    int *slot;                      ///< Offset in scratch of each requested register
+    unsigned char *addrbuf;         ///< Start address of each burst, as sent on the bus
+    unsigned char *scratch;         ///< Data of all bursts
+    i2cbus_batch batch;             ///< Prepared register-address write and read of each burst
+} i2cbus_plan;
+
+/**
+ * @brief Build a read plan. Registers are sorted and merged into the
+ * fewest burst reads allowed by max_gap and max_burst.
+ * 
+ * @param plan Plan to initialize
+ * @param dev i2c device descriptor, opened with i2cbus_open()
+ * @param cfg Register layout and merge policy
+ * @param regs Register addresses, in the order of the output slots (may repeat)
+ * @param nregs Number of register addresses
+ * @return int Number of burst reads on success, negative on error
+ */
+I2CBUS_API int i2cbus_plan_init(i2cbus_plan *plan, i2cbus *dev, const i2cbus_plan_config *cfg,
+                                const unsigned int *regs, int nregs);
+/**
+ * @brief Execute all burst reads of the plan under a single bus lock and
+ * scatter the values into the output slots.
+ * 
+ * @param plan Read plan
+ * @param out Output array of nregs slots of val_bits / 8 bytes each, in
+ * the order of the registers given to i2cbus_plan_init() (MSB first)
+ * @return int Number of burst reads on success, negative on error
+ */
+I2CBUS_API int i2cbus_plan_exec(i2cbus_plan *plan, void *out);
+/**
+ * @brief Release the memory held by a read plan.
+ * 
+ * @param plan Read plan
+ */
+I2CBUS_API void i2cbus_plan_free(i2cbus_plan *plan);
+#ifdef __cplusplus 
+}
+#endif
+#endif
@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "i2cbus_regmap.h"
+#include "i2cbus_log.h"
+
+#ifdef eprintf
+#undef eprintf
+#endif
+
+#define eprintf(str, ...) I2CBUS_LOG(str, ##__VA_ARGS__)
+
+static inline int regmap_in_ranges(const i2cbus_regmap_range *ranges, int num, unsigned int reg)
+{
+    for (int i = 0; i < num; i++)
+    {
+        if (reg >= ranges[i].min && reg <= ranges[i].max)
+            return 1;
+    }
+    return 0;
+}
+
+static inline int regmap_is_volatile(i2cbus_regmap *map, unsigned int reg)
+{
+    return regmap_in_ranges(map->cfg.volatile_ranges, map->cfg.num_volatile, reg);
+}
+
+static inline int regmap_is_readonly(i2cbus_regmap *map, unsigned int reg)
+{
+    return regmap_in_ranges(map->cfg.readonly_ranges, map->cfg.num_readonly, reg);
+}
+
+static inline int regmap_cached(i2cbus_regmap *map, unsigned int reg)
+{
+    return map->valid[reg >> 3] & (1 << (reg & 0x7));
+}
+
+static inline void regmap_cache_store(i2cbus_regmap *map, unsigned int reg, unsigned int val)
+{
+    map->cache[reg] = val;
+    map->valid[reg >> 3] |= 1 << (reg & 0x7);
+}
+
+static inline int regmap_dirty(i2cbus_regmap *map, unsigned int reg)
+{
+    return map->dirty[reg >> 3] & (1 << (reg & 0x7));
+}
+
+static inline void regmap_set_dirty(i2cbus_regmap *map, unsigned int reg, int dirty)
+{
+    if (dirty)
+        map->dirty[reg >> 3] |= 1 << (reg & 0x7);
+    else
+        map->dirty[reg >> 3] &= ~(1 << (reg & 0x7));
+}
+
+/**
+ * @brief Serialize a register address or value MSB first.
+ *
+ * @return int Number of bytes written to buf
+ */
+static inline int regmap_put(unsigned char *buf, int bits, unsigned int val)
+{
+    if (bits == 16)
+    {
+        buf[0] = val >> 8;
+        buf[1] = val;
+        return 2;
+    }
+    buf[0] = val;
+    return 1;
+}
+
+int i2cbus_regmap_init(i2cbus_regmap *map, i2cbus *dev, const i2cbus_regmap_config *cfg)
+{
+    if (map == NULL || dev == NULL || cfg == NULL)
+    {
+        eprintf("Invalid argument: map %p, device %p, config %p", map, dev, cfg);
+        return -1;
+    }
+    if (cfg->max_burst < 0)
+    {
+        eprintf("Invalid maximum burst length %d", cfg->max_burst);
+        return -1;
+    }
+    if ((cfg->reg_bits != 8 && cfg->reg_bits != 16) || (cfg->val_bits != 8 && cfg->val_bits != 16))
+    {
+        eprintf("Unsupported register layout: %d bit address, %d bit value", cfg->reg_bits, cfg->val_bits);
+        return -1;
+    }
+    if (cfg->max_register >= (1U << cfg->reg_bits))
+    {
+        eprintf("Maximum register 0x%x does not fit in %d bits", cfg->max_register, cfg->reg_bits);
+        return -1;
+    }
+    memset(map, 0, sizeof(i2cbus_regmap));
+    map->dev = dev;
+    map->cfg = *cfg;
+    map->cache = calloc(cfg->max_register + 1, sizeof(unsigned short));
+    map->valid = calloc((cfg->max_register >> 3) + 1, sizeof(unsigned char));
+    map->dirty = calloc((cfg->max_register >> 3) + 1, sizeof(unsigned char));
+    if (map->cfg.max_burst == 0)
+        map->cfg.max_burst = 16;
+    if (map->cache == NULL || map->valid == NULL || map->dirty == NULL)
+    {
+        eprintf("Could not allocate cache for %u registers", cfg->max_register + 1);
+        i2cbus_regmap_free(map);
+        return -2;
+    }
+    return 1;
+}
+
+void i2cbus_regmap_free(i2cbus_regmap *map)
+{
+    if (map == NULL)
+        return;
+    free(map->cache);
+    free(map->valid);
+    free(map->dirty);
+    map->cache = NULL;
+    map->valid = NULL;
+    map->dirty = NULL;
+}
+
+/**
+ * @brief Read a register from the device. Called with the bus lock held.
+ *
+ */
+static int regmap_bus_read(i2cbus_regmap *map, unsigned int reg, unsigned int *val)
+{
+    unsigned char obuf[2], ibuf[2];
+    int olen = regmap_put(obuf, map->cfg.reg_bits, reg);
+    int ilen = map->cfg.val_bits / 8;
+    if (i2cbus_xfer(map->dev, obuf, olen, ibuf, ilen, 0) != ilen)
+        return -1;
+    *val = ilen == 2 ? ((unsigned int)ibuf[0] << 8) | ibuf[1] : ibuf[0];
+    return 1;
+}
+
+/**
+ * @brief Write a register to the device. Called with the bus lock held.
+ *
+ */
+static int regmap_bus_write(i2cbus_regmap *map, unsigned int reg, unsigned int val)
+{
+    unsigned char buf[4];
+    int len = regmap_put(buf, map->cfg.reg_bits, reg);
+    len += regmap_put(buf + len, map->cfg.val_bits, val);
+    if (i2cbus_write(map->dev, buf, len) != len)
+        return -1;
+    return 1;
+}
+
+int i2cbus_regmap_read(i2cbus_regmap *map, unsigned int reg, unsigned int *val)
+{
+    if (map == NULL || map->cache == NULL || val == NULL)
+    {
+        eprintf("Invalid argument: map %p, value %p", map, val);
+        return -1;
+    }
+    if (reg > map->cfg.max_register)
+    {
+        eprintf("Register 0x%x out of range, maximum is 0x%x", reg, map->cfg.max_register);
+        return -1;
+    }
+    int ret = i2cbus_lock(map->dev->id);
+    if (ret < 0)
+        return ret;
+    if (regmap_is_volatile(map, reg))
+    {
+        ret = regmap_bus_read(map, reg, val);
+    }
+    else if (regmap_cached(map, reg))
+    {
+        *val = map->cache[reg];
+        ret = 1;
+    }
+    else if ((ret = regmap_bus_read(map, reg, val)) > 0)
+    {
+        regmap_cache_store(map, reg, *val);
+    }
+    i2cbus_unlock(map->dev->id);
+    return ret;
+}
+
+int i2cbus_regmap_write(i2cbus_regmap *map, unsigned int reg, unsigned int val)
+{
+    if (map == NULL || map->cache == NULL)
+    {
+        eprintf("Invalid register map %p", map);
+        return -1;
+    }
+    if (reg > map->cfg.max_register)
+    {
+        eprintf("Register 0x%x out of range, maximum is 0x%x", reg, map->cfg.max_register);
+        return -1;
+    }
+    if (regmap_is_readonly(map, reg))
+    {
+        eprintf("Register 0x%x is read-only", reg);
+        return -2;
+    }
+    val &= (1U << map->cfg.val_bits) - 1;
+    int ret = i2cbus_lock(map->dev->id);
+    if (ret < 0)
+        return ret;
+    if (regmap_is_volatile(map, reg))
+    {
+        ret = regmap_bus_write(map, reg, val);
+    }
+    else if (regmap_cached(map, reg) && map->cache[reg] == val)
+    {
+        ret = 1; // unchanged, skip the bus transaction
+    }
+    else if (map->cfg.cache_mode == I2CBUS_REGMAP_WRITE_BACK)
+    {
+        regmap_cache_store(map, reg, val);
+        regmap_set_dirty(map, reg, 1);
+        ret = 1;
+    }
+    else if ((ret = regmap_bus_write(map, reg, val)) > 0)
+    {
+        regmap_cache_store(map, reg, val);
+    }
+    i2cbus_unlock(map->dev->id);
+    return ret;
+}
+
+int i2cbus_regmap_update_bits(i2cbus_regmap *map, unsigned int reg, unsigned int mask, unsigned int val)
+{
+    if (map == NULL || map->dev == NULL)
+    {
+        eprintf("Invalid register map %p", map);
+        return -1;
+    }
+    unsigned int orig;
+    int ret = i2cbus_lock(map->dev->id);
+    if (ret < 0)
+        return ret;
+    if ((ret = i2cbus_regmap_read(map, reg, &orig)) > 0)
+        ret = i2cbus_regmap_write(map, reg, (orig & ~mask) | (val & mask));
+    i2cbus_unlock(map->dev->id);
+    return ret;
+}
+
+int i2cbus_regmap_sync(i2cbus_regmap *map)
+{
+    if (map == NULL || map->cache == NULL)
+    {
+        eprintf("Invalid register map %p", map);
+        return -1;
+    }
+    int rlen = map->cfg.reg_bits / 8;
+    int vlen = map->cfg.val_bits / 8;
+    unsigned int nregs = map->cfg.max_register + 1;
+    unsigned char *buf = NULL;
+    i2cbus_batch batch;
+    int ret = i2cbus_batch_init(&batch, map->dev);
+    if (ret < 0)
+        return ret;
+    ret = i2cbus_lock(map->dev->id);
+    if (ret < 0)
+        return ret;
+    int nwrites = 0;
+    unsigned char *ptr = NULL;
+    for (unsigned int reg = 0; reg < nregs; reg++)
+    {
+        if (!regmap_dirty(map, reg))
+            continue;
+        if (buf == NULL && (ptr = buf = malloc(nregs * (rlen + vlen))) == NULL)
+        {
+            eprintf("Could not allocate %u bytes for sync", nregs * (rlen + vlen));
+            ret = -2;
+            goto out;
+        }
+        // collect a run of consecutive dirty registers
+        unsigned char *start = ptr;
+        ptr += regmap_put(ptr, map->cfg.reg_bits, reg);
+        int count = 0;
+        while (reg < nregs && count < map->cfg.max_burst && regmap_dirty(map, reg))
+        {
+            ptr += regmap_put(ptr, map->cfg.val_bits, map->cache[reg]);
+            reg++;
+            count++;
+        }
+        reg--; // loop increment moves past the run
+        if ((ret = i2cbus_batch_write(&batch, -1, start, ptr - start)) < 0)
+            goto out;
+        nwrites++;
+    }
+    if (nwrites > 0)
+    {
+        if ((ret = i2cbus_batch_run(&batch)) < 0)
+            goto out;
+        memset(map->dirty, 0, (map->cfg.max_register >> 3) + 1);
+    }
+    ret = nwrites;
+out:
+    i2cbus_unlock(map->dev->id);
+    i2cbus_batch_free(&batch);
+    free(buf);
+    return ret;
+}
+
+void i2cbus_regmap_cache_drop(i2cbus_regmap *map)
+{
+    if (map == NULL || map->valid == NULL)
+        return;
+    int locked = map->dev != NULL && i2cbus_lock(map->dev->id) > 0;
+    memset(map->valid, 0, (map->cfg.max_register >> 3) + 1);
+    memset(map->dirty, 0, (map->cfg.max_register >> 3) + 1);
+    if (locked)
+        i2cbus_unlock(map->dev->id);
+}
@@ -0,0 +1,141 @@
+/**
+ * @file i2cbus_regmap.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Register map with an in-memory shadow cache over i2cbus.
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef __I2CBUS_REGMAP_H
+#define __I2CBUS_REGMAP_H
+#ifdef __cplusplus 
+extern "C" {
+#endif
+#include "i2cbus.h"
+
+/**
+ * @brief Inclusive range of register addresses.
+ * 
+ */
+typedef struct
+{
+    unsigned int min; ///< First register in the range
+    unsigned int max; ///< Last register in the range
+} i2cbus_regmap_range;
+
+/**
+ * @brief Cache policy for writes to non-volatile registers.
+ * 
+ */
+typedef enum
+{
+    I2CBUS_REGMAP_WRITE_THROUGH = 0, ///< Writes go to the device immediately
+    I2CBUS_REGMAP_WRITE_BACK,        ///< Writes only update the cache until i2cbus_regmap_sync()
+} i2cbus_regmap_cache_mode;
+
+/**
+ * @brief Description of the register layout of a device.
+ * 
+ */
+typedef struct
+{
+    int reg_bits;                               ///< Register address width in bits (8 or 16), sent MSB first
+    int val_bits;                               ///< Register value width in bits (8 or 16), MSB first
+    unsigned int max_register;                  ///< Highest valid register address
+    const i2cbus_regmap_range *volatile_ranges; ///< Registers changed by the device, never cached
+    int num_volatile;                           ///< Number of volatile ranges
+    const i2cbus_regmap_range *readonly_ranges; ///< Registers that can not be written
+    int num_readonly;                           ///< Number of read-only ranges
+    i2cbus_regmap_cache_mode cache_mode;        ///< Write policy for non-volatile registers
+    int max_burst;                              ///< Most registers per auto-increment write in i2cbus_regmap_sync(), 0 for 16, 1 if the device does not auto-increment
+} i2cbus_regmap_config;
+
+/**
+ * @brief Register map of a device. Reads of non-volatile registers are
+ * served from the shadow cache once the register has been read or
+ * written, and writes that do not change a cached value are skipped.
+ * 
+ */
+typedef struct
+{
+    i2cbus *dev;                 ///< i2c device descriptor
+    i2cbus_regmap_config cfg;    ///< Register layout (ranges are not copied)
+    unsigned short *cache;       ///< Shadow register values, indexed by register address
+    unsigned char *valid;        ///< Bitmap of cached registers
+    unsigned char *dirty;        ///< Bitmap of registers not yet written to the device (write-back)
+} i2cbus_regmap;
+
+/**
+ * @brief Initialize a register map for a device. The cache starts empty.
+ * 
+ * @param map Register map to initialize
+ * @param dev i2c device descriptor, opened with i2cbus_open()
+ * @param cfg Register layout, copied; the range arrays must stay valid
+ * @return int 1 on success, negative on error
+ */
+I2CBUS_API int i2cbus_regmap_init(i2cbus_regmap *map, i2cbus *dev, const i2cbus_regmap_config *cfg);
+/**
+ * @brief Release the memory held by a register map. The device is not closed.
+ * 
+ * @param map Register map
+ */
+I2CBUS_API void i2cbus_regmap_free(i2cbus_regmap *map);
+/**
+ * @brief Read a register, from the cache if possible.
+ * 
+ * Note: Cache and bus access by this function is protected by the
+ * recursive bus lock.
+ * 
+ * @param map Register map
+ * @param reg Register address
+ * @param val Pointer to store the register value
+ * @return int 1 on success, negative on error
+ */
+I2CBUS_API int i2cbus_regmap_read(i2cbus_regmap *map, unsigned int reg, unsigned int *val);
+/**
+ * @brief Write a register, unless the cached value already matches.
+ * In write-back mode, non-volatile registers are only updated in the
+ * cache and marked dirty.
+ * 
+ * Note: Cache and bus access by this function is protected by the
+ * recursive bus lock.
+ * 
+ * @param map Register map
+ * @param reg Register address
+ * @param val Register value
+ * @return int 1 on success, -2 if the register is read-only, negative on error
+ */
+I2CBUS_API int i2cbus_regmap_write(i2cbus_regmap *map, unsigned int reg, unsigned int val);
+/**
+ * @brief Read-modify-write the bits selected by mask in a register.
+ * 
+ * @param map Register map
+ * @param reg Register address
+ * @param mask Bits to update
+ * @param val New value of the bits selected by mask
+ * @return int 1 on success, negative on error
+ */
+I2CBUS_API int i2cbus_regmap_update_bits(i2cbus_regmap *map, unsigned int reg, unsigned int mask, unsigned int val);
+/**
+ * @brief Write all dirty registers to the device. Runs of consecutive
+ * dirty registers are merged into auto-increment writes of up to
+ * max_burst registers, and all writes are sent with i2cbus_batch_run().
+ * 
+ * @param map Register map
+ * @return int Number of write transactions on success, negative on error.
+ * Registers stay dirty if their write may not have completed.
+ */
+I2CBUS_API int i2cbus_regmap_sync(i2cbus_regmap *map);
+/**
+ * @brief Forget all cached values, e.g. after a device reset. Dirty
+ * registers are discarded without being written.
+ * 
+ * @param map Register map
+ */
+I2CBUS_API void i2cbus_regmap_cache_drop(i2cbus_regmap *map);
+#ifdef __cplusplus 
+}
+#endif
+#endif
@@ -0,0 +1,666 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <linux/i2c-dev.h>
+#include <linux/i2c.h>
+#include "i2cbus_sim.h"
+#include "i2cbus_log.h"
+
+#ifdef eprintf
+#undef eprintf
+#endif
+
+#define eprintf(str, ...) I2CBUS_LOG(str, ##__VA_ARGS__)
+
+#define SIM_SPIN_NS 50000 /// Remaining bus time below which the simulator spins instead of sleeping
+
+/**
+ * @brief Register-file slave on a simulated bus.
+ *
+ */
+struct sim_device
+{
+    int reg_bytes;       ///< Register pointer width in bytes
+    unsigned int size;   ///< Number of registers
+    unsigned int ptr;    ///< Register pointer
+    unsigned char *mem;  ///< Registers
+    int pec;             ///< Non-zero if I2C transactions carry a PEC byte
+    int busy;            ///< Number of upcoming transactions to NACK
+};
+
+/**
+ * @brief Simulated bus: the slaves on it and its timing model.
+ *
+ */
+struct sim_bus
+{
+    pthread_mutex_t lock;             ///< Serializes transfers, like the adapter would
+    i2cbus_sim_timing timing;         ///< Timing model
+    int addr;                         ///< Address bound with I2C_SLAVE
+    int pec;                          ///< SMBus PEC enabled with I2C_PEC
+    unsigned long funcs;              ///< Functionality reported by I2C_FUNCS and enforced
+    unsigned long timeout;            ///< Adapter timeout set with I2C_TIMEOUT (10 ms units)
+    unsigned long retries;            ///< Adapter retries set with I2C_RETRIES
+    struct sim_device *devices[128];  ///< Slaves by 7-bit address
+};
+
+static struct sim_bus *sim_buses[I2CBUS_SIM_MAX_BUS];
+static pthread_mutex_t sim_buses_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct sim_bus *sim_bus_get(int id)
+{
+    if (id < 0 || id >= I2CBUS_SIM_MAX_BUS)
+        return NULL;
+    return __atomic_load_n(&(sim_buses[id]), __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Occupy the bus until start + ns, sleeping for most of the time
+ * like a transfer waiting on adapter interrupts.
+ *
+ */
+static void sim_wait(const struct timespec *start, unsigned long ns)
+{
+    if (ns == 0)
+        return;
+    struct timespec end = *start, now;
+    end.tv_sec += ns / 1000000000;
+    end.tv_nsec += ns % 1000000000;
+    if (end.tv_nsec >= 1000000000)
+    {
+        end.tv_sec++;
+        end.tv_nsec -= 1000000000;
+    }
+    for (;;)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int64_t left = (int64_t)(end.tv_sec - now.tv_sec) * 1000000000 + (end.tv_nsec - now.tv_nsec);
+        if (left <= 0)
+            return;
+        if (left > SIM_SPIN_NS)
+        {
+            struct timespec wake = end;
+            wake.tv_nsec -= SIM_SPIN_NS;
+            if (wake.tv_nsec < 0)
+            {
+                wake.tv_sec--;
+                wake.tv_nsec += 1000000000;
+            }
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL);
+        }
+    }
+}
+
+/**
+ * @brief Carry out one message on a slave.
+ *
+ */
+static void sim_device_msg(struct sim_device *sd, struct i2c_msg *msg)
+{
+    int i = 0;
+    if (!(msg->flags & I2C_M_RD))
+    {
+        if (msg->len >= sd->reg_bytes)
+        {
+            sd->ptr = 0;
+            for (; i < sd->reg_bytes; i++)
+                sd->ptr = (sd->ptr << 8) | msg->buf[i];
+            sd->ptr %= sd->size;
+        }
+        for (; i < msg->len; i++)
+        {
+            sd->mem[sd->ptr] = msg->buf[i];
+            sd->ptr = (sd->ptr + 1) % sd->size;
+        }
+    }
+    else
+    {
+        for (; i < msg->len; i++)
+        {
+            msg->buf[i] = sd->mem[sd->ptr];
+            sd->ptr = (sd->ptr + 1) % sd->size;
+        }
+    }
+}
+
+static int sim_rdwr(struct sim_bus *sb, struct i2c_rdwr_ioctl_data *data)
+{
+    if (!(__atomic_load_n(&(sb->funcs), __ATOMIC_RELAXED) & I2C_FUNC_I2C))
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (data == NULL || data->msgs == NULL || data->nmsgs == 0 || data->nmsgs > I2C_RDWR_IOCTL_MAX_MSGS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    struct timespec start;
+    unsigned long bytes = 0;
+    unsigned char crc = 0;
+    int ret = data->nmsgs;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&(sb->lock));
+    for (unsigned int i = 0; i < data->nmsgs; i++)
+    {
+        struct i2c_msg *msg = &(data->msgs[i]);
+        if (msg->len > 8192 || (msg->len > 0 && msg->buf == NULL))
+        {
+            errno = EINVAL;
+            ret = -1;
+            break;
+        }
+        bytes++; // address byte
+        struct sim_device *sd = msg->addr < 128 ? sb->devices[msg->addr] : NULL;
+        if (sd != NULL && sd->busy > 0)
+        {
+            sd->busy--;
+            sd = NULL;
+        }
+        if (sd == NULL)
+        {
+            errno = ENXIO; // address NACK ends the transfer
+            ret = -1;
+            break;
+        }
+        bytes += msg->len;
+        crc = i2cbus_pec(crc, &(unsigned char){(msg->addr << 1) | ((msg->flags & I2C_M_RD) ? 1 : 0)}, 1);
+        if (sd->pec && i == data->nmsgs - 1 && msg->len > 0)
+        {
+            // the last message of the transaction carries the PEC byte
+            struct i2c_msg body = *msg;
+            body.len--;
+            if (!(msg->flags & I2C_M_RD))
+            {
+                if (i2cbus_pec(crc, msg->buf, body.len) != msg->buf[body.len])
+                {
+                    errno = EREMOTEIO; // slave NACKs a bad PEC
+                    ret = -1;
+                    break;
+                }
+                sim_device_msg(sd, &body);
+            }
+            else
+            {
+                sim_device_msg(sd, &body);
+                msg->buf[body.len] = i2cbus_pec(crc, msg->buf, body.len);
+            }
+            continue;
+        }
+        sim_device_msg(sd, msg);
+        crc = i2cbus_pec(crc, msg->buf, msg->len);
+    }
+    sim_wait(&start, sb->timing.xfer_ns + bytes * sb->timing.byte_ns);
+    pthread_mutex_unlock(&(sb->lock));
+    return ret;
+}
+
+/**
+ * @brief Copy between a buffer and consecutive registers of a slave,
+ * wrapping at the end of the register file. The register pointer is
+ * left untouched.
+ *
+ */
+static void sim_device_copy(struct sim_device *sd, unsigned int reg, unsigned char *buf, int len, int to_dev)
+{
+    for (int i = 0; i < len; i++)
+    {
+        unsigned int r = (reg + i) % sd->size;
+        if (to_dev)
+            sd->mem[r] = buf[i];
+        else
+            buf[i] = sd->mem[r];
+    }
+}
+
+/**
+ * @brief Carry out an SMBus transaction on a slave. The command byte
+ * selects the register, so on slaves with 16-bit register pointers
+ * only the first 256 registers can be read that way. Byte data, word
+ * data and I2C block writes to such slaves are instead taken as the
+ * bytes they put on the wire, command first, as a real slave sees them:
+ * the first two set the register pointer. A block (SMBus block
+ * write) is stored as its byte count at the command register followed
+ * by the data, and a block read returns what is stored there in the
+ * same layout. Process calls echo the data written back.
+ *
+ * @return int Bytes on the wire, -1 on failure (errno is set)
+ */
+static int sim_device_smbus(struct sim_device *sd, struct i2c_smbus_ioctl_data *args)
+{
+    union i2c_smbus_data *data = args->data;
+    unsigned int cmd = args->command;
+    int rd = args->read_write == I2C_SMBUS_READ;
+    unsigned char buf[I2C_SMBUS_BLOCK_MAX + 1];
+    int len;
+    if (sd->reg_bytes > 1 && !rd &&
+        (args->size == I2C_SMBUS_BYTE_DATA || args->size == I2C_SMBUS_WORD_DATA || args->size == I2C_SMBUS_I2C_BLOCK_DATA))
+    {
+        struct i2c_msg msg = {.addr = 0, .flags = 0, .len = 0, .buf = buf};
+        buf[0] = cmd;
+        if (args->size == I2C_SMBUS_BYTE_DATA)
+        {
+            buf[1] = data->byte;
+            msg.len = 2;
+        }
+        else if (args->size == I2C_SMBUS_WORD_DATA)
+        {
+            buf[1] = data->word & 0xff;
+            buf[2] = data->word >> 8;
+            msg.len = 3;
+        }
+        else
+        {
+            len = data->block[0];
+            if (len == 0 || len > I2C_SMBUS_BLOCK_MAX)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+            memcpy(buf + 1, data->block + 1, len);
+            msg.len = len + 1;
+        }
+        sim_device_msg(sd, &msg);
+        return msg.len + 1;
+    }
+    switch (args->size)
+    {
+    case I2C_SMBUS_QUICK:
+        return 1;
+    case I2C_SMBUS_BYTE:
+        if (rd)
+        {
+            data->byte = sd->mem[sd->ptr];
+            sd->ptr = (sd->ptr + 1) % sd->size;
+        }
+        else
+        {
+            sd->ptr = cmd % sd->size;
+        }
+        return 2;
+    case I2C_SMBUS_BYTE_DATA:
+        sim_device_copy(sd, cmd, &(data->byte), 1, !rd);
+        sd->ptr = (cmd + 1) % sd->size;
+        return rd ? 4 : 3;
+    case I2C_SMBUS_WORD_DATA:
+    case I2C_SMBUS_PROC_CALL:
+        if (!rd)
+        {
+            buf[0] = data->word & 0xff;
+            buf[1] = data->word >> 8;
+            sim_device_copy(sd, cmd, buf, 2, 1);
+        }
+        if (rd || args->size == I2C_SMBUS_PROC_CALL)
+        {
+            sim_device_copy(sd, cmd, buf, 2, 0);
+            data->word = buf[0] | (buf[1] << 8);
+        }
+        sd->ptr = (cmd + 2) % sd->size;
+        return args->size == I2C_SMBUS_PROC_CALL ? 7 : rd ? 5 : 4;
+    case I2C_SMBUS_BLOCK_DATA:
+    case I2C_SMBUS_BLOCK_PROC_CALL:
+        len = 0;
+        if (!rd)
+        {
+            if (data->block[0] > I2C_SMBUS_BLOCK_MAX)
+            {
+                errno = EINVAL;
+                return -1;
+            }
+            len = data->block[0] + 1;
+            sim_device_copy(sd, cmd, data->block, len, 1);
+        }
+        if (rd || args->size == I2C_SMBUS_BLOCK_PROC_CALL)
+        {
+            sim_device_copy(sd, cmd, buf, 1, 0);
+            if (buf[0] > I2C_SMBUS_BLOCK_MAX)
+            {
+                errno = EPROTO;
+                return -1;
+            }
+            sim_device_copy(sd, cmd, data->block, buf[0] + 1, 0);
+            len += buf[0] + 1;
+        }
+        sd->ptr = (cmd + len) % sd->size;
+        return len + (rd || args->size == I2C_SMBUS_BLOCK_PROC_CALL ? 3 : 2);
+    case I2C_SMBUS_I2C_BLOCK_DATA:
+        len = data->block[0];
+        if (len == 0 || len > I2C_SMBUS_BLOCK_MAX)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        sim_device_copy(sd, cmd, data->block + 1, len, !rd);
+        sd->ptr = (cmd + len) % sd->size;
+        return len + (rd ? 3 : 2);
+    default:
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+}
+
+/**
+ * @brief Functionality bit an SMBus transaction requires.
+ *
+ */
+static unsigned long sim_smbus_func(int size, int rd)
+{
+    switch (size)
+    {
+    case I2C_SMBUS_QUICK:
+        return I2C_FUNC_SMBUS_QUICK;
+    case I2C_SMBUS_BYTE:
+        return rd ? I2C_FUNC_SMBUS_READ_BYTE : I2C_FUNC_SMBUS_WRITE_BYTE;
+    case I2C_SMBUS_BYTE_DATA:
+        return rd ? I2C_FUNC_SMBUS_READ_BYTE_DATA : I2C_FUNC_SMBUS_WRITE_BYTE_DATA;
+    case I2C_SMBUS_WORD_DATA:
+        return rd ? I2C_FUNC_SMBUS_READ_WORD_DATA : I2C_FUNC_SMBUS_WRITE_WORD_DATA;
+    case I2C_SMBUS_PROC_CALL:
+        return I2C_FUNC_SMBUS_PROC_CALL;
+    case I2C_SMBUS_BLOCK_DATA:
+        return rd ? I2C_FUNC_SMBUS_READ_BLOCK_DATA : I2C_FUNC_SMBUS_WRITE_BLOCK_DATA;
+    case I2C_SMBUS_I2C_BLOCK_DATA:
+        return rd ? I2C_FUNC_SMBUS_READ_I2C_BLOCK : I2C_FUNC_SMBUS_WRITE_I2C_BLOCK;
+    case I2C_SMBUS_BLOCK_PROC_CALL:
+        return I2C_FUNC_SMBUS_BLOCK_PROC_CALL;
+    default:
+        return 0;
+    }
+}
+
+static int sim_smbus(struct sim_bus *sb, struct i2c_smbus_ioctl_data *args)
+{
+    if (args != NULL &&
+        !(__atomic_load_n(&(sb->funcs), __ATOMIC_RELAXED) & sim_smbus_func(args->size, args->read_write == I2C_SMBUS_READ)))
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    if (args == NULL || (args->data == NULL && args->size != I2C_SMBUS_QUICK &&
+                         !(args->size == I2C_SMBUS_BYTE && args->read_write == I2C_SMBUS_WRITE)))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    struct timespec start;
+    int ret = 0, bytes = 1;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_mutex_lock(&(sb->lock));
+    struct sim_device *sd = sb->devices[sb->addr];
+    if (sd != NULL && sd->busy > 0)
+    {
+        sd->busy--;
+        sd = NULL;
+    }
+    if (sd == NULL)
+    {
+        errno = ENXIO;
+        ret = -1;
+    }
+    else if ((bytes = sim_device_smbus(sd, args)) < 0)
+    {
+        bytes = 1;
+        ret = -1;
+    }
+    else if (sb->pec && args->size != I2C_SMBUS_QUICK)
+    {
+        bytes++; // PEC byte
+    }
+    sim_wait(&start, sb->timing.xfer_ns + bytes * sb->timing.byte_ns);
+    pthread_mutex_unlock(&(sb->lock));
+    return ret;
+}
+
+static int sim_open(const i2cbus_backend *be, int id)
+{
+    (void)be;
+    if (sim_bus_get(id) == NULL)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    return id;
+}
+
+static int sim_close(const i2cbus_backend *be, int handle)
+{
+    (void)be;
+    if (sim_bus_get(handle) == NULL)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    return 0;
+}
+
+static int sim_ioctl(const i2cbus_backend *be, int handle, unsigned long request, void *arg)
+{
+    (void)be;
+    struct sim_bus *sb = sim_bus_get(handle);
+    if (sb == NULL)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    switch (request)
+    {
+    case I2C_RDWR:
+        return sim_rdwr(sb, arg);
+    case I2C_SMBUS:
+        return sim_smbus(sb, arg);
+    case I2C_FUNCS:
+        *(unsigned long *)arg = __atomic_load_n(&(sb->funcs), __ATOMIC_RELAXED);
+        return 0;
+    case I2C_PEC:
+        pthread_mutex_lock(&(sb->lock));
+        sb->pec = arg != NULL;
+        pthread_mutex_unlock(&(sb->lock));
+        return 0;
+    case I2C_TIMEOUT:
+        __atomic_store_n(&(sb->timeout), (unsigned long)arg, __ATOMIC_RELAXED);
+        return 0;
+    case I2C_RETRIES:
+        __atomic_store_n(&(sb->retries), (unsigned long)arg, __ATOMIC_RELAXED);
+        return 0;
+    case I2C_SLAVE:
+    case I2C_SLAVE_FORCE:
+        if ((unsigned long)arg > 0x7f)
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        pthread_mutex_lock(&(sb->lock));
+        sb->addr = (unsigned long)arg;
+        pthread_mutex_unlock(&(sb->lock));
+        return 0;
+    default:
+        errno = ENOTTY;
+        return -1;
+    }
+}
+
+const i2cbus_backend i2cbus_backend_sim = {
+    .name = "sim",
+    .open = sim_open,
+    .close = sim_close,
+    .ioctl = sim_ioctl,
+    .priv = NULL,
+};
+
+int i2cbus_sim_create(int id, const i2cbus_sim_timing *timing)
+{
+    if (id < 0 || id >= I2CBUS_SIM_MAX_BUS)
+    {
+        eprintf("Simulated bus ID %d out of range, maximum is %d", id, I2CBUS_SIM_MAX_BUS - 1);
+        return -1;
+    }
+    pthread_mutex_lock(&sim_buses_lock);
+    struct sim_bus *sb = sim_buses[id];
+    if (sb == NULL)
+    {
+        sb = calloc(1, sizeof(struct sim_bus));
+        if (sb == NULL)
+        {
+            eprintf("Could not allocate simulated bus %d", id);
+            pthread_mutex_unlock(&sim_buses_lock);
+            return -2;
+        }
+        pthread_mutex_init(&(sb->lock), NULL);
+        sb->funcs = I2CBUS_SIM_FUNCS_DEFAULT;
+        __atomic_store_n(&(sim_buses[id]), sb, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_lock(&(sb->lock));
+    if (timing != NULL)
+        sb->timing = *timing;
+    else
+        memset(&(sb->timing), 0, sizeof(i2cbus_sim_timing));
+    pthread_mutex_unlock(&(sb->lock));
+    pthread_mutex_unlock(&sim_buses_lock);
+    return 1;
+}
+
+int i2cbus_sim_add_device(int id, int addr, int reg_bits, int size)
+{
+    struct sim_bus *sb = sim_bus_get(id);
+    if (sb == NULL)
+    {
+        eprintf("Simulated bus %d does not exist", id);
+        return -1;
+    }
+    if (addr < 0 || addr > 0x7f || (reg_bits != 8 && reg_bits != 16) || size <= 0 || size > 65536)
+    {
+        eprintf("Invalid simulated device: address 0x%02x, %d bit pointer, %d registers", addr, reg_bits, size);
+        return -1;
+    }
+    struct sim_device *sd = calloc(1, sizeof(struct sim_device));
+    if (sd == NULL || (sd->mem = calloc(size, 1)) == NULL)
+    {
+        eprintf("Could not allocate simulated device 0x%02x", addr);
+        free(sd);
+        return -2;
+    }
+    sd->reg_bytes = reg_bits / 8;
+    sd->size = size;
+    pthread_mutex_lock(&(sb->lock));
+    struct sim_device *old = sb->devices[addr];
+    sb->devices[addr] = sd;
+    pthread_mutex_unlock(&(sb->lock));
+    if (old != NULL)
+    {
+        free(old->mem);
+        free(old);
+    }
+    return 1;
+}
+
+/**
+ * @brief Copy between a buffer and the registers of a slave, wrapping at
+ * the end of the register file.
+ *
+ */
+static int sim_copy(int id, int addr, unsigned int reg, unsigned char *buf, int len, int to_dev)
+{
+    struct sim_bus *sb = sim_bus_get(id);
+    if (sb == NULL || addr < 0 || addr > 0x7f || buf == NULL || len < 0)
+    {
+        eprintf("Invalid argument: bus %d, address 0x%02x, buffer %p, length %d", id, addr, buf, len);
+        return -1;
+    }
+    pthread_mutex_lock(&(sb->lock));
+    struct sim_device *sd = sb->devices[addr];
+    if (sd == NULL)
+    {
+        pthread_mutex_unlock(&(sb->lock));
+        eprintf("No simulated device at address 0x%02x on bus %d", addr, id);
+        return -1;
+    }
+    sim_device_copy(sd, reg, buf, len, to_dev);
+    pthread_mutex_unlock(&(sb->lock));
+    return len;
+}
+
+int i2cbus_sim_set_funcs(int id, unsigned long funcs)
+{
+    struct sim_bus *sb = sim_bus_get(id);
+    if (sb == NULL)
+    {
+        eprintf("Simulated bus %d does not exist", id);
+        return -1;
+    }
+    __atomic_store_n(&(sb->funcs), funcs, __ATOMIC_RELAXED);
+    return 1;
+}
+
+int i2cbus_sim_set_pec(int id, int addr, int on)
+{
+    struct sim_bus *sb = sim_bus_get(id);
+    if (sb == NULL || addr < 0 || addr > 0x7f)
+    {
+        eprintf("Invalid argument: bus %d, address 0x%02x", id, addr);
+        return -1;
+    }
+    pthread_mutex_lock(&(sb->lock));
+    struct sim_device *sd = sb->devices[addr];
+    if (sd != NULL)
+        sd->pec = on;
+    pthread_mutex_unlock(&(sb->lock));
+    if (sd == NULL)
+    {
+        eprintf("No simulated device at address 0x%02x on bus %d", addr, id);
+        return -1;
+    }
+    return 1;
+}
+
+int i2cbus_sim_set_busy(int id, int addr, int count)
+{
+    struct sim_bus *sb = sim_bus_get(id);
+    if (sb == NULL || addr < 0 || addr > 0x7f || count < 0)
+    {
+        eprintf("Invalid argument: bus %d, address 0x%02x, count %d", id, addr, count);
+        return -1;
+    }
+    pthread_mutex_lock(&(sb->lock));
+    struct sim_device *sd = sb->devices[addr];
+    if (sd != NULL)
+        sd->busy = count;
+    pthread_mutex_unlock(&(sb->lock));
+    if (sd == NULL)
+    {
+        eprintf("No simulated device at address 0x%02x on bus %d", addr, id);
+        return -1;
+    }
+    return 1;
+}
+
+int i2cbus_sim_get_adapter(int id, unsigned long *timeout, unsigned long *retries)
+{
+    struct sim_bus *sb = sim_bus_get(id);
+    if (sb == NULL)
+    {
+        eprintf("Invalid bus %d", id);
+        return -1;
+    }
+    if (timeout != NULL)
+        *timeout = __atomic_load_n(&(sb->timeout), __ATOMIC_RELAXED);
+    if (retries != NULL)
+        *retries = __atomic_load_n(&(sb->retries), __ATOMIC_RELAXED);
+    return 1;
+}
+
+int i2cbus_sim_poke(int id, int addr, unsigned int reg, const void *buf, int len)
+{
+    return sim_copy(id, addr, reg, (unsigned char *)buf, len, 1);
+}
+
+int i2cbus_sim_peek(int id, int addr, unsigned int reg, void *buf, int len)
+{
+    return sim_copy(id, addr, reg, buf, len, 0);
+}
@@ -0,0 +1,141 @@
+/**
+ * @file i2cbus_sim.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief In-process simulated I2C bus backend.
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef __I2CBUS_SIM_H
+#define __I2CBUS_SIM_H
+#ifdef __cplusplus 
+extern "C" {
+#endif
+#include "i2cbus.h"
+
+#ifndef I2CBUS_SIM_MAX_BUS
+#define I2CBUS_SIM_MAX_BUS 64 ///< Number of simulated buses
+#endif
+
+/**
+ * @brief Functionality of a new simulated bus: plain I2C and every SMBus
+ * transaction (I2C_FUNC_I2C | I2C_FUNC_SMBUS_EMUL_ALL from linux/i2c.h).
+ * 
+ */
+#define I2CBUS_SIM_FUNCS_DEFAULT 0x0fff8009UL
+
+/**
+ * @brief Timing model of a simulated bus. A transfer of n messages
+ * carrying b data bytes occupies the bus for
+ * xfer_ns + (n + b) * byte_ns nanoseconds (one address byte per message).
+ * 
+ */
+typedef struct
+{
+    unsigned long byte_ns; ///< Time per byte including ACK, e.g. 90000 at 100 kHz, 22500 at 400 kHz
+    unsigned long xfer_ns; ///< Fixed time per transfer (start, stop, driver overhead)
+} i2cbus_sim_timing;
+
+/**
+ * @brief Backend serving simulated buses created with i2cbus_sim_create(),
+ * for use with i2cbus_open_backend(). Emulates I2C_RDWR and I2C_SMBUS
+ * transfers (with PEC); SMBus commands address the registers of the slave,
+ * except that writes to a slave with 16-bit register pointers are taken
+ * as the bytes they put on the wire, command first.
+ * 
+ */
+I2CBUS_API extern const i2cbus_backend i2cbus_backend_sim;
+
+/**
+ * @brief Create a simulated bus, or update its timing if it exists.
+ * 
+ * @param id Bus ID (0 to I2CBUS_SIM_MAX_BUS - 1)
+ * @param timing Timing model, NULL for zero-time transfers
+ * @return int 1 on success, negative on error
+ */
+I2CBUS_API int i2cbus_sim_create(int id, const i2cbus_sim_timing *timing);
+/**
+ * @brief Attach a register-file slave to a simulated bus. The first
+ * reg_bits / 8 bytes of a write set the register pointer (MSB first), the
+ * remaining bytes are stored from the pointer on; reads return bytes from
+ * the pointer on. The pointer auto-increments and wraps at size.
+ * 
+ * @param id Bus ID
+ * @param addr 7-bit slave address
+ * @param reg_bits Register pointer width in bits (8 or 16)
+ * @param size Number of registers (1 to 65536)
+ * @return int 1 on success, negative on error
+ */
+I2CBUS_API int i2cbus_sim_add_device(int id, int addr, int reg_bits, int size);
+/**
+ * @brief Set the functionality a simulated bus reports with I2C_FUNCS.
+ * Transactions outside of it fail with EOPNOTSUPP, e.g. a mask without
+ * I2C_FUNC_I2C behaves like an SMBus-only adapter such as i2c-stub. The
+ * library queries the mask when the bus is opened, so set it before
+ * opening the first device.
+ * 
+ * @param id Bus ID
+ * @param funcs I2C_FUNC_* mask from linux/i2c.h
+ * @return int 1 on success, -1 on error
+ */
+I2CBUS_API int i2cbus_sim_set_funcs(int id, unsigned long funcs);
+/**
+ * @brief Make a slave expect a PEC byte at the end of each I2C_RDWR
+ * transaction it takes part in: it checks (and NACKs a bad) PEC at the end
+ * of a final write message, and sends one after a final read message.
+ * SMBus transactions follow I2C_PEC instead.
+ * 
+ * @param id Bus ID
+ * @param addr Slave address
+ * @param on Non-zero to enable PEC
+ * @return int 1 on success, -1 on error
+ */
+I2CBUS_API int i2cbus_sim_set_pec(int id, int addr, int on);
+/**
+ * @brief Make a slave NACK its address in the next count transactions
+ * addressed to it, like an EEPROM busy with a write cycle.
+ * 
+ * @param id Bus ID
+ * @param addr Slave address
+ * @param count Number of transactions to NACK
+ * @return int 1 on success, -1 on error
+ */
+I2CBUS_API int i2cbus_sim_set_busy(int id, int addr, int count);
+/**
+ * @brief Get the adapter timeout and retry count last set on a simulated
+ * bus with I2C_TIMEOUT and I2C_RETRIES.
+ * 
+ * @param id Bus ID
+ * @param timeout Pointer to store the timeout (10 ms units), may be NULL
+ * @param retries Pointer to store the retry count, may be NULL
+ * @return int 1 on success, -1 on error
+ */
+I2CBUS_API int i2cbus_sim_get_adapter(int id, unsigned long *timeout, unsigned long *retries);
+/**
+ * @brief Copy bytes into the registers of a simulated slave, bypassing the bus.
+ * 
+ * @param id Bus ID
+ * @param addr 7-bit slave address
+ * @param reg First register
+ * @param buf Bytes to store
+ * @param len Number of bytes
+ * @return int len on success, negative on error
+ */
+I2CBUS_API int i2cbus_sim_poke(int id, int addr, unsigned int reg, const void *buf, int len);
+/**
+ * @brief Copy bytes out of the registers of a simulated slave, bypassing the bus.
+ * 
+ * @param id Bus ID
+ * @param addr 7-bit slave address
+ * @param reg First register
+ * @param buf Buffer to copy to
+ * @param len Number of bytes
+ * @return int len on success, negative on error
+ */
+I2CBUS_API int i2cbus_sim_peek(int id, int addr, unsigned int reg, void *buf, int len);
+#ifdef __cplusplus 
+}
+#endif
+#endif
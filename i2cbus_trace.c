@@ -0,0 +1,208 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/i2c.h>
+#include "i2cbus_trace.h"
+#include "i2cbus_trace_priv.h"
+#include "i2cbus_log.h"
+
+#ifdef eprintf
+#undef eprintf
+#endif
+
+#define eprintf(str, ...) I2CBUS_LOG(str, ##__VA_ARGS__)
+
+#if (I2CBUS_TRACE_RING & (I2CBUS_TRACE_RING - 1)) != 0
+#error "I2CBUS_TRACE_RING must be a power of 2"
+#endif
+
+/**
+ * @brief Trace ring of one thread. Only the owning thread writes records;
+ * head is published with release ordering after each record, so at most
+ * one record (the one at index head) is being written at any time. When
+ * the owner exits the ring is marked free, and its records stay in the
+ * dumps until a new thread takes the ring over.
+ *
+ */
+struct trace_ring
+{
+    struct trace_ring *next;                   ///< Next ring in the registry
+    uint32_t tid;                              ///< Owning thread, protected by trace_rings_lock
+    int free;                                  ///< Non-zero once the owner has exited, protected by trace_rings_lock
+    uint64_t base;                             ///< head when the owner took the ring over, protected by trace_rings_lock
+    uint64_t head;                             ///< Number of records ever written
+    i2cbus_trace_rec recs[I2CBUS_TRACE_RING];  ///< Records, indexed by count modulo size
+};
+
+#ifdef I2C_DEBUG
+int i2cbus_trace_flag = 1;
+#else
+int i2cbus_trace_flag = 0;
+#endif
+
+static struct trace_ring *trace_rings = NULL; /// Registry of all rings, never freed but reused
+static pthread_mutex_t trace_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct trace_ring *trace_ring_self = NULL;
+static pthread_key_t trace_ring_key; /// Releases the ring of a thread when it exits
+static pthread_once_t trace_ring_key_once = PTHREAD_ONCE_INIT;
+static int trace_ring_key_status = -1; /// 0 once trace_ring_key is created
+
+void i2cbus_trace_enable(int on)
+{
+    __atomic_store_n(&i2cbus_trace_flag, on ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Mark the ring of an exiting thread free for the next new thread.
+ *
+ */
+static void trace_ring_release(void *arg)
+{
+    struct trace_ring *ring = arg;
+    pthread_mutex_lock(&trace_rings_lock);
+    ring->free = 1;
+    pthread_mutex_unlock(&trace_rings_lock);
+    // a transfer from a later thread-specific destructor takes a new ring
+    trace_ring_self = NULL;
+}
+
+static void trace_ring_key_create(void)
+{
+    trace_ring_key_status = pthread_key_create(&trace_ring_key, trace_ring_release);
+    if (trace_ring_key_status)
+        eprintf("Could not create trace ring key, error %d: rings of exited threads are not reused", trace_ring_key_status);
+}
+
+static struct trace_ring *trace_ring_get(void)
+{
+    struct trace_ring *ring = trace_ring_self;
+    if (ring != NULL)
+        return ring;
+    pthread_once(&trace_ring_key_once, trace_ring_key_create);
+    uint32_t tid = syscall(SYS_gettid);
+    // take over the ring of an exited thread, or add a new one
+    pthread_mutex_lock(&trace_rings_lock);
+    for (ring = trace_rings; ring != NULL && !ring->free; ring = ring->next)
+        ;
+    if (ring != NULL)
+    {
+        ring->free = 0;
+        ring->tid = tid;
+        ring->base = ring->head;
+    }
+    else if ((ring = calloc(1, sizeof(struct trace_ring))) != NULL)
+    {
+        ring->tid = tid;
+        ring->next = trace_rings;
+        trace_rings = ring;
+    }
+    pthread_mutex_unlock(&trace_rings_lock);
+    if (ring == NULL)
+        return NULL;
+    if (trace_ring_key_status == 0)
+        pthread_setspecific(trace_ring_key, ring);
+    trace_ring_self = ring;
+    return ring;
+}
+
+void i2cbus_trace_record(int bus, const struct i2c_msg *msgs, int nmsgs, int err,
+                         uint64_t ts_ns, uint64_t duration_ns)
+{
+    struct trace_ring *ring = trace_ring_get();
+    if (ring == NULL)
+        return;
+    uint64_t head = ring->head;
+    for (int i = 0; i < nmsgs; i++, head++)
+    {
+        i2cbus_trace_rec *rec = &(ring->recs[head & (I2CBUS_TRACE_RING - 1)]);
+        rec->ts_ns = ts_ns;
+        rec->duration_ns = duration_ns > UINT32_MAX ? UINT32_MAX : duration_ns;
+        rec->bus = bus;
+        rec->addr = msgs[i].addr;
+        rec->flags = msgs[i].flags;
+        rec->len = msgs[i].len;
+        rec->status = -err;
+        rec->msg = i;
+        rec->nmsgs = nmsgs;
+        int n = msgs[i].len < I2CBUS_TRACE_DATA ? msgs[i].len : I2CBUS_TRACE_DATA;
+        if (err != 0 && (msgs[i].flags & I2C_M_RD))
+            n = 0; // read buffer is not valid
+        memcpy(rec->data, msgs[i].buf, n);
+        memset(rec->data + n, 0, I2CBUS_TRACE_DATA - n);
+        __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+    }
+}
+
+int i2cbus_trace_dump(const char *path)
+{
+    if (path == NULL)
+    {
+        eprintf("Invalid path NULL");
+        return -1;
+    }
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL)
+    {
+        eprintf("Could not create %s, errno %d", path, errno);
+        return -1;
+    }
+    i2cbus_trace_rec *buf = malloc(sizeof(i2cbus_trace_rec) * I2CBUS_TRACE_RING);
+    if (buf == NULL)
+    {
+        eprintf("Could not allocate dump buffer");
+        fclose(fp);
+        return -2;
+    }
+    pthread_mutex_lock(&trace_rings_lock);
+    struct trace_ring *rings = trace_rings;
+    pthread_mutex_unlock(&trace_rings_lock);
+    i2cbus_trace_file_hdr hdr = {.magic = I2CBUS_TRACE_MAGIC, .version = I2CBUS_TRACE_VERSION, .rec_size = sizeof(i2cbus_trace_rec)};
+    for (struct trace_ring *ring = rings; ring != NULL; ring = ring->next)
+        hdr.nrings++;
+    int ret = 0;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+        ret = -1;
+    for (struct trace_ring *ring = rings; ret >= 0 && ring != NULL; ring = ring->next)
+    {
+        // copy the ring, then keep only records the writer can not have
+        // overwritten while we were copying. Records from before the
+        // current owner took the ring over are those of an exited thread.
+        pthread_mutex_lock(&trace_rings_lock);
+        uint32_t tid = ring->tid;
+        uint64_t base = ring->base;
+        uint64_t head = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+        pthread_mutex_unlock(&trace_rings_lock);
+        uint64_t first = head > I2CBUS_TRACE_RING ? head - I2CBUS_TRACE_RING : 0;
+        if (first < base)
+            first = base;
+        for (uint64_t i = first; i < head; i++)
+            buf[i - first] = ring->recs[i & (I2CBUS_TRACE_RING - 1)];
+        uint64_t now = __atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE);
+        uint64_t valid = now + 1 > I2CBUS_TRACE_RING ? now + 1 - I2CBUS_TRACE_RING : 0;
+        uint64_t skip = valid > first ? valid - first : 0;
+        if (skip > head - first)
+            skip = head - first;
+        i2cbus_trace_ring_hdr rhdr = {.tid = tid, .count = head - first - skip, .dropped = first - base + skip};
+        if (fwrite(&rhdr, sizeof(rhdr), 1, fp) != 1 ||
+            fwrite(buf + skip, sizeof(i2cbus_trace_rec), rhdr.count, fp) != rhdr.count)
+        {
+            ret = -1;
+            break;
+        }
+        ret += rhdr.count;
+    }
+    free(buf);
+    if (fclose(fp) != 0 || ret < 0)
+    {
+        eprintf("Failed to write %s, errno %d", path, errno);
+        return -1;
+    }
+    return ret;
+}
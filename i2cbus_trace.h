@@ -0,0 +1,92 @@
+/**
+ * @file i2cbus_trace.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Binary trace of bus transfers in per-thread lock-free rings.
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef __I2CBUS_TRACE_H
+#define __I2CBUS_TRACE_H
+#ifdef __cplusplus 
+extern "C" {
+#endif
+#include <stdint.h>
+#include "i2cbus_api.h"
+
+#ifndef I2CBUS_TRACE_RING
+#define I2CBUS_TRACE_RING 4096 ///< Records per thread ring (power of 2)
+#endif
+#define I2CBUS_TRACE_DATA 16          ///< Payload bytes kept per record
+#define I2CBUS_TRACE_MAGIC 0x4543415254433249ULL ///< "I2CTRACE", first word of a dump file
+#define I2CBUS_TRACE_VERSION 1        ///< Dump file format version
+
+/**
+ * @brief One message of a bus transfer. Messages of the same transfer
+ * share the timestamp and the duration.
+ * 
+ */
+typedef struct
+{
+    uint64_t ts_ns;                     ///< CLOCK_MONOTONIC time at the start of the transfer
+    uint32_t duration_ns;               ///< Duration of the transfer (saturated)
+    uint16_t bus;                       ///< Bus index
+    uint16_t addr;                      ///< Slave address
+    uint16_t flags;                     ///< I2C message flags (I2C_M_RD, ...)
+    uint16_t len;                       ///< Message length
+    int16_t status;                     ///< 0 on success, negative errno of the transfer on failure
+    uint8_t msg;                        ///< Index of the message in the transfer
+    uint8_t nmsgs;                      ///< Number of messages in the transfer
+    uint8_t data[I2CBUS_TRACE_DATA];    ///< First bytes of the message
+} i2cbus_trace_rec;
+
+/**
+ * @brief Dump file header, followed by the thread rings.
+ * 
+ */
+typedef struct
+{
+    uint64_t magic;    ///< I2CBUS_TRACE_MAGIC
+    uint32_t version;  ///< I2CBUS_TRACE_VERSION
+    uint32_t rec_size; ///< sizeof(i2cbus_trace_rec)
+    uint32_t nrings;   ///< Number of thread rings that follow
+    uint32_t reserved; ///< Zero
+} i2cbus_trace_file_hdr;
+
+/**
+ * @brief Header of a thread ring in a dump file, followed by count
+ * records in chronological order.
+ * 
+ */
+typedef struct
+{
+    uint32_t tid;      ///< Kernel thread ID of the recording thread
+    uint32_t count;    ///< Number of records that follow
+    uint64_t dropped;  ///< Records overwritten before the dump
+} i2cbus_trace_ring_hdr;
+
+/**
+ * @brief Turn transfer tracing on or off for all threads. Tracing is on
+ * from the start in builds with I2C_DEBUG defined. Each thread that
+ * records a transfer holds a ring of I2CBUS_TRACE_RING records, taken
+ * over from an exited thread where possible.
+ * 
+ * @param on Non-zero to record transfers
+ */
+I2CBUS_API void i2cbus_trace_enable(int on);
+/**
+ * @brief Write the contents of all thread rings, including those of
+ * exited threads, to a file. Decode it with i2cbus_trace_decode. The ring
+ * of an exited thread is reused by the next thread that records a
+ * transfer, which drops the records of the exited thread.
+ * 
+ * @param path File to create
+ * @return int Number of records written on success, negative on error
+ */
+I2CBUS_API int i2cbus_trace_dump(const char *path);
+#ifdef __cplusplus 
+}
+#endif
+#endif
@@ -0,0 +1,116 @@
+/**
+ * @file i2cbus_trace_decode.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Decode a trace dump written by i2cbus_trace_dump().
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ * Prints the records of all threads in chronological order, one message
+ * per line, with times relative to the first record.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/i2c.h>
+#include "i2cbus_trace.h"
+
+typedef struct
+{
+    uint32_t tid;
+    i2cbus_trace_rec rec;
+} entry_t;
+
+static int entry_cmp(const void *a, const void *b)
+{
+    const entry_t *x = a, *y = b;
+    if (x->rec.ts_ns != y->rec.ts_ns)
+        return x->rec.ts_ns < y->rec.ts_ns ? -1 : 1;
+    if (x->tid != y->tid)
+        return x->tid < y->tid ? -1 : 1;
+    return (int)x->rec.msg - (int)y->rec.msg;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <trace dump>\n", argv[0]);
+        return 1;
+    }
+    FILE *fp = fopen(argv[1], "rb");
+    if (fp == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    i2cbus_trace_file_hdr hdr;
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != I2CBUS_TRACE_MAGIC)
+    {
+        fprintf(stderr, "%s: not an i2cbus trace dump\n", argv[1]);
+        return 1;
+    }
+    if (hdr.version != I2CBUS_TRACE_VERSION || hdr.rec_size != sizeof(i2cbus_trace_rec))
+    {
+        fprintf(stderr, "%s: unsupported format version %u, record size %u\n", argv[1], hdr.version, hdr.rec_size);
+        return 1;
+    }
+    entry_t *entries = NULL;
+    size_t num = 0;
+    for (uint32_t r = 0; r < hdr.nrings; r++)
+    {
+        i2cbus_trace_ring_hdr rhdr;
+        if (fread(&rhdr, sizeof(rhdr), 1, fp) != 1)
+        {
+            fprintf(stderr, "%s: truncated at ring %u\n", argv[1], r);
+            break;
+        }
+        if (rhdr.dropped)
+            printf("# thread %u: %llu older records overwritten\n", rhdr.tid, (unsigned long long)rhdr.dropped);
+        entry_t *grown = realloc(entries, (num + rhdr.count) * sizeof(entry_t));
+        if (grown == NULL && num + rhdr.count > 0)
+        {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        entries = grown;
+        for (uint32_t i = 0; i < rhdr.count; i++, num++)
+        {
+            entries[num].tid = rhdr.tid;
+            if (fread(&(entries[num].rec), sizeof(i2cbus_trace_rec), 1, fp) != 1)
+            {
+                fprintf(stderr, "%s: truncated in ring %u\n", argv[1], r);
+                r = hdr.nrings;
+                break;
+            }
+        }
+    }
+    fclose(fp);
+    qsort(entries, num, sizeof(entry_t), entry_cmp);
+    uint64_t t0 = num ? entries[0].rec.ts_ns : 0;
+    for (size_t i = 0; i < num; i++)
+    {
+        i2cbus_trace_rec *rec = &(entries[i].rec);
+        uint64_t t = rec->ts_ns - t0;
+        printf("[%6llu.%09llu] tid %-6u bus %-3u 0x%02x %c %-4u %d/%d %8u ns ",
+               (unsigned long long)(t / 1000000000), (unsigned long long)(t % 1000000000),
+               entries[i].tid, rec->bus, rec->addr, (rec->flags & I2C_M_RD) ? 'R' : 'W', rec->len,
+               rec->msg + 1, rec->nmsgs, rec->duration_ns);
+        if (rec->status)
+            printf("error %d (%s)", -rec->status, strerror(-rec->status));
+        else
+            printf("ok   ");
+        int n = rec->len < I2CBUS_TRACE_DATA ? rec->len : I2CBUS_TRACE_DATA;
+        if (rec->status && (rec->flags & I2C_M_RD))
+            n = 0;
+        for (int j = 0; j < n; j++)
+            printf(" %02x", rec->data[j]);
+        if (n < rec->len && n > 0)
+            printf(" ...");
+        printf("\n");
+    }
+    free(entries);
+    return 0;
+}
@@ -0,0 +1,44 @@
+/**
+ * @file i2cbus_trace_priv.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Hooks used by i2cbus.c to record transfers. Not part of the API.
+ * @version 0.1
+ * @date 2026-10-16
+ * 
+ * @copyright Copyright (c) 2026
+ * 
+ */
+#ifndef __I2CBUS_TRACE_PRIV_H
+#define __I2CBUS_TRACE_PRIV_H
+#include <stdint.h>
+
+struct i2c_msg;
+
+/**
+ * @brief Non-zero while tracing is enabled.
+ * 
+ */
+extern int i2cbus_trace_flag;
+
+/**
+ * @brief Check whether transfers should be recorded.
+ * 
+ */
+static inline int i2cbus_trace_on(void)
+{
+    return __atomic_load_n(&i2cbus_trace_flag, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Record the messages of a transfer in the ring of the calling thread.
+ * 
+ * @param bus Bus index
+ * @param msgs Messages of the transfer
+ * @param nmsgs Number of messages
+ * @param err errno of the transfer, 0 on success
+ * @param ts_ns CLOCK_MONOTONIC time at the start of the transfer
+ * @param duration_ns Duration of the transfer
+ */
+void i2cbus_trace_record(int bus, const struct i2c_msg *msgs, int nmsgs, int err,
+                         uint64_t ts_ns, uint64_t duration_ns);
+#endif
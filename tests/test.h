@@ -0,0 +1,80 @@
+/**
+ * @file test.h
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Check macros and helpers shared by the tests run by make check.
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#ifndef __I2CBUS_TEST_H
+#define __I2CBUS_TEST_H
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+static int test_failed = 0; ///< Number of failed checks, updated from any thread
+
+/**
+ * @brief Check a condition, reporting it and counting a failure if it
+ * does not hold. Carries on with the test either way.
+ *
+ */
+#define CHECK(cond)                                                                      \
+    do                                                                                   \
+    {                                                                                    \
+        if (!(cond))                                                                     \
+        {                                                                                \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);     \
+            __atomic_fetch_add(&test_failed, 1, __ATOMIC_RELAXED);                       \
+        }                                                                                \
+    } while (0)
+
+/**
+ * @brief Run a test function and report whether its checks passed.
+ *
+ */
+#define TEST(fn)                                                                           \
+    do                                                                                     \
+    {                                                                                      \
+        int _before = __atomic_load_n(&test_failed, __ATOMIC_RELAXED);                     \
+        fn();                                                                              \
+        fprintf(stderr, "%s %s\n", __atomic_load_n(&test_failed, __ATOMIC_RELAXED) == _before ? "PASS" : "FAIL", #fn); \
+    } while (0)
+
+/**
+ * @brief Exit status of a test program.
+ *
+ * @return int 0 if every check passed, 1 otherwise
+ */
+static inline int test_result(void)
+{
+    return __atomic_load_n(&test_failed, __ATOMIC_RELAXED) ? 1 : 0;
+}
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ *
+ */
+static inline unsigned long long test_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Absolute CLOCK_MONOTONIC deadline usec microseconds from now.
+ *
+ */
+static inline struct timespec test_deadline(unsigned long usec)
+{
+    unsigned long long ns = test_now_ns() + usec * 1000ULL;
+    struct timespec ts = {.tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL};
+    return ts;
+}
+#endif // __I2CBUS_TEST_H
@@ -0,0 +1,273 @@
+/**
+ * @file test_fairlock.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Tests of the FIFO bus lock used in fair mode.
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include "test.h"
+#include "i2cbus.h"
+#include "i2cbus_sim.h"
+#include "i2cbus_fairlock_priv.h"
+
+#define NWAITERS 4
+
+static i2cbus_fairlock fl;
+static int order[NWAITERS]; ///< Waiter IDs in the order they got the lock
+static int norder;
+static int gate; ///< Non-zero while the first waiter must keep the lock
+
+typedef struct
+{
+    pthread_t thread;
+    int id;
+    unsigned long timeout_usec; ///< 0 to wait indefinitely
+    int ret;                    ///< Return value of i2cbus_fairlock_lock()
+} waiter_t;
+
+static void *waiter(void *arg)
+{
+    waiter_t *w = arg;
+    struct timespec deadline = test_deadline(w->timeout_usec);
+    w->ret = i2cbus_fairlock_lock(&fl, w->timeout_usec ? &deadline : NULL);
+    if (w->ret == 0)
+    {
+        order[norder++] = w->id;
+        while (__atomic_load_n(&gate, __ATOMIC_ACQUIRE))
+            usleep(100);
+        CHECK(i2cbus_fairlock_unlock(&fl) == 0);
+    }
+    return NULL;
+}
+
+static struct i2cbus_fairlock_waiter *queue_tail(void)
+{
+    pthread_mutex_lock(&(fl.qlock));
+    struct i2cbus_fairlock_waiter *tail = fl.tail;
+    pthread_mutex_unlock(&(fl.qlock));
+    return tail;
+}
+
+/**
+ * @brief Start a waiter and return once it has queued up, so that waiters
+ * started one after another are queued in that order.
+ *
+ */
+static void waiter_start(waiter_t *w, int id, unsigned long timeout_usec)
+{
+    struct i2cbus_fairlock_waiter *tail = queue_tail();
+    w->id = id;
+    w->timeout_usec = timeout_usec;
+    w->ret = -1;
+    CHECK(pthread_create(&(w->thread), NULL, waiter, w) == 0);
+    unsigned long long give_up = test_now_ns() + 2000000000ULL;
+    while (queue_tail() == tail && test_now_ns() < give_up)
+        usleep(100);
+    CHECK(queue_tail() != tail);
+}
+
+static void lock_reset(void)
+{
+    memset(&fl, 0, sizeof(fl));
+    CHECK(i2cbus_fairlock_init(&fl) == 0);
+    memset(order, 0, sizeof(order));
+    norder = 0;
+}
+
+static void lock_check_idle(void)
+{
+    CHECK(fl.state == 0);
+    CHECK(fl.owner == 0);
+    CHECK(fl.head == NULL && fl.tail == NULL);
+}
+
+static void *try_other(void *arg)
+{
+    int *ret = arg;
+    *ret = i2cbus_fairlock_trylock(&fl);
+    if (*ret == 0)
+        CHECK(i2cbus_fairlock_unlock(&fl) == 0);
+    return NULL;
+}
+
+static void *unlock_other(void *arg)
+{
+    int *ret = arg;
+    *ret = i2cbus_fairlock_unlock(&fl);
+    return NULL;
+}
+
+static int run_other(void *(*fn)(void *))
+{
+    pthread_t thread;
+    int ret = -1;
+    CHECK(pthread_create(&thread, NULL, fn, &ret) == 0);
+    pthread_join(thread, NULL);
+    return ret;
+}
+
+/**
+ * @brief Queued threads get the lock in arrival order, and the releasing
+ * thread cannot take it back ahead of them.
+ *
+ */
+static void test_fifo_handoff(void)
+{
+    waiter_t w[NWAITERS];
+    lock_reset();
+    CHECK(i2cbus_fairlock_lock(&fl, NULL) == 0);
+    __atomic_store_n(&gate, 1, __ATOMIC_RELEASE);
+    for (int i = 0; i < NWAITERS; i++)
+        waiter_start(&w[i], i + 1, 0);
+    CHECK(i2cbus_fairlock_unlock(&fl) == 0);
+    // handed over to the first waiter, which holds it until the gate opens
+    CHECK(i2cbus_fairlock_trylock(&fl) == EBUSY);
+    __atomic_store_n(&gate, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < NWAITERS; i++)
+    {
+        pthread_join(w[i].thread, NULL);
+        CHECK(w[i].ret == 0);
+    }
+    CHECK(norder == NWAITERS);
+    for (int i = 0; i < NWAITERS; i++)
+        CHECK(order[i] == i + 1);
+    lock_check_idle();
+}
+
+/**
+ * @brief The holder can take the lock again, and it is released by the
+ * matching number of unlocks, only by the holder.
+ *
+ */
+static void test_recursive(void)
+{
+    lock_reset();
+    CHECK(i2cbus_fairlock_unlock(&fl) == EPERM);
+    CHECK(i2cbus_fairlock_lock(&fl, NULL) == 0);
+    CHECK(i2cbus_fairlock_lock(&fl, NULL) == 0);
+    CHECK(i2cbus_fairlock_trylock(&fl) == 0);
+    CHECK(fl.depth == 3);
+    CHECK(run_other(try_other) == EBUSY);
+    CHECK(run_other(unlock_other) == EPERM);
+    CHECK(i2cbus_fairlock_unlock(&fl) == 0);
+    CHECK(i2cbus_fairlock_unlock(&fl) == 0);
+    CHECK(run_other(try_other) == EBUSY);
+    CHECK(i2cbus_fairlock_unlock(&fl) == 0);
+    lock_check_idle();
+    CHECK(run_other(try_other) == 0);
+    lock_check_idle();
+}
+
+/**
+ * @brief A queued timed lock gives up at its deadline, and the lock goes
+ * back to plain held so that the holder frees it on unlock.
+ *
+ */
+static void test_timeout_queued(void)
+{
+    waiter_t w;
+    lock_reset();
+    CHECK(i2cbus_fairlock_lock(&fl, NULL) == 0);
+    unsigned long long start = test_now_ns();
+    waiter_start(&w, 1, 20000);
+    pthread_join(w.thread, NULL);
+    CHECK(w.ret == ETIMEDOUT);
+    CHECK(test_now_ns() - start >= 20000000ULL);
+    CHECK(fl.state == 1);
+    CHECK(fl.head == NULL && fl.tail == NULL);
+    CHECK(norder == 0);
+    CHECK(i2cbus_fairlock_unlock(&fl) == 0);
+    lock_check_idle();
+}
+
+/**
+ * @brief A waiter that times out at the head, in the middle or at the
+ * tail of the queue leaves it, and the others get the lock in order.
+ *
+ */
+static void test_leave_queue(void)
+{
+    for (int leaver = 0; leaver < 3; leaver++)
+    {
+        waiter_t w[3];
+        lock_reset();
+        CHECK(i2cbus_fairlock_lock(&fl, NULL) == 0);
+        for (int i = 0; i < 3; i++)
+            waiter_start(&w[i], i + 1, i == leaver ? 20000 : 0);
+        pthread_join(w[leaver].thread, NULL);
+        CHECK(w[leaver].ret == ETIMEDOUT);
+        CHECK(fl.state == 2);
+        CHECK(i2cbus_fairlock_unlock(&fl) == 0);
+        int n = 0;
+        for (int i = 0; i < 3; i++)
+        {
+            if (i == leaver)
+                continue;
+            pthread_join(w[i].thread, NULL);
+            CHECK(w[i].ret == 0);
+            CHECK(order[n++] == i + 1);
+        }
+        CHECK(norder == 2);
+        lock_check_idle();
+    }
+}
+
+static void *bus_try_other(void *arg)
+{
+    int *ret = arg;
+    struct timespec deadline = test_deadline(20000);
+    ret[0] = i2cbus_trylock(40);
+    ret[1] = i2cbus_timedlock(40, &deadline);
+    if (ret[0] == 1)
+        i2cbus_unlock(40);
+    if (ret[1] == 1)
+        i2cbus_unlock(40);
+    return NULL;
+}
+
+/**
+ * @brief The bus lock functions on a bus created in fair mode.
+ *
+ */
+static void test_bus_fair(void)
+{
+    i2cbus dev;
+    unsigned char out = 0, in[2];
+    int ret[2];
+    pthread_t thread;
+    CHECK(i2cbus_set_lock_fair(1) == 1);
+    CHECK(i2cbus_sim_create(40, NULL) == 1);
+    CHECK(i2cbus_sim_add_device(40, 0x50, 8, 256) == 1);
+    CHECK(i2cbus_open_backend(&dev, 40, 0x50, &i2cbus_backend_sim) >= 0);
+    CHECK(i2cbus_set_lock_fair(0) == 1);
+    CHECK(i2cbus_lock(40) == 1);
+    CHECK(i2cbus_lock(40) == 1);
+    CHECK(i2cbus_xfer(&dev, &out, 1, in, 2, 0) == 2);
+    CHECK(pthread_create(&thread, NULL, bus_try_other, ret) == 0);
+    pthread_join(thread, NULL);
+    CHECK(ret[0] == -EBUSY);
+    CHECK(ret[1] == -ETIMEDOUT);
+    CHECK(i2cbus_unlock(40) == 1);
+    CHECK(i2cbus_unlock(40) == 1);
+    CHECK(i2cbus_unlock(40) == -EPERM);
+    CHECK(pthread_create(&thread, NULL, bus_try_other, ret) == 0);
+    pthread_join(thread, NULL);
+    CHECK(ret[0] == 1 && ret[1] == 1);
+    CHECK(i2cbus_close(&dev) == 0);
+}
+
+int main(void)
+{
+    TEST(test_fifo_handoff);
+    TEST(test_recursive);
+    TEST(test_timeout_queued);
+    TEST(test_leave_queue);
+    TEST(test_bus_fair);
+    return test_result();
+}
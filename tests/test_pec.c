@@ -0,0 +1,112 @@
+/**
+ * @file test_pec.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Tests of SMBus Packet Error Checking over plain I2C.
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include <errno.h>
+#include <string.h>
+#include "test.h"
+#include "i2cbus.h"
+#include "i2cbus_sim.h"
+
+/**
+ * @brief CRC-8 vectors: the standard check value, single bytes, a whole
+ * SMBus write byte data transaction, and updates in pieces.
+ *
+ */
+static void test_vectors(void)
+{
+    const unsigned char wire[3] = {0x50 << 1, 0x10, 0x55}; // address 0x50, write, command 0x10, data 0x55
+    CHECK(i2cbus_pec(0, "123456789", 9) == 0xf4);
+    CHECK(i2cbus_pec(0, "\x01", 1) == 0x07);
+    CHECK(i2cbus_pec(0, "\xff", 1) == 0xf3);
+    CHECK(i2cbus_pec(0, wire, 3) == 0xb3);
+    CHECK(i2cbus_pec(i2cbus_pec(0, wire, 1), wire + 1, 2) == 0xb3);
+    CHECK(i2cbus_pec(0x5a, wire, 0) == 0x5a);
+    // a message followed by its PEC sums to 0
+    unsigned char msg[4];
+    memcpy(msg, wire, 3);
+    msg[3] = i2cbus_pec(0, wire, 3);
+    CHECK(i2cbus_pec(0, msg, 4) == 0);
+}
+
+/**
+ * @brief Writes, reads and write-read transfers to a slave that checks
+ * and sends PEC bytes.
+ *
+ */
+static void test_transfers(void)
+{
+    i2cbus dev;
+    unsigned char out[3] = {0x20, 0xc0, 0xc1}, reg = 0x20, in[2] = {0}, mem[2];
+    CHECK(i2cbus_sim_create(30, NULL) == 1);
+    CHECK(i2cbus_sim_add_device(30, 0x50, 8, 256) == 1);
+    CHECK(i2cbus_sim_set_pec(30, 0x50, 1) == 1);
+    CHECK(i2cbus_open_backend(&dev, 30, 0x50, &i2cbus_backend_sim) >= 0);
+    dev.flags |= I2CBUS_FLAG_PEC;
+    // the slave NACKs a write with a bad PEC, so getting here means it matched
+    CHECK(i2cbus_write(&dev, out, 3) == 3);
+    CHECK(i2cbus_sim_peek(30, 0x50, 0x20, mem, 2) == 2);
+    CHECK(mem[0] == 0xc0 && mem[1] == 0xc1);
+    CHECK(i2cbus_write(&dev, &reg, 1) == 1);
+    CHECK(i2cbus_read(&dev, in, 2) == 2);
+    CHECK(in[0] == 0xc0 && in[1] == 0xc1);
+    memset(in, 0, sizeof(in));
+    CHECK(i2cbus_xfer(&dev, &reg, 1, in, 2, 0) == 2);
+    CHECK(in[0] == 0xc0 && in[1] == 0xc1);
+    memset(in, 0, sizeof(in));
+    dev.flags |= I2CBUS_FLAG_RDWR;
+    CHECK(i2cbus_xfer(&dev, &reg, 1, in, 2, 0) == 2);
+    CHECK(in[0] == 0xc0 && in[1] == 0xc1);
+    CHECK(i2cbus_close(&dev) == 0);
+}
+
+/**
+ * @brief A read whose last byte is not the PEC of the others fails with
+ * EBADMSG, leaves the buffer alone, and is counted.
+ *
+ */
+static void test_bad_pec(void)
+{
+    i2cbus dev;
+    i2cbus_stats stats;
+    unsigned char reg = 0x40, in[2] = {0xee, 0xee};
+    // without PEC, the slave sends the next register where the PEC should be
+    unsigned char mem[3] = {0x12, 0x34, 0};
+    unsigned char crc = i2cbus_pec(0, &(unsigned char){(0x51 << 1) | 1}, 1);
+    mem[2] = i2cbus_pec(crc, mem, 2) ^ 0xff;
+    CHECK(i2cbus_sim_create(31, NULL) == 1);
+    CHECK(i2cbus_sim_add_device(31, 0x51, 8, 256) == 1);
+    CHECK(i2cbus_sim_poke(31, 0x51, 0x40, mem, 3) == 3);
+    CHECK(i2cbus_open_backend(&dev, 31, 0x51, &i2cbus_backend_sim) >= 0);
+    CHECK(i2cbus_write(&dev, &reg, 1) == 1);
+    dev.flags |= I2CBUS_FLAG_PEC;
+    errno = 0;
+    CHECK(i2cbus_read(&dev, in, 2) == -1);
+    CHECK(errno == EBADMSG);
+    CHECK(in[0] == 0xee && in[1] == 0xee);
+    CHECK(i2cbus_get_stats(31, &stats) == 1);
+    CHECK(stats.pec_errors == 1);
+    // with the right PEC in place, the same read goes through
+    mem[2] ^= 0xff;
+    CHECK(i2cbus_sim_poke(31, 0x51, 0x42, &mem[2], 1) == 1);
+    dev.flags &= ~I2CBUS_FLAG_PEC;
+    CHECK(i2cbus_write(&dev, &reg, 1) == 1);
+    dev.flags |= I2CBUS_FLAG_PEC;
+    CHECK(i2cbus_read(&dev, in, 2) == 2);
+    CHECK(in[0] == 0x12 && in[1] == 0x34);
+    CHECK(i2cbus_close(&dev) == 0);
+}
+
+int main(void)
+{
+    TEST(test_vectors);
+    TEST(test_transfers);
+    TEST(test_bad_pec);
+    return test_result();
+}
@@ -0,0 +1,158 @@
+/**
+ * @file test_plan.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Tests of the read planner: merging registers into bursts.
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include <string.h>
+#include "test.h"
+#include "i2cbus.h"
+#include "i2cbus_sim.h"
+#include "i2cbus_plan.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+static i2cbus dev8, dev16;
+
+/**
+ * @brief Build a plan and check its bursts against start/count pairs.
+ *
+ */
+static void check_plan(const i2cbus_plan_config *cfg, const unsigned int *regs, int nregs,
+                       const unsigned int *spans, int nspans)
+{
+    i2cbus_plan plan;
+    int ret = i2cbus_plan_init(&plan, &dev8, cfg, regs, nregs);
+    CHECK(ret == nspans);
+    if (ret < 0)
+        return;
+    for (int i = 0; i < plan.nspans && i < nspans; i++)
+    {
+        if (plan.spans[i].start != spans[2 * i] || plan.spans[i].count != (int)spans[2 * i + 1])
+            fprintf(stderr, "burst %d: got 0x%x+%d, expected 0x%x+%u\n", i, plan.spans[i].start,
+                    plan.spans[i].count, spans[2 * i], spans[2 * i + 1]);
+        CHECK(plan.spans[i].start == spans[2 * i] && plan.spans[i].count == (int)spans[2 * i + 1]);
+    }
+    i2cbus_plan_free(&plan);
+}
+
+#define PLAN(cfg, regs, spans) check_plan(&(cfg), regs, ARRAY_SIZE(regs), spans, ARRAY_SIZE(spans) / 2)
+
+/**
+ * @brief Gaps are read through up to max_gap registers, by default the
+ * cost of starting a new burst, and bursts are split at max_burst.
+ *
+ */
+static void test_coalesce(void)
+{
+    // a new burst costs 3 bytes: 3 registers of 8 bits, 2 of 16 bits
+    i2cbus_plan_config cfg = {.reg_bits = 8, .val_bits = 8, .max_gap = -1};
+    const unsigned int r1[] = {0x10, 0x13, 0x20, 0x24, 0x29}, s1[] = {0x10, 4, 0x20, 5, 0x29, 1};
+    PLAN(cfg, r1, s1);
+    cfg.val_bits = 16;
+    const unsigned int r2[] = {0x10, 0x13, 0x20, 0x24}, s2[] = {0x10, 4, 0x20, 1, 0x24, 1};
+    PLAN(cfg, r2, s2);
+    const unsigned int r3[] = {0x10, 0x12, 0x15}, s3[] = {0x10, 6};
+    PLAN(cfg, r3, s3);
+    const unsigned int r9[] = {0x10, 0x12, 0x16}, s9[] = {0x10, 3, 0x16, 1};
+    PLAN(cfg, r9, s9);
+    // no gaps
+    cfg = (i2cbus_plan_config){.reg_bits = 8, .val_bits = 8, .max_gap = 0};
+    const unsigned int r4[] = {1, 2, 3, 5}, s4[] = {1, 3, 5, 1};
+    PLAN(cfg, r4, s4);
+    // unsorted and repeated registers
+    cfg.max_gap = 4;
+    const unsigned int r5[] = {0x30, 0x20, 0x24, 0x20, 0x29}, s5[] = {0x20, 10, 0x30, 1};
+    PLAN(cfg, r5, s5);
+    // default burst limit of 32, then a smaller one
+    unsigned int r6[40];
+    for (int i = 0; i < 40; i++)
+        r6[i] = i;
+    const unsigned int s6[] = {0, 32, 32, 8};
+    PLAN(cfg, r6, s6);
+    cfg.max_burst = 16;
+    const unsigned int s7[] = {0, 16, 16, 16, 32, 8};
+    PLAN(cfg, r6, s7);
+    // a gap does not stretch a burst past the limit
+    cfg.max_burst = 4;
+    const unsigned int r8[] = {0, 2, 4}, s8[] = {0, 3, 4, 1};
+    PLAN(cfg, r8, s8);
+}
+
+/**
+ * @brief Executing a plan puts every requested register in its slot,
+ * repeats and unrequested gap registers included.
+ *
+ */
+static void test_exec(void)
+{
+    i2cbus_plan plan;
+    i2cbus_plan_config cfg = {.reg_bits = 8, .val_bits = 8, .max_gap = -1};
+    const unsigned int regs[] = {0x42, 0x10, 0x12, 0x42, 0x80, 0x11};
+    unsigned char out[ARRAY_SIZE(regs)];
+    CHECK(i2cbus_plan_init(&plan, &dev8, &cfg, regs, ARRAY_SIZE(regs)) == 3);
+    memset(out, 0, sizeof(out));
+    CHECK(i2cbus_plan_exec(&plan, out) == 3);
+    for (size_t i = 0; i < ARRAY_SIZE(regs); i++)
+        CHECK(out[i] == regs[i]);
+    // a plan is reusable and reads the current values
+    CHECK(i2cbus_sim_poke(10, 0x50, 0x12, &(unsigned char){0xaa}, 1) == 1);
+    CHECK(i2cbus_plan_exec(&plan, out) == 3);
+    CHECK(out[2] == 0xaa && out[5] == 0x11);
+    i2cbus_plan_free(&plan);
+
+    // 16-bit register addresses, 16-bit values
+    cfg = (i2cbus_plan_config){.reg_bits = 16, .val_bits = 16, .max_gap = -1};
+    const unsigned int regs16[] = {0x2fe, 0x100, 0x102};
+    const unsigned char vals16[] = {0x12, 0x34, 0x56, 0x78, 0x9a, 0xbc, 0xde, 0xf0};
+    unsigned char out16[2 * ARRAY_SIZE(regs16)];
+    CHECK(i2cbus_sim_poke(11, 0x50, 0x100, vals16, 6) == 6);
+    CHECK(i2cbus_sim_poke(11, 0x50, 0x2fe, vals16 + 6, 2) == 2);
+    CHECK(i2cbus_plan_init(&plan, &dev16, &cfg, regs16, ARRAY_SIZE(regs16)) == 2);
+    CHECK(plan.spans[0].start == 0x100 && plan.spans[0].count == 3);
+    CHECK(i2cbus_plan_exec(&plan, out16) == 2);
+    // the simulated slave has byte registers: value n of a burst is at byte 2n
+    CHECK(out16[0] == 0xde && out16[1] == 0xf0);
+    CHECK(out16[2] == 0x12 && out16[3] == 0x34);
+    CHECK(out16[4] == 0x9a && out16[5] == 0xbc);
+    i2cbus_plan_free(&plan);
+}
+
+/**
+ * @brief Registers that do not fit the address width, and unsupported
+ * value widths, are refused.
+ *
+ */
+static void test_invalid(void)
+{
+    i2cbus_plan plan;
+    i2cbus_plan_config cfg = {.reg_bits = 8, .val_bits = 8};
+    const unsigned int regs[] = {0x10, 0x100};
+    CHECK(i2cbus_plan_init(&plan, &dev8, &cfg, regs, 2) == -1);
+    cfg.val_bits = 12;
+    CHECK(i2cbus_plan_init(&plan, &dev8, &cfg, regs, 1) == -1);
+}
+
+int main(void)
+{
+    unsigned char fill[256];
+    for (int i = 0; i < 256; i++)
+        fill[i] = i;
+    CHECK(i2cbus_sim_create(10, NULL) == 1);
+    CHECK(i2cbus_sim_add_device(10, 0x50, 8, 256) == 1);
+    CHECK(i2cbus_sim_poke(10, 0x50, 0, fill, 256) == 256);
+    CHECK(i2cbus_open_backend(&dev8, 10, 0x50, &i2cbus_backend_sim) >= 0);
+    CHECK(i2cbus_sim_create(11, NULL) == 1);
+    CHECK(i2cbus_sim_add_device(11, 0x50, 16, 1024) == 1);
+    CHECK(i2cbus_open_backend(&dev16, 11, 0x50, &i2cbus_backend_sim) >= 0);
+    TEST(test_coalesce);
+    TEST(test_exec);
+    TEST(test_invalid);
+    CHECK(i2cbus_close(&dev8) == 0);
+    CHECK(i2cbus_close(&dev16) == 0);
+    return test_result();
+}
@@ -0,0 +1,246 @@
+/**
+ * @file test_queue.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Tests of the asynchronous request queue and its worker thread.
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include <errno.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include "test.h"
+#include "i2cbus.h"
+#include "i2cbus_sim.h"
+
+#define NREQ 16
+#define NPRODUCERS 4
+#define NPERPRODUCER 200
+
+static const i2cbus_sim_timing timing = {.byte_ns = 20000, .xfer_ns = 5000};
+
+/**
+ * @brief Check whether the worker thread of a bus is alive, by its name.
+ *
+ */
+static int worker_alive(int bus)
+{
+    char name[16], path[300], comm[32];
+    snprintf(name, sizeof(name), "i2cbus-%d", bus);
+    int found = 0;
+    DIR *dir = opendir("/proc/self/task");
+    if (dir == NULL)
+        return -1;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL && !found)
+    {
+        if (ent->d_name[0] == '.')
+            continue;
+        snprintf(path, sizeof(path), "/proc/self/task/%s/comm", ent->d_name);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL)
+            continue;
+        if (fgets(comm, sizeof(comm), fp) != NULL)
+            found = strncmp(comm, name, strlen(name)) == 0 && (comm[strlen(name)] == '\n' || comm[strlen(name)] == '\0');
+        fclose(fp);
+    }
+    closedir(dir);
+    return found;
+}
+
+static void open_sim(i2cbus *dev, int bus, int addr)
+{
+    CHECK(i2cbus_sim_create(bus, &timing) == 1);
+    CHECK(i2cbus_sim_add_device(bus, addr, 8, 256) == 1);
+    CHECK(i2cbus_open_backend(dev, bus, addr, &i2cbus_backend_sim) >= 0);
+}
+
+static void req_read(i2cbus_req *req, i2cbus *dev, void *buf, int len)
+{
+    memset(req, 0, sizeof(*req));
+    req->dev = dev;
+    req->type = I2CBUS_REQ_READ;
+    req->prio = I2CBUS_PRIO_NORMAL;
+    req->inbuf = buf;
+    req->inlen = len;
+    req->efd = -1;
+}
+
+/**
+ * @brief Closing the last device runs the requests already queued for it,
+ * then stops the worker.
+ *
+ */
+static void test_close_last(void)
+{
+    i2cbus dev;
+    i2cbus_req req[NREQ];
+    unsigned char buf[NREQ][4];
+    open_sim(&dev, 41, 0x50);
+    for (int i = 0; i < NREQ; i++)
+    {
+        req_read(&req[i], &dev, buf[i], 4);
+        CHECK(i2cbus_submit(&req[i]) == 1);
+    }
+    CHECK(worker_alive(41) == 1);
+    CHECK(i2cbus_close(&dev) == 0);
+    for (int i = 0; i < NREQ; i++)
+    {
+        CHECK(i2cbus_req_done(&req[i]));
+        CHECK(req[i].status == 4);
+    }
+    CHECK(worker_alive(41) == 0);
+    // a new device on the bus gets a new worker
+    open_sim(&dev, 41, 0x50);
+    req_read(&req[0], &dev, buf[0], 2);
+    CHECK(i2cbus_submit(&req[0]) == 1);
+    CHECK(i2cbus_req_wait(&req[0]) == 2);
+    CHECK(i2cbus_close(&dev) == 0);
+    CHECK(worker_alive(41) == 0);
+}
+
+/**
+ * @brief Closing one of several devices on a bus runs its queued requests
+ * and leaves the worker to the others.
+ *
+ */
+static void test_close_one(void)
+{
+    i2cbus a, b;
+    i2cbus_req req[NREQ];
+    unsigned char buf[NREQ][4], out = 0, in[2];
+    open_sim(&a, 42, 0x50);
+    open_sim(&b, 42, 0x51);
+    for (int i = 0; i < NREQ; i++)
+    {
+        req_read(&req[i], &a, buf[i], 4);
+        req[i].prio = (i2cbus_req_prio)(i % I2CBUS_PRIO_CLASSES);
+        CHECK(i2cbus_submit(&req[i]) == 1);
+    }
+    CHECK(i2cbus_close(&a) == 0);
+    for (int i = 0; i < NREQ; i++)
+    {
+        CHECK(i2cbus_req_done(&req[i]));
+        CHECK(req[i].status == 4);
+    }
+    CHECK(worker_alive(42) == 1);
+    CHECK(i2cbus_xfer_prio(&b, I2CBUS_PRIO_NORMAL, &out, 1, in, 2, 0) == 2);
+    CHECK(i2cbus_close(&b) == 0);
+    CHECK(worker_alive(42) == 0);
+}
+
+static void close_cb(i2cbus_req *req)
+{
+    CHECK(i2cbus_close(req->dev) == 0);
+}
+
+/**
+ * @brief A device closed from a completion callback fails the requests it
+ * still has queued instead of running them on a closed bus.
+ *
+ */
+static void test_close_from_callback(void)
+{
+    i2cbus dev;
+    i2cbus_req req[4];
+    unsigned char buf[4][2];
+    open_sim(&dev, 43, 0x50);
+    // queue everything before the worker can run the first request
+    CHECK(i2cbus_lock(43) == 1);
+    for (int i = 0; i < 4; i++)
+    {
+        req_read(&req[i], &dev, buf[i], 2);
+        req[i].cb = i == 0 ? close_cb : NULL;
+        CHECK(i2cbus_submit(&req[i]) == 1);
+    }
+    CHECK(i2cbus_unlock(43) == 1);
+    CHECK(i2cbus_req_wait(&req[0]) == 2);
+    for (int i = 1; i < 4; i++)
+    {
+        CHECK(i2cbus_req_wait(&req[i]) == -1);
+        CHECK(req[i].err == EBADF);
+    }
+    CHECK(dev.fd < 0 && dev.bus == NULL);
+    unsigned long long give_up = test_now_ns() + 2000000000ULL;
+    while (worker_alive(43) && test_now_ns() < give_up)
+        usleep(100);
+    CHECK(worker_alive(43) == 0);
+}
+
+typedef struct
+{
+    pthread_t thread;
+    i2cbus *dev;
+    int id;
+    i2cbus_req req[NPERPRODUCER];
+    unsigned char buf[NPERPRODUCER][2];
+} producer_t;
+
+static int last_seq[NPRODUCERS]; ///< Sequence number of the last completed request of each producer
+static int out_of_order;
+
+static void seq_cb(i2cbus_req *req)
+{
+    // completion callbacks run one at a time on the worker
+    producer_t *p = req->arg;
+    int seq = (int)(req - p->req);
+    if (seq != last_seq[p->id] + 1)
+        out_of_order++;
+    last_seq[p->id] = seq;
+}
+
+static void *producer(void *arg)
+{
+    producer_t *p = arg;
+    for (int i = 0; i < NPERPRODUCER; i++)
+    {
+        req_read(&p->req[i], p->dev, p->buf[i], 2);
+        p->req[i].cb = seq_cb;
+        p->req[i].arg = p;
+        CHECK(i2cbus_submit(&p->req[i]) == 1);
+    }
+    for (int i = 0; i < NPERPRODUCER; i++)
+        CHECK(i2cbus_req_wait(&p->req[i]) == 2);
+    return NULL;
+}
+
+/**
+ * @brief Concurrent submitters lose no request, and the requests of each
+ * run in submission order within their class.
+ *
+ */
+static void test_producers(void)
+{
+    static producer_t p[NPRODUCERS];
+    i2cbus dev;
+    i2cbus_sim_timing fast = {0};
+    CHECK(i2cbus_sim_create(44, &fast) == 1);
+    CHECK(i2cbus_sim_add_device(44, 0x50, 8, 256) == 1);
+    CHECK(i2cbus_open_backend(&dev, 44, 0x50, &i2cbus_backend_sim) >= 0);
+    for (int i = 0; i < NPRODUCERS; i++)
+    {
+        p[i].dev = &dev;
+        p[i].id = i;
+        last_seq[i] = -1;
+        CHECK(pthread_create(&(p[i].thread), NULL, producer, &p[i]) == 0);
+    }
+    for (int i = 0; i < NPRODUCERS; i++)
+    {
+        pthread_join(p[i].thread, NULL);
+        CHECK(last_seq[i] == NPERPRODUCER - 1);
+    }
+    CHECK(out_of_order == 0);
+    CHECK(i2cbus_close(&dev) == 0);
+}
+
+int main(void)
+{
+    TEST(test_close_last);
+    TEST(test_close_one);
+    TEST(test_close_from_callback);
+    TEST(test_producers);
+    return test_result();
+}
@@ -0,0 +1,161 @@
+/**
+ * @file test_regmap.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Tests of the write-back cache of the register map.
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include <string.h>
+#include "test.h"
+#include "i2cbus.h"
+#include "i2cbus_sim.h"
+#include "i2cbus_regmap.h"
+
+#define BUS 20
+#define ADDR 0x50
+
+static const i2cbus_regmap_range volatile_ranges[] = {{0x30, 0x31}};
+static const i2cbus_regmap_range readonly_ranges[] = {{0x40, 0x40}};
+
+static i2cbus dev;
+static i2cbus_regmap map;
+
+/**
+ * @brief Open a fresh device and a write-back register map over it.
+ *
+ */
+static void map_open(int max_burst)
+{
+    i2cbus_regmap_config cfg = {
+        .reg_bits = 8,
+        .val_bits = 8,
+        .max_register = 0xff,
+        .volatile_ranges = volatile_ranges,
+        .num_volatile = 1,
+        .readonly_ranges = readonly_ranges,
+        .num_readonly = 1,
+        .cache_mode = I2CBUS_REGMAP_WRITE_BACK,
+        .max_burst = max_burst,
+    };
+    unsigned char zero[256] = {0};
+    CHECK(i2cbus_sim_poke(BUS, ADDR, 0, zero, 256) == 256);
+    CHECK(i2cbus_open_backend(&dev, BUS, ADDR, &i2cbus_backend_sim) >= 0);
+    CHECK(i2cbus_regmap_init(&map, &dev, &cfg) == 1);
+}
+
+static void map_close(void)
+{
+    i2cbus_regmap_free(&map);
+    CHECK(i2cbus_close(&dev) == 0);
+}
+
+static unsigned char peek(unsigned int reg)
+{
+    unsigned char val = 0xee;
+    CHECK(i2cbus_sim_peek(BUS, ADDR, reg, &val, 1) == 1);
+    return val;
+}
+
+static unsigned long long transactions(void)
+{
+    i2cbus_stats stats;
+    CHECK(i2cbus_get_stats(BUS, &stats) == 1);
+    return stats.transactions;
+}
+
+/**
+ * @brief Writes stay in the cache until a sync, which sends each run of
+ * consecutive dirty registers as one write, split at max_burst.
+ *
+ */
+static void test_write_back(void)
+{
+    unsigned int val;
+    map_open(2);
+    unsigned long long before = transactions();
+    for (unsigned int reg = 0x10; reg <= 0x12; reg++)
+        CHECK(i2cbus_regmap_write(&map, reg, reg + 0x80) == 1);
+    CHECK(i2cbus_regmap_write(&map, 0x20, 0xa5) == 1);
+    CHECK(transactions() == before);
+    CHECK(peek(0x10) == 0 && peek(0x20) == 0);
+    CHECK(i2cbus_regmap_read(&map, 0x11, &val) == 1);
+    CHECK(val == 0x91);
+    CHECK(transactions() == before);
+    // 0x10-0x11, 0x12 and 0x20
+    CHECK(i2cbus_regmap_sync(&map) == 3);
+    for (unsigned int reg = 0x10; reg <= 0x12; reg++)
+        CHECK(peek(reg) == reg + 0x80);
+    CHECK(peek(0x20) == 0xa5);
+    CHECK(peek(0x13) == 0);
+    // nothing left to write
+    before = transactions();
+    CHECK(i2cbus_regmap_sync(&map) == 0);
+    CHECK(i2cbus_regmap_write(&map, 0x20, 0xa5) == 1);
+    CHECK(i2cbus_regmap_sync(&map) == 0);
+    CHECK(transactions() == before);
+    map_close();
+
+    map_open(0);
+    for (unsigned int reg = 0x10; reg < 0x10 + 20; reg++)
+        CHECK(i2cbus_regmap_write(&map, reg, reg) == 1);
+    // the default burst is 16 registers
+    CHECK(i2cbus_regmap_sync(&map) == 2);
+    for (unsigned int reg = 0x10; reg < 0x10 + 20; reg++)
+        CHECK(peek(reg) == reg);
+    map_close();
+}
+
+/**
+ * @brief Volatile registers are written through and read from the device
+ * even in write-back mode, and read-only registers refuse writes.
+ *
+ */
+static void test_volatile(void)
+{
+    unsigned int val;
+    map_open(16);
+    CHECK(i2cbus_regmap_write(&map, 0x30, 0x5a) == 1);
+    CHECK(peek(0x30) == 0x5a);
+    CHECK(i2cbus_sim_poke(BUS, ADDR, 0x31, &(unsigned char){0x77}, 1) == 1);
+    CHECK(i2cbus_regmap_read(&map, 0x31, &val) == 1);
+    CHECK(val == 0x77);
+    CHECK(i2cbus_regmap_write(&map, 0x40, 1) == -2);
+    CHECK(i2cbus_regmap_sync(&map) == 0);
+    CHECK(peek(0x40) == 0);
+    map_close();
+}
+
+/**
+ * @brief A sync that fails keeps the registers dirty for the next one,
+ * and dropping the cache discards them.
+ *
+ */
+static void test_sync_failure(void)
+{
+    map_open(16);
+    CHECK(i2cbus_regmap_write(&map, 0x50, 0x11) == 1);
+    CHECK(i2cbus_regmap_write(&map, 0x60, 0x22) == 1);
+    CHECK(i2cbus_sim_set_busy(BUS, ADDR, 1) == 1);
+    CHECK(i2cbus_regmap_sync(&map) < 0);
+    CHECK(i2cbus_regmap_sync(&map) == 2);
+    CHECK(peek(0x50) == 0x11 && peek(0x60) == 0x22);
+
+    CHECK(i2cbus_regmap_write(&map, 0x70, 0x33) == 1);
+    i2cbus_regmap_cache_drop(&map);
+    CHECK(i2cbus_regmap_sync(&map) == 0);
+    CHECK(peek(0x70) == 0);
+    map_close();
+}
+
+int main(void)
+{
+    CHECK(i2cbus_sim_create(BUS, NULL) == 1);
+    CHECK(i2cbus_sim_add_device(BUS, ADDR, 8, 256) == 1);
+    TEST(test_write_back);
+    TEST(test_volatile);
+    TEST(test_sync_failure);
+    return test_result();
+}
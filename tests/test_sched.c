@@ -0,0 +1,198 @@
+/**
+ * @file test_sched.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Tests of the scheduling classes of the bus worker.
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include <errno.h>
+#include <string.h>
+#include "test.h"
+#include "i2cbus.h"
+#include "i2cbus_sim.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define NREQ 8
+
+static i2cbus dev, other;
+static i2cbus_req req[NREQ];
+static unsigned char buf[NREQ][2];
+static int order[NREQ]; ///< Requests in the order they completed
+static int norder;
+static int started, gate; ///< Handshake holding the worker in the callback of request 0
+
+static void order_cb(i2cbus_req *r)
+{
+    order[norder++] = (int)(r - req);
+}
+
+static void gate_cb(i2cbus_req *r)
+{
+    order_cb(r);
+    __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&gate, __ATOMIC_ACQUIRE))
+        usleep(100);
+}
+
+static void req_read(int i, i2cbus_req_prio prio)
+{
+    memset(&req[i], 0, sizeof(req[i]));
+    req[i].dev = &dev;
+    req[i].type = I2CBUS_REQ_READ;
+    req[i].prio = prio;
+    req[i].inbuf = buf[i];
+    req[i].inlen = 2;
+    req[i].cb = i == 0 ? gate_cb : order_cb;
+    req[i].efd = -1;
+}
+
+/**
+ * @brief Keep the worker busy with request 0 of class prio0, so that the
+ * requests submitted until queue_release() queue up behind it.
+ *
+ */
+static void queue_hold(i2cbus_req_prio prio0)
+{
+    norder = 0;
+    __atomic_store_n(&started, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&gate, 1, __ATOMIC_RELEASE);
+    req_read(0, prio0);
+    CHECK(i2cbus_submit(&req[0]) == 1);
+    while (!__atomic_load_n(&started, __ATOMIC_ACQUIRE))
+        usleep(100);
+}
+
+static void queue_release(int n)
+{
+    __atomic_store_n(&gate, 0, __ATOMIC_RELEASE);
+    for (int i = 0; i < n; i++)
+        CHECK(i2cbus_req_wait(&req[i]) == 2);
+    CHECK(norder == n);
+}
+
+static unsigned long long aged(void)
+{
+    i2cbus_stats stats;
+    CHECK(i2cbus_get_stats(12, &stats) == 1);
+    return stats.aged;
+}
+
+/**
+ * @brief Without aging, the worker runs realtime, then normal, then bulk
+ * requests, each class in submission order.
+ *
+ */
+static void test_strict(void)
+{
+    const i2cbus_req_prio prio[] = {I2CBUS_PRIO_NORMAL, I2CBUS_PRIO_BULK, I2CBUS_PRIO_NORMAL, I2CBUS_PRIO_BULK,
+                                    I2CBUS_PRIO_REALTIME, I2CBUS_PRIO_NORMAL, I2CBUS_PRIO_REALTIME};
+    const int expect[] = {0, 4, 6, 2, 5, 1, 3};
+    CHECK(i2cbus_set_bus_aging(12, 0) == 1);
+    unsigned long long before = aged();
+    queue_hold(prio[0]);
+    for (size_t i = 1; i < ARRAY_SIZE(prio); i++)
+    {
+        req_read(i, prio[i]);
+        CHECK(i2cbus_submit(&req[i]) == 1);
+    }
+    queue_release(ARRAY_SIZE(prio));
+    CHECK(memcmp(order, expect, sizeof(expect)) == 0);
+    CHECK(aged() == before);
+}
+
+/**
+ * @brief A bulk request that has waited two aging intervals runs before a
+ * realtime request submitted after it, and is counted as aged.
+ *
+ */
+static void test_aging(void)
+{
+    CHECK(i2cbus_set_bus_aging(12, 2000) == 1);
+    unsigned long long before = aged();
+    queue_hold(I2CBUS_PRIO_NORMAL);
+    req_read(1, I2CBUS_PRIO_BULK);
+    CHECK(i2cbus_submit(&req[1]) == 1);
+    usleep(6000);
+    req_read(2, I2CBUS_PRIO_REALTIME);
+    CHECK(i2cbus_submit(&req[2]) == 1);
+    req_read(3, I2CBUS_PRIO_NORMAL);
+    CHECK(i2cbus_submit(&req[3]) == 1);
+    queue_release(4);
+    for (int i = 0; i < 4; i++)
+        CHECK(order[i] == i);
+    CHECK(aged() == before + 1);
+    CHECK(i2cbus_set_bus_aging(12, I2CBUS_AGING_USEC) == 1);
+}
+
+static int same_ret, same_err, other_ret, sub_ret, wait_ret;
+static i2cbus_req inner;
+
+static void deadlock_cb(i2cbus_req *r)
+{
+    unsigned char out = 0, in[2];
+    (void)r;
+    errno = 0;
+    same_ret = i2cbus_xfer_prio(&dev, I2CBUS_PRIO_NORMAL, &out, 1, in, 2, 0);
+    same_err = errno;
+    other_ret = i2cbus_xfer_prio(&other, I2CBUS_PRIO_NORMAL, &out, 1, in, 2, 0);
+    memset(&inner, 0, sizeof(inner));
+    inner.dev = &dev;
+    inner.type = I2CBUS_REQ_READ;
+    inner.inbuf = buf[1];
+    inner.inlen = 2;
+    inner.efd = -1;
+    sub_ret = i2cbus_submit(&inner);
+    wait_ret = i2cbus_req_wait(&inner);
+}
+
+/**
+ * @brief A completion callback cannot wait for its own bus, which fails
+ * with -EDEADLK, but can wait for another bus and submit requests.
+ *
+ */
+static void test_deadlock(void)
+{
+    req_read(0, I2CBUS_PRIO_NORMAL);
+    req[0].cb = deadlock_cb;
+    CHECK(i2cbus_submit(&req[0]) == 1);
+    CHECK(i2cbus_req_wait(&req[0]) == 2);
+    CHECK(same_ret == -EDEADLK && same_err == EDEADLK);
+    CHECK(other_ret == 2);
+    CHECK(sub_ret == 1);
+    CHECK(wait_ret == -EDEADLK);
+    CHECK(i2cbus_req_wait(&inner) == 2);
+}
+
+/**
+ * @brief Invalid scheduling classes are refused.
+ *
+ */
+static void test_invalid(void)
+{
+    unsigned char out = 0, in[2];
+    req_read(0, (i2cbus_req_prio)I2CBUS_PRIO_CLASSES);
+    CHECK(i2cbus_submit(&req[0]) == -3);
+    CHECK(i2cbus_xfer_prio(&dev, (i2cbus_req_prio)-1, &out, 1, in, 2, 0) == -3);
+    CHECK(i2cbus_set_bus_aging(14, 0) == -100);
+}
+
+int main(void)
+{
+    const i2cbus_sim_timing timing = {.byte_ns = 20000, .xfer_ns = 5000};
+    CHECK(i2cbus_sim_create(12, &timing) == 1);
+    CHECK(i2cbus_sim_add_device(12, 0x50, 8, 256) == 1);
+    CHECK(i2cbus_open_backend(&dev, 12, 0x50, &i2cbus_backend_sim) >= 0);
+    CHECK(i2cbus_sim_create(13, NULL) == 1);
+    CHECK(i2cbus_sim_add_device(13, 0x50, 8, 256) == 1);
+    CHECK(i2cbus_open_backend(&other, 13, 0x50, &i2cbus_backend_sim) >= 0);
+    TEST(test_strict);
+    TEST(test_aging);
+    TEST(test_deadlock);
+    TEST(test_invalid);
+    CHECK(i2cbus_close(&dev) == 0);
+    CHECK(i2cbus_close(&other) == 0);
+    return test_result();
+}
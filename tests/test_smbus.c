@@ -0,0 +1,194 @@
+/**
+ * @file test_smbus.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Tests of the SMBus fallback for adapters without plain I2C.
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include <errno.h>
+#include <string.h>
+#include <linux/i2c.h>
+#include "test.h"
+#include "i2cbus.h"
+#include "i2cbus_sim.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define F_WB I2C_FUNC_SMBUS_WRITE_BYTE
+#define F_RB I2C_FUNC_SMBUS_READ_BYTE
+#define F_WBD I2C_FUNC_SMBUS_WRITE_BYTE_DATA
+#define F_RBD I2C_FUNC_SMBUS_READ_BYTE_DATA
+#define F_WWD I2C_FUNC_SMBUS_WRITE_WORD_DATA
+#define F_RWD I2C_FUNC_SMBUS_READ_WORD_DATA
+#define F_WIB I2C_FUNC_SMBUS_WRITE_I2C_BLOCK
+#define F_RIB I2C_FUNC_SMBUS_READ_I2C_BLOCK
+#define F_SMBUS (F_WB | F_RB | F_WBD | F_RBD | F_WWD | F_RWD | F_WIB | F_RIB)
+
+#define U I2CBUS_METHOD_UNSUPPORTED
+#define I2C I2CBUS_METHOD_I2C
+#define BYTE I2CBUS_METHOD_SMBUS_BYTE
+#define BYTE_DATA I2CBUS_METHOD_SMBUS_BYTE_DATA
+#define WORD_DATA I2CBUS_METHOD_SMBUS_WORD_DATA
+#define I2C_BLOCK I2CBUS_METHOD_SMBUS_I2C_BLOCK
+
+static const struct
+{
+    unsigned long funcs;
+    int outlen;
+    int inlen;
+    i2cbus_method method;
+} methods[] = {
+    // invalid lengths, whatever the adapter can do
+    {I2C_FUNC_I2C | F_SMBUS, -1, 1, U},
+    {I2C_FUNC_I2C | F_SMBUS, 1, -1, U},
+    {I2C_FUNC_I2C | F_SMBUS, 0, 0, U},
+    // plain I2C carries anything
+    {I2C_FUNC_I2C, 1, 0, I2C},
+    {I2C_FUNC_I2C, 0, 1, I2C},
+    {I2C_FUNC_I2C, 2, 300, I2C},
+    {I2C_FUNC_I2C | F_SMBUS, 1, 1, I2C},
+    // no functionality at all
+    {0, 1, 0, U},
+    {0, 0, 1, U},
+    {0, 1, 1, U},
+    // write only: command byte, then data
+    {F_SMBUS, 1, 0, BYTE},
+    {F_SMBUS & ~F_WB, 1, 0, U},
+    {F_SMBUS, 2, 0, BYTE_DATA},
+    {F_WIB, 2, 0, I2C_BLOCK},
+    {F_SMBUS & ~(F_WBD | F_WIB), 2, 0, U},
+    {F_SMBUS, 3, 0, WORD_DATA},
+    {F_WIB, 3, 0, I2C_BLOCK},
+    {F_SMBUS & ~(F_WWD | F_WIB), 3, 0, U},
+    {F_SMBUS, 4, 0, I2C_BLOCK},
+    {F_SMBUS, I2C_SMBUS_BLOCK_MAX + 1, 0, I2C_BLOCK},
+    {F_SMBUS, I2C_SMBUS_BLOCK_MAX + 2, 0, U},
+    {F_SMBUS & ~F_WIB, 4, 0, U},
+    // read without a command
+    {F_SMBUS, 0, 1, BYTE},
+    {F_SMBUS & ~F_RB, 0, 1, U},
+    {F_SMBUS, 0, 2, U},
+    // command, repeated start, read
+    {F_SMBUS, 1, 1, BYTE_DATA},
+    {F_RIB, 1, 1, I2C_BLOCK},
+    {F_SMBUS & ~(F_RBD | F_RIB), 1, 1, U},
+    {F_SMBUS, 1, 2, WORD_DATA},
+    {F_RIB, 1, 2, I2C_BLOCK},
+    {F_SMBUS & ~(F_RWD | F_RIB), 1, 2, U},
+    {F_SMBUS, 1, 3, I2C_BLOCK},
+    {F_SMBUS, 1, I2C_SMBUS_BLOCK_MAX, I2C_BLOCK},
+    {F_SMBUS, 1, I2C_SMBUS_BLOCK_MAX + 1, U},
+    {F_SMBUS & ~F_RIB, 1, 3, U},
+    // more than a command byte before a read has no SMBus equivalent
+    {F_SMBUS, 2, 1, U},
+    {F_SMBUS, 3, 2, U},
+};
+
+/**
+ * @brief i2cbus_select_method() against fake functionality masks, one
+ * case per branch.
+ *
+ */
+static void test_select_method(void)
+{
+    for (size_t i = 0; i < ARRAY_SIZE(methods); i++)
+    {
+        i2cbus_method method = i2cbus_select_method(methods[i].funcs, methods[i].outlen, methods[i].inlen);
+        if (method != methods[i].method)
+            fprintf(stderr, "case %zu: funcs 0x%08lx, %d/%d bytes: got %d, expected %d\n", i, methods[i].funcs,
+                    methods[i].outlen, methods[i].inlen, method, methods[i].method);
+        CHECK(method == methods[i].method);
+    }
+}
+
+/**
+ * @brief Open a device on a simulated bus that reports the given
+ * functionality, with registers 0 to 255 set to their own address.
+ *
+ */
+static void open_sim(i2cbus *dev, int bus, unsigned long funcs, int reg_bits)
+{
+    unsigned char fill[256];
+    for (int i = 0; i < 256; i++)
+        fill[i] = i;
+    CHECK(i2cbus_sim_create(bus, NULL) == 1);
+    CHECK(i2cbus_sim_set_funcs(bus, funcs) == 1);
+    CHECK(i2cbus_sim_add_device(bus, 0x50, reg_bits, 1024) == 1);
+    CHECK(i2cbus_sim_poke(bus, 0x50, 0, fill, 256) == 256);
+    CHECK(i2cbus_open_backend(dev, bus, 0x50, &i2cbus_backend_sim) >= 0);
+}
+
+/**
+ * @brief i2cbus_xfer_yield() on an SMBus-only adapter joins the phases
+ * into one transaction instead of failing the read after the write.
+ *
+ */
+static void test_xfer_yield(void)
+{
+    i2cbus dev;
+    unsigned char reg = 0x10, in[4] = {0};
+    const unsigned char expect[4] = {0x10, 0x11, 0x12, 0x13};
+    open_sim(&dev, 50, F_SMBUS, 8);
+    CHECK(i2cbus_xfer_yield(&dev, &reg, 1, in, 4, 1000) == 4);
+    CHECK(memcmp(in, expect, sizeof(in)) == 0);
+    reg = 0x20;
+    CHECK(i2cbus_xfer_yield(&dev, &reg, 1, in, 2, 1000) == 2);
+    CHECK(in[0] == 0x20 && in[1] == 0x21);
+    // no SMBus equivalent: fails without writing the command
+    unsigned char cmd[2] = {0x30, 0x31};
+    errno = 0;
+    CHECK(i2cbus_xfer_yield(&dev, cmd, 2, in, 1, 1000) == -1);
+    CHECK(errno == EOPNOTSUPP);
+    unsigned char reg30;
+    CHECK(i2cbus_sim_peek(50, 0x50, 0x30, &reg30, 1) == 1);
+    CHECK(reg30 == 0x30);
+    CHECK(i2cbus_close(&dev) == 0);
+}
+
+/**
+ * @brief i2cbus_read_reg() on SMBus-only adapters: 8-bit registers in
+ * block sized chunks, 16-bit registers by setting the pointer and
+ * receiving byte by byte, and EOPNOTSUPP where the adapter cannot.
+ *
+ */
+static void test_read_reg(void)
+{
+    i2cbus dev;
+    unsigned char buf[40], fill[8] = {0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7};
+    open_sim(&dev, 51, F_SMBUS, 8);
+    CHECK(i2cbus_read_reg(&dev, 0x10, 1, buf, 40) == 40);
+    for (int i = 0; i < 40; i++)
+        CHECK(buf[i] == 0x10 + i);
+    CHECK(i2cbus_close(&dev) == 0);
+
+    open_sim(&dev, 52, F_SMBUS, 16);
+    CHECK(i2cbus_sim_poke(52, 0x50, 0x2fe, fill, 8) == 8);
+    memset(buf, 0, sizeof(buf));
+    CHECK(i2cbus_read_reg(&dev, 0x2fe, 2, buf, 8) == 8);
+    CHECK(memcmp(buf, fill, 8) == 0);
+    CHECK(i2cbus_close(&dev) == 0);
+    // the pointer write goes out as an I2C block write without byte data
+    open_sim(&dev, 53, F_SMBUS & ~F_WBD, 16);
+    CHECK(i2cbus_sim_poke(53, 0x50, 0x2fe, fill, 8) == 8);
+    memset(buf, 0, sizeof(buf));
+    CHECK(i2cbus_read_reg(&dev, 0x2fe, 2, buf, 3) == 3);
+    CHECK(memcmp(buf, fill, 3) == 0);
+    CHECK(i2cbus_close(&dev) == 0);
+    // no receive byte, no 16-bit register reads
+    open_sim(&dev, 54, F_SMBUS & ~F_RB, 16);
+    errno = 0;
+    CHECK(i2cbus_read_reg(&dev, 0x2fe, 2, buf, 2) == -1);
+    CHECK(errno == EOPNOTSUPP);
+    CHECK(i2cbus_close(&dev) == 0);
+}
+
+int main(void)
+{
+    TEST(test_select_method);
+    TEST(test_xfer_yield);
+    TEST(test_read_reg);
+    return test_result();
+}
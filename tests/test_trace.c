@@ -0,0 +1,206 @@
+/**
+ * @file test_trace.c
+ * @author Sunip K. Mukherjee (sunipkmukherjee@gmail.com)
+ * @brief Tests of the per-thread transfer trace rings.
+ * @version 0.1
+ * @date 2026-10-16
+ *
+ * @copyright Copyright (c) 2026
+ *
+ */
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "test.h"
+#include "i2cbus.h"
+#include "i2cbus_sim.h"
+#include "i2cbus_trace.h"
+
+#define MAX_RINGS 64
+#define NSEQ 20
+#define NLIVE 3
+#define NXFER 3
+
+/**
+ * @brief A thread ring read back from a dump.
+ *
+ */
+typedef struct
+{
+    i2cbus_trace_ring_hdr hdr;
+    unsigned char tag[I2CBUS_TRACE_RING]; ///< First data byte of each record
+} ring_t;
+
+static ring_t rings[MAX_RINGS];
+static i2cbus dev;
+static char path[64];
+
+/**
+ * @brief Dump the trace and read it back.
+ *
+ * @return int Number of rings, -1 on error
+ */
+static int dump(void)
+{
+    CHECK(i2cbus_trace_dump(path) >= 0);
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return -1;
+    i2cbus_trace_file_hdr hdr;
+    int n = -1;
+    if (fread(&hdr, sizeof(hdr), 1, fp) == 1 && hdr.magic == I2CBUS_TRACE_MAGIC && hdr.nrings <= MAX_RINGS)
+    {
+        n = hdr.nrings;
+        for (int i = 0; i < n && n >= 0; i++)
+        {
+            if (fread(&(rings[i].hdr), sizeof(rings[i].hdr), 1, fp) != 1)
+            {
+                n = -1;
+                break;
+            }
+            for (uint32_t j = 0; j < rings[i].hdr.count; j++)
+            {
+                i2cbus_trace_rec rec;
+                if (fread(&rec, sizeof(rec), 1, fp) != 1)
+                {
+                    n = -1;
+                    break;
+                }
+                rings[i].tag[j] = rec.data[0];
+            }
+        }
+    }
+    fclose(fp);
+    return n;
+}
+
+static ring_t *ring_of(uint32_t tid, int nrings)
+{
+    for (int i = 0; i < nrings; i++)
+    {
+        if (rings[i].hdr.tid == tid)
+            return &rings[i];
+    }
+    return NULL;
+}
+
+typedef struct
+{
+    pthread_t thread;
+    pthread_barrier_t *barrier; ///< Keeps the threads alive together, NULL for none
+    unsigned char tag;
+    uint32_t tid;
+} tracer_t;
+
+static void *tracer(void *arg)
+{
+    tracer_t *t = arg;
+    unsigned char buf[2] = {t->tag, 0};
+    t->tid = syscall(SYS_gettid);
+    for (int i = 0; i < NXFER; i++)
+        CHECK(i2cbus_write(&dev, buf, 2) == 2);
+    if (t->barrier != NULL)
+        pthread_barrier_wait(t->barrier);
+    return NULL;
+}
+
+/**
+ * @brief Threads that come and go one after another share one ring, and
+ * the records of the last one stay readable after it exited.
+ *
+ */
+static void test_reuse(void)
+{
+    tracer_t t[NSEQ];
+    unsigned char buf[2] = {0xee, 0};
+    CHECK(i2cbus_write(&dev, buf, 2) == 2);
+    for (int i = 0; i < NSEQ; i++)
+    {
+        t[i].barrier = NULL;
+        t[i].tag = i;
+        CHECK(pthread_create(&(t[i].thread), NULL, tracer, &t[i]) == 0);
+        pthread_join(t[i].thread, NULL);
+    }
+    int n = dump();
+    CHECK(n == 2);
+    ring_t *last = ring_of(t[NSEQ - 1].tid, n);
+    CHECK(last != NULL);
+    if (last != NULL)
+    {
+        CHECK(last->hdr.count == NXFER && last->hdr.dropped == 0);
+        for (uint32_t j = 0; j < last->hdr.count; j++)
+            CHECK(last->tag[j] == NSEQ - 1);
+    }
+    ring_t *self = ring_of(syscall(SYS_gettid), n);
+    CHECK(self != NULL && self->hdr.count == 1 && self->tag[0] == 0xee);
+}
+
+/**
+ * @brief Threads alive at the same time each get a ring of their own.
+ *
+ */
+static void test_live(void)
+{
+    tracer_t t[NLIVE];
+    pthread_barrier_t barrier;
+    pthread_barrier_init(&barrier, NULL, NLIVE);
+    for (int i = 0; i < NLIVE; i++)
+    {
+        t[i].barrier = &barrier;
+        t[i].tag = 0x80 + i;
+        CHECK(pthread_create(&(t[i].thread), NULL, tracer, &t[i]) == 0);
+    }
+    for (int i = 0; i < NLIVE; i++)
+        pthread_join(t[i].thread, NULL);
+    pthread_barrier_destroy(&barrier);
+    int n = dump();
+    CHECK(n == 1 + NLIVE);
+    for (int i = 0; i < NLIVE; i++)
+    {
+        ring_t *ring = ring_of(t[i].tid, n);
+        CHECK(ring != NULL);
+        if (ring == NULL)
+            continue;
+        CHECK(ring->hdr.count == NXFER);
+        for (uint32_t j = 0; j < ring->hdr.count; j++)
+            CHECK(ring->tag[j] == 0x80 + i);
+    }
+}
+
+/**
+ * @brief Bus workers started and stopped by open, submit and close cycles
+ * do not add a ring each.
+ *
+ */
+static void test_worker_cycles(void)
+{
+    int before = dump();
+    for (int i = 0; i < NSEQ; i++)
+    {
+        i2cbus d;
+        unsigned char out = 0, in[2];
+        CHECK(i2cbus_open_backend(&d, 61, 0x50, &i2cbus_backend_sim) >= 0);
+        CHECK(i2cbus_xfer_prio(&d, I2CBUS_PRIO_NORMAL, &out, 1, in, 2, 0) == 2);
+        CHECK(i2cbus_close(&d) == 0);
+    }
+    CHECK(dump() == before);
+}
+
+int main(void)
+{
+    snprintf(path, sizeof(path), "/tmp/i2cbus_test_trace.%d", (int)getpid());
+    i2cbus_trace_enable(1);
+    CHECK(i2cbus_sim_create(60, NULL) == 1);
+    CHECK(i2cbus_sim_add_device(60, 0x50, 8, 256) == 1);
+    CHECK(i2cbus_open_backend(&dev, 60, 0x50, &i2cbus_backend_sim) >= 0);
+    CHECK(i2cbus_sim_create(61, NULL) == 1);
+    CHECK(i2cbus_sim_add_device(61, 0x50, 8, 256) == 1);
+    TEST(test_reuse);
+    TEST(test_live);
+    TEST(test_worker_cycles);
+    CHECK(i2cbus_close(&dev) == 0);
+    unlink(path);
+    return test_result();
+}